@@ -0,0 +1,1265 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Benchmarks for ZP7. These aren't built with any particular instruction set,
+// so pass the same HAS_* defines (and compiler flags) as the target, e.g.:
+//
+//     cc -O3 -march=native -DHAS_CLMUL -DHAS_BZHI -DHAS_POPCNT -pthread
+//         bench.c -o bench
+//
+// Run with no arguments to run every benchmark, or with any number of names
+// to only run benchmarks whose name contains one of them.
+
+// For pinning threads in zp7_parallel.c
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "zp7.c"
+#include "zp7_parallel.c"
+#include "zp7_roaring.c"
+#include "zp7_wavelet.c"
+#include "zp7_sort.c"
+#include "zp7_scan.c"
+#include "zp7_bitshuffle.c"
+#include "zp7_bitio.c"
+#include "zp7_pixel.c"
+#include "zp7_dna.c"
+
+#define ARRAY_SIZE(a)       (sizeof(a) / sizeof((a)[0]))
+
+#define N_ITERS             (1 << 24)
+
+// Same PRNG as test.c
+typedef struct {
+    uint64_t a, b, c, d;
+} rand_ctx_t;
+
+uint64_t rotate_left(uint64_t x, uint64_t k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+uint64_t rand_next(rand_ctx_t *x) {
+    uint64_t e = x->a - rotate_left(x->b, 7);
+    x->a = x->b ^ rotate_left(x->c, 13);
+    x->b = x->c + rotate_left(x->d, 37);
+    x->c = x->d + e;
+    x->d = e + x->a;
+    return x->d;
+}
+
+void rand_init(rand_ctx_t *x) {
+    x->a = 0x89ABCDEF01234567ULL, x->b = x->c = x->d = 0xFEDCBA9876543210ULL;
+    for (int i = 0; i < 1000; i++)
+        (void)rand_next(x);
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Keep the compiler from throwing away benchmark results
+volatile uint64_t sink;
+
+void report(const char *name, double ns, double n_ops) {
+    printf("%-40s %8.2f ns/op\n", name, ns / n_ops);
+}
+
+// For benchmarks where throughput is more natural
+void report_rate(const char *name, double ns, double n_bytes) {
+    printf("%-40s %8.2f GB/s\n", name, n_bytes / ns);
+}
+
+// Random masks, shared by the benchmarks
+uint64_t bench_masks[1 << 10];
+
+// PPP
+
+// Fold the PPP values into one word, so benchmarks can depend on them
+static inline uint64_t ppp_fold(zp7_masks_64_t p) {
+#ifdef ZP7_32BIT
+    return p.ppp_bit_32[0][0] ^ p.ppp_bit_32[1][N_BITS - 2];
+#else
+    return p.ppp_bit[0] ^ p.ppp_bit[N_BITS - 1];
+#endif
+}
+
+// Latency: each mask depends on the PPP of the previous one
+#define BENCH_PPP_LATENCY(name, fn)                                         \
+    do {                                                                    \
+        uint64_t m = bench_masks[0];                                        \
+        double start = now_ns();                                            \
+        for (int i = 0; i < N_ITERS; i++) {                                 \
+            zp7_masks_64_t p = fn(m);                                       \
+            m ^= ppp_fold(p) ^ i;                                           \
+        }                                                                   \
+        report(name, now_ns() - start, N_ITERS);                            \
+        sink = m;                                                           \
+    } while (0)
+
+// Throughput: independent masks
+#define BENCH_PPP_THROUGHPUT(name, fn)                                      \
+    do {                                                                    \
+        uint64_t sum = 0;                                                   \
+        double start = now_ns();                                            \
+        for (int i = 0; i < N_ITERS; i++) {                                 \
+            zp7_masks_64_t p = fn(bench_masks[i % ARRAY_SIZE(bench_masks)]);\
+            sum += ppp_fold(p);                                             \
+        }                                                                   \
+        report(name, now_ns() - start, N_ITERS);                            \
+        sink = sum;                                                         \
+    } while (0)
+
+// Latency of a scalar helper, as EXPR of the previous result X
+#define BENCH_OP_LATENCY(name, expr)                                        \
+    do {                                                                    \
+        uint64_t x = bench_masks[0];                                        \
+        double start = now_ns();                                            \
+        for (int i = 0; i < N_ITERS; i++)                                   \
+            x = (expr) ^ i;                                                 \
+        report(name, now_ns() - start, N_ITERS);                            \
+        sink = x;                                                           \
+    } while (0)
+
+void bench_ppp() {
+    // The instructions behind the PPP and the PDEP popcount, against the
+    // portable code, for the targets where they're intrinsics or assembly
+#if !defined(HAS_POPCNT) && (defined(HAS_NEON) || defined(HAS_ZBB))
+    BENCH_OP_LATENCY("popcnt latency: popcnt", popcnt(x) + x);
+    BENCH_OP_LATENCY("popcnt latency: portable", popcnt_64(x) + x);
+#endif
+#if defined(HAS_PMULL) || defined(HAS_ZBC)
+    BENCH_OP_LATENCY("prefix xor latency: clmul_64", clmul_64(x, -2LL));
+    BENCH_OP_LATENCY("prefix xor latency: portable", prefix_sum(x) << 1);
+#endif
+    BENCH_PPP_LATENCY("ppp latency: zp7_ppp_64", zp7_ppp_64);
+#ifndef ZP7_32BIT
+    BENCH_PPP_LATENCY("ppp latency: serial", zp7_ppp_serial_64);
+    BENCH_PPP_LATENCY("ppp latency: bytewise", zp7_ppp_bytewise_64);
+#endif
+    BENCH_PPP_THROUGHPUT("ppp throughput: zp7_ppp_64", zp7_ppp_64);
+#ifndef ZP7_32BIT
+    BENCH_PPP_THROUGHPUT("ppp throughput: serial", zp7_ppp_serial_64);
+    BENCH_PPP_THROUGHPUT("ppp throughput: bytewise", zp7_ppp_bytewise_64);
+#endif
+}
+
+// Bulk same-mask PEXT/PDEP, reported per word
+
+#define N_ARRAY_WORDS       (1 << 12)
+
+uint64_t array_src[N_ARRAY_WORDS], array_dst[N_ARRAY_WORDS];
+
+#define BENCH_ARRAY(name, fn, masks)                                        \
+    do {                                                                    \
+        int reps = N_ITERS / N_ARRAY_WORDS;                                 \
+        double start = now_ns();                                            \
+        for (int i = 0; i < reps; i++) {                                    \
+            fn(array_dst, array_src, N_ARRAY_WORDS, masks);                 \
+            /* Make each rep depend on the last, so none get optimized */  \
+            array_src[i % N_ARRAY_WORDS] ^= array_dst[N_ARRAY_WORDS - 1];   \
+        }                                                                   \
+        report(name, now_ns() - start, (double)reps * N_ARRAY_WORDS);       \
+        sink = array_dst[0];                                                \
+    } while (0)
+
+// The scalar functions in a loop, for comparison against the bulk ones
+void pext_loop(uint64_t *dst, const uint64_t *src, size_t n,
+        const zp7_masks_64_t *masks) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = zp7_pext_pre_64(src[i], masks);
+}
+
+void pdep_loop(uint64_t *dst, const uint64_t *src, size_t n,
+        const zp7_masks_64_t *masks) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = zp7_pdep_pre_64(src[i], masks);
+}
+
+// Merging PDEP by hand, with a separate AND/OR after each deposit
+void pdep_merge_loop(uint64_t *dst, const uint64_t *src, size_t n,
+        const zp7_masks_64_t *masks) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = (dst[i] & ~masks->mask) | zp7_pdep_pre_64(src[i], masks);
+}
+
+void bench_array() {
+    for (int i = 0; i < N_ARRAY_WORDS; i++)
+        array_src[i] = bench_masks[i % ARRAY_SIZE(bench_masks)] * (i + 1);
+
+    zp7_masks_64_t masks = zp7_ppp_64(bench_masks[0]);
+    BENCH_ARRAY("array pext: scalar loop", pext_loop, &masks);
+    BENCH_ARRAY("array pext: zp7_pext_pre_array_64", zp7_pext_pre_array_64,
+            &masks);
+    BENCH_ARRAY("array pdep: scalar loop", pdep_loop, &masks);
+    BENCH_ARRAY("array pdep: zp7_pdep_pre_array_64", zp7_pdep_pre_array_64,
+            &masks);
+    BENCH_ARRAY("array merge: scalar loop", pdep_merge_loop, &masks);
+    BENCH_ARRAY("array merge: zp7_pdep_merge_pre_array_64",
+            zp7_pdep_merge_pre_array_64, &masks);
+}
+
+// PEXT/PDEP with a different mask for each word, reported per word
+
+uint64_t array_mask[N_ARRAY_WORDS];
+
+#define BENCH_MASKS_ARRAY(name, fn)                                         \
+    do {                                                                    \
+        int reps = N_ITERS / N_ARRAY_WORDS;                                 \
+        double start = now_ns();                                            \
+        for (int i = 0; i < reps; i++) {                                    \
+            fn(array_dst, array_src, array_mask, N_ARRAY_WORDS);            \
+            array_src[i % N_ARRAY_WORDS] ^= array_dst[N_ARRAY_WORDS - 1];   \
+        }                                                                   \
+        report(name, now_ns() - start, (double)reps * N_ARRAY_WORDS);       \
+        sink = array_dst[0];                                                \
+    } while (0)
+
+void pext_masks_loop(uint64_t *dst, const uint64_t *src, const uint64_t *mask,
+        size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = zp7_pext_64(src[i], mask[i]);
+}
+
+void pdep_masks_loop(uint64_t *dst, const uint64_t *src, const uint64_t *mask,
+        size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = zp7_pdep_64(src[i], mask[i]);
+}
+
+void bench_batch() {
+    for (int i = 0; i < N_ARRAY_WORDS; i++) {
+        array_src[i] = bench_masks[i % ARRAY_SIZE(bench_masks)] * (i + 1);
+        array_mask[i] = bench_masks[(i * 7) % ARRAY_SIZE(bench_masks)];
+    }
+    BENCH_MASKS_ARRAY("batch pext: scalar loop", pext_masks_loop);
+    BENCH_MASKS_ARRAY("batch pext: zp7_pext_array_64", zp7_pext_array_64);
+    BENCH_MASKS_ARRAY("batch pdep: scalar loop", pdep_masks_loop);
+    BENCH_MASKS_ARRAY("batch pdep: zp7_pdep_array_64", zp7_pdep_array_64);
+}
+
+// Single-word PEXT/PDEP with precomputed masks. For latency, each input
+// depends on the previous result; for throughput, the inputs are independent.
+
+#define BENCH_PRE_LATENCY(name, fn, masks)                                  \
+    do {                                                                    \
+        uint64_t a = bench_masks[1];                                        \
+        double start = now_ns();                                            \
+        for (int i = 0; i < N_ITERS; i++)                                   \
+            a = fn(a ^ i, masks);                                           \
+        report(name, now_ns() - start, N_ITERS);                            \
+        sink = a;                                                           \
+    } while (0)
+
+#define BENCH_PRE_THROUGHPUT(name, fn, masks)                               \
+    do {                                                                    \
+        uint64_t sum = 0;                                                   \
+        double start = now_ns();                                            \
+        for (int i = 0; i < N_ITERS; i++)                                   \
+            sum += fn(bench_masks[i % ARRAY_SIZE(bench_masks)], masks);     \
+        report(name, now_ns() - start, N_ITERS);                            \
+        sink = sum;                                                         \
+    } while (0)
+
+// Merging PDEP, with the input as the destination too, so latency includes
+// both
+static inline uint64_t pdep_then_merge(uint64_t a, const zp7_masks_64_t *masks) {
+    return (a & ~masks->mask) | zp7_pdep_pre_64(a, masks);
+}
+
+static inline uint64_t merge_into_input(uint64_t a,
+        const zp7_masks_64_t *masks) {
+    return zp7_pdep_merge_pre_64(a, a, masks);
+}
+
+// MSB-aligned results the long way, for comparison with the MSB variants
+static inline uint64_t pext_then_shift(uint64_t a, const zp7_masks_64_t *masks) {
+    return zp7_pext_pre_64(a, masks) << (64 - popcnt(masks->mask));
+}
+
+static inline uint64_t shift_then_pdep(uint64_t a, const zp7_masks_64_t *masks) {
+    return zp7_pdep_pre_64(a >> (64 - popcnt(masks->mask)), masks);
+}
+
+void bench_pre() {
+    zp7_masks_64_t masks = zp7_ppp_64(bench_masks[0]);
+    zp7_msb_masks_64_t msb_masks = zp7_ppp_msb_64(bench_masks[0]);
+    BENCH_PRE_LATENCY("pre latency: zp7_pext_pre_64", zp7_pext_pre_64,
+            &masks);
+    BENCH_PRE_LATENCY("pre latency: zp7_pdep_pre_64", zp7_pdep_pre_64,
+            &masks);
+    BENCH_PRE_THROUGHPUT("pre throughput: zp7_pext_pre_64", zp7_pext_pre_64,
+            &masks);
+    BENCH_PRE_THROUGHPUT("pre throughput: zp7_pdep_pre_64", zp7_pdep_pre_64,
+            &masks);
+
+    BENCH_PRE_LATENCY("merge latency: pdep + and/or", pdep_then_merge,
+            &masks);
+    BENCH_PRE_LATENCY("merge latency: zp7_pdep_merge_pre_64",
+            merge_into_input, &masks);
+
+    BENCH_PRE_LATENCY("msb latency: pext + shift", pext_then_shift, &masks);
+    BENCH_PRE_LATENCY("msb latency: zp7_pext_msb_pre_64",
+            zp7_pext_msb_pre_64, &msb_masks);
+    BENCH_PRE_LATENCY("msb latency: shift + pdep", shift_then_pdep, &masks);
+    BENCH_PRE_LATENCY("msb latency: zp7_pdep_msb_pre_64",
+            zp7_pdep_msb_pre_64, &msb_masks);
+}
+
+// Backends with their own precomputed masks. PREFIX is the prefix of the
+// function names, e.g. zp7_gfni_ for zp7_gfni_pre_64(), etc.
+#define BENCH_BACKEND(name, masks_t, prefix)                                \
+    do {                                                                    \
+        masks_t masks = prefix##pre_64(bench_masks[0]);                     \
+        BENCH_PRE_LATENCY(name " latency: pext", prefix##pext_pre_64,       \
+                &masks);                                                    \
+        BENCH_PRE_LATENCY(name " latency: pdep", prefix##pdep_pre_64,       \
+                &masks);                                                    \
+        BENCH_PRE_THROUGHPUT(name " throughput: pext", prefix##pext_pre_64, \
+                &masks);                                                    \
+        BENCH_PRE_THROUGHPUT(name " throughput: pdep", prefix##pdep_pre_64, \
+                &masks);                                                    \
+                                                                            \
+        for (int i = 0; i < N_ARRAY_WORDS; i++)                             \
+            array_src[i] = bench_masks[i % ARRAY_SIZE(bench_masks)] * (i + 1);\
+        BENCH_ARRAY(name " array: pext", prefix##pext_pre_array_64, &masks);\
+        BENCH_ARRAY(name " array: pdep", prefix##pdep_pre_array_64, &masks);\
+                                                                            \
+        /* Sparse masks, with one byte of result */                         \
+        masks = prefix##pre_64(bench_masks[0] & bench_masks[1] &            \
+                bench_masks[2]);                                            \
+        BENCH_ARRAY(name " array, sparse: pext", prefix##pext_pre_array_64, \
+                &masks);                                                    \
+        BENCH_ARRAY(name " array, sparse: pdep", prefix##pdep_pre_array_64, \
+                &masks);                                                    \
+                                                                            \
+        /* Mask precomputation */                                           \
+        uint64_t sum = 0;                                                   \
+        double start = now_ns();                                            \
+        for (int i = 0; i < N_ITERS / 16; i++) {                            \
+            masks = prefix##pre_64(bench_masks[i & 1023] ^ i);              \
+            sum += masks.mask;                                              \
+        }                                                                   \
+        report(name " precompute", now_ns() - start, N_ITERS / 16);         \
+        sink = sum;                                                         \
+    } while (0)
+
+#ifdef HAS_GFNI
+void bench_gfni() {
+    BENCH_BACKEND("gfni", zp7_gfni_masks_64_t, zp7_gfni_);
+}
+#endif
+
+#ifdef HAS_BITALG
+void bench_bitalg() {
+    BENCH_BACKEND("bitalg", zp7_bitalg_masks_64_t, zp7_bitalg_);
+}
+#endif
+
+#if defined(HAS_SSSE3) || defined(HAS_AVX2)
+void bench_pshufb() {
+    BENCH_BACKEND("pshufb", zp7_pshufb_masks_64_t, zp7_pshufb_);
+}
+#endif
+
+// Parallel bulk PEXT/PDEP, with increasing numbers of threads. The array is
+// much bigger than the caches, so this should scale about linearly until it
+// hits the memory bandwidth limit, which is reported as read+write GB/s.
+
+#define N_PARALLEL_WORDS    ((size_t)1 << 25)
+#define N_PARALLEL_REPS     (8)
+
+typedef struct {
+    uint64_t *src, *dst;
+} parallel_init_t;
+
+// Initialize with the pool, so the pages are placed with the same split as
+// the benchmark uses
+static void parallel_init(void *p, size_t begin, size_t end) {
+    parallel_init_t *init = (parallel_init_t *)p;
+    for (size_t i = begin; i < end; i++) {
+        init->src[i] = bench_masks[i % ARRAY_SIZE(bench_masks)] * (i + 1);
+        init->dst[i] = 0;
+    }
+}
+
+void bench_parallel() {
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n = N_PARALLEL_WORDS;
+    uint64_t *src = aligned_alloc(4096, n * sizeof(uint64_t));
+    uint64_t *dst = aligned_alloc(4096, n * sizeof(uint64_t));
+    zp7_masks_64_t masks = zp7_ppp_64(bench_masks[0]);
+
+    for (int threads = 1; ; threads *= 2) {
+        if (threads > n_cpus)
+            threads = n_cpus;
+        zp7_pool_t *pool = zp7_pool_create(threads, ZP7_POOL_PIN);
+        parallel_init_t init = { src, dst };
+        zp7_pool_run(pool, n, ZP7_POOL_CHUNK, parallel_init, &init);
+
+        for (int op = 0; op < 2; op++) {
+            double start = now_ns();
+            for (int i = 0; i < N_PARALLEL_REPS; i++) {
+                if (op == 0)
+                    zp7_pext_pre_array_parallel_64(pool, dst, src, n, &masks);
+                else
+                    zp7_pdep_pre_array_parallel_64(pool, dst, src, n, &masks);
+            }
+            double ns = now_ns() - start;
+            char name[64];
+            snprintf(name, sizeof(name), "parallel %s: %d thread%s",
+                    op == 0 ? "pext" : "pdep", threads, threads > 1 ? "s" : "");
+            double words = (double)N_PARALLEL_REPS * n;
+            printf("%-40s %8.2f ns/op %8.2f GB/s\n", name, ns / words,
+                    2 * sizeof(uint64_t) * words / ns);
+        }
+        sink = dst[n - 1];
+        zp7_pool_destroy(pool);
+        if (threads == n_cpus)
+            break;
+    }
+    free(src);
+    free(dst);
+}
+
+// Bitstream compaction, serial and with increasing numbers of threads.
+// SRC is reused as the mask stream.
+void bench_compact() {
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n = N_PARALLEL_WORDS;
+    uint64_t *src = aligned_alloc(4096, n * sizeof(uint64_t));
+    uint64_t *dst = aligned_alloc(4096, n * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++)
+        src[i] = bench_masks[i % ARRAY_SIZE(bench_masks)] * (i + 1);
+    memset(dst, 0, n * sizeof(uint64_t));
+    const uint64_t *mask = src + 1;
+    n--;
+
+    double start = now_ns();
+    for (int i = 0; i < N_PARALLEL_REPS; i++)
+        sink = zp7_compact_64(dst, src, mask, n);
+    report("compact: serial", now_ns() - start, (double)N_PARALLEL_REPS * n);
+
+    for (int threads = 1; ; threads *= 2) {
+        if (threads > n_cpus)
+            threads = n_cpus;
+        zp7_pool_t *pool = zp7_pool_create(threads, ZP7_POOL_PIN);
+        start = now_ns();
+        for (int i = 0; i < N_PARALLEL_REPS; i++)
+            sink = zp7_compact_parallel_64(pool, dst, src, mask, n);
+        char name[64];
+        snprintf(name, sizeof(name), "compact: %d thread%s", threads,
+                threads > 1 ? "s" : "");
+        report(name, now_ns() - start, (double)N_PARALLEL_REPS * n);
+        zp7_pool_destroy(pool);
+        if (threads == n_cpus)
+            break;
+    }
+    free(src);
+    free(dst);
+}
+
+// Bitmap flattening, compared to finding the set bits one at a time, at a
+// range of densities. The "mixed" bitmap picks a density for each word at
+// random, which is where the branchy loop suffers the most.
+
+#define N_FLATTEN_WORDS     (1 << 14)
+#define N_FLATTEN_REPS      (64)
+
+static size_t flatten_ctz(uint32_t *dst, const uint64_t *bitmap, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (uint64_t m = bitmap[i]; m; m &= m - 1)
+            dst[count++] = i * 64 + __builtin_ctzll(m);
+    }
+    return count;
+}
+
+void bench_flatten() {
+    static uint64_t bitmap[N_FLATTEN_WORDS];
+    static uint32_t dst[N_FLATTEN_WORDS * 64 + 8];
+    static const char *densities[] = { "1/64", "1/8", "1/2", "7/8", "mixed" };
+    rand_ctx_t r[1];
+    rand_init(r);
+    for (int d = 0; d < (int)ARRAY_SIZE(densities); d++) {
+        for (size_t i = 0; i < N_FLATTEN_WORDS; i++) {
+            int k = d < 4 ? d : rand_next(r) % 4;
+            uint64_t m = rand_next(r);
+            switch (k) {
+                case 0: for (int j = 0; j < 5; j++) m &= rand_next(r); break;
+                case 1: m &= rand_next(r) & rand_next(r); break;
+                case 2: break;
+                case 3: m |= rand_next(r) | rand_next(r); break;
+            }
+            bitmap[i] = m;
+        }
+
+        char name[64];
+        double start = now_ns();
+        for (int i = 0; i < N_FLATTEN_REPS; i++)
+            sink += flatten_ctz(dst, bitmap, N_FLATTEN_WORDS);
+        snprintf(name, sizeof(name), "flatten: ctz %s", densities[d]);
+        report(name, now_ns() - start,
+                (double)N_FLATTEN_REPS * N_FLATTEN_WORDS);
+
+        start = now_ns();
+        for (int i = 0; i < N_FLATTEN_REPS; i++)
+            sink += zp7_flatten_64(dst, bitmap, N_FLATTEN_WORDS);
+        snprintf(name, sizeof(name), "flatten: zp7 %s", densities[d]);
+        report(name, now_ns() - start,
+                (double)N_FLATTEN_REPS * N_FLATTEN_WORDS);
+    }
+}
+
+// Compressed bitmaps, compared to plain bitsets over the same range. Each
+// data set is a pair of sets: sparse random values (array containers), dense
+// random values (bitmaps), or long runs.
+
+#define N_ROARING_KEYS      (256)
+#define N_ROARING_WORDS     (N_ROARING_KEYS * ZP7_ROARING_WORDS)
+#define N_ROARING_REPS      (16)
+#define N_ROARING_QUERIES   (1 << 12)
+
+static void roaring_bench_fill(rand_ctx_t *r, uint64_t *bits, int kind) {
+    memset(bits, 0, N_ROARING_WORDS * sizeof(uint64_t));
+    for (size_t i = 0; i < N_ROARING_WORDS; i++) {
+        if (kind == 0)
+            bits[i] = 1ULL << (rand_next(r) & 63) & -(rand_next(r) % 16 == 0);
+        else if (kind == 1)
+            bits[i] = rand_next(r);
+    }
+    if (kind == 2) {
+        for (int i = 0; i < N_ROARING_KEYS * 8; i++) {
+            uint32_t lo = rand_next(r) % (N_ROARING_KEYS << 16);
+            uint32_t hi = lo + rand_next(r) % 4000;
+            if (hi >= N_ROARING_KEYS << 16)
+                hi = (N_ROARING_KEYS << 16) - 1;
+            words_set_range(bits, lo, hi);
+        }
+    }
+}
+
+void bench_roaring() {
+    static const char *kinds[] = { "sparse", "dense", "runs" };
+    uint64_t *bits_a = malloc(N_ROARING_WORDS * sizeof(uint64_t));
+    uint64_t *bits_b = malloc(N_ROARING_WORDS * sizeof(uint64_t));
+    uint32_t *dst = malloc(((size_t)N_ROARING_KEYS << 16) * sizeof(uint32_t) +
+            8 * sizeof(uint32_t));
+    uint32_t queries[N_ROARING_QUERIES];
+    rand_ctx_t r[1];
+    rand_init(r);
+
+    for (int kind = 0; kind < (int)ARRAY_SIZE(kinds); kind++) {
+        roaring_bench_fill(r, bits_a, kind);
+        roaring_bench_fill(r, bits_b, kind);
+        zp7_roaring_t a, b;
+        zp7_roaring_init(&a);
+        zp7_roaring_init(&b);
+        for (uint32_t x = 0; x < N_ROARING_KEYS << 16; x++) {
+            if (bits_a[x >> 6] >> (x & 63) & 1)
+                zp7_roaring_add(&a, x);
+            if (bits_b[x >> 6] >> (x & 63) & 1)
+                zp7_roaring_add(&b, x);
+        }
+        zp7_roaring_optimize(&a);
+        zp7_roaring_optimize(&b);
+        uint64_t card = zp7_roaring_cardinality(&a);
+        for (int i = 0; i < N_ROARING_QUERIES; i++)
+            queries[i] = rand_next(r) % (N_ROARING_KEYS << 16);
+
+        char name[64];
+        double start = now_ns();
+        for (int i = 0; i < N_ROARING_REPS; i++) {
+            size_t n = 0;
+            for (size_t w = 0; w < N_ROARING_WORDS; w++) {
+                for (uint64_t m = bits_a[w] & bits_b[w]; m; m &= m - 1)
+                    dst[n++] = w * 64 + __builtin_ctzll(m);
+            }
+            sink += n;
+        }
+        snprintf(name, sizeof(name), "roaring: bitset and_to_list %s",
+                kinds[kind]);
+        report(name, now_ns() - start, N_ROARING_REPS);
+
+        start = now_ns();
+        for (int i = 0; i < N_ROARING_REPS; i++)
+            sink += zp7_roaring_and_to_list(dst, &a, &b);
+        snprintf(name, sizeof(name), "roaring: zp7 and_to_list %s",
+                kinds[kind]);
+        report(name, now_ns() - start, N_ROARING_REPS);
+
+        start = now_ns();
+        for (int i = 0; i < N_ROARING_REPS; i++) {
+            uint64_t n = 0;
+            for (size_t w = 0; w < N_ROARING_WORDS; w++)
+                n += popcnt(bits_a[w] & bits_b[w]);
+            sink += n;
+        }
+        snprintf(name, sizeof(name), "roaring: bitset and_card %s",
+                kinds[kind]);
+        report(name, now_ns() - start, N_ROARING_REPS);
+
+        start = now_ns();
+        for (int i = 0; i < N_ROARING_REPS; i++)
+            sink += zp7_roaring_and_cardinality(&a, &b);
+        snprintf(name, sizeof(name), "roaring: zp7 and_card %s",
+                kinds[kind]);
+        report(name, now_ns() - start, N_ROARING_REPS);
+
+        // Rank and select on a bitset have to count from the start
+        start = now_ns();
+        for (int i = 0; i < N_ROARING_QUERIES; i++) {
+            uint32_t x = queries[i];
+            uint64_t rank = 0;
+            for (uint32_t w = 0; w < x >> 6; w++)
+                rank += popcnt(bits_a[w]);
+            sink += rank + popcnt(bits_a[x >> 6] & (-1ULL >> (63 - (x & 63))));
+        }
+        snprintf(name, sizeof(name), "roaring: bitset rank %s", kinds[kind]);
+        report(name, now_ns() - start, N_ROARING_QUERIES);
+
+        start = now_ns();
+        for (int i = 0; i < N_ROARING_QUERIES; i++)
+            sink += zp7_roaring_rank(&a, queries[i]);
+        snprintf(name, sizeof(name), "roaring: zp7 rank %s", kinds[kind]);
+        report(name, now_ns() - start, N_ROARING_QUERIES);
+
+        start = now_ns();
+        for (int i = 0; i < N_ROARING_QUERIES; i++) {
+            uint64_t k = queries[i] % card;
+            uint32_t w = 0;
+            for (uint64_t pop; k >= (pop = popcnt(bits_a[w])); w++)
+                k -= pop;
+            uint64_t m = bits_a[w];
+            for (; k > 0; k--)
+                m &= m - 1;
+            sink += w * 64 + __builtin_ctzll(m);
+        }
+        snprintf(name, sizeof(name), "roaring: bitset select %s",
+                kinds[kind]);
+        report(name, now_ns() - start, N_ROARING_QUERIES);
+
+        start = now_ns();
+        for (int i = 0; i < N_ROARING_QUERIES; i++) {
+            uint32_t x;
+            zp7_roaring_select(&a, queries[i] % card, &x);
+            sink += x;
+        }
+        snprintf(name, sizeof(name), "roaring: zp7 select %s", kinds[kind]);
+        report(name, now_ns() - start, N_ROARING_QUERIES);
+
+        zp7_roaring_free(&a);
+        zp7_roaring_free(&b);
+    }
+    free(bits_a);
+    free(bits_b);
+    free(dst);
+}
+
+// Wavelet matrix construction on 100M 8-bit symbols, compared to the usual
+// construction that stably partitions the symbols themselves at each level,
+// plus query times
+
+#define N_WAVELET_SYMBOLS   (100000000)
+#define N_WAVELET_BITS      (8)
+#define N_WAVELET_QUERIES   (1 << 20)
+
+static void wavelet_build_simple(uint64_t *levels, size_t stride,
+        uint32_t *symbols, uint32_t *tmp, size_t n, int n_bits) {
+    for (int l = 0; l < n_bits; l++) {
+        int bit = n_bits - 1 - l;
+        uint64_t *level = levels + l * stride;
+        memset(level, 0, stride * sizeof(uint64_t));
+        size_t zeros = 0;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t b = symbols[i] >> bit & 1;
+            level[i / 64] |= b << (i % 64);
+            zeros += !b;
+        }
+        size_t pos_0 = 0, pos_1 = zeros;
+        for (size_t i = 0; i < n; i++) {
+            if (symbols[i] >> bit & 1)
+                tmp[pos_1++] = symbols[i];
+            else
+                tmp[pos_0++] = symbols[i];
+        }
+        uint32_t *t = symbols;
+        symbols = tmp;
+        tmp = t;
+    }
+}
+
+void bench_wavelet() {
+    size_t n = N_WAVELET_SYMBOLS;
+    uint32_t *symbols = malloc(n * sizeof(uint32_t));
+    uint32_t *copy = malloc(n * sizeof(uint32_t));
+    uint32_t *tmp = malloc(n * sizeof(uint32_t));
+    size_t stride = (n + 63) / 64 + 1;
+    uint64_t *levels = malloc(N_WAVELET_BITS * stride * sizeof(uint64_t));
+    rand_ctx_t r[1];
+    rand_init(r);
+    // Skewed symbols, like text: the AND of two random bytes
+    for (size_t i = 0; i < n; i++) {
+        uint64_t x = rand_next(r);
+        symbols[i] = (x & x >> 8) & 0xFF;
+    }
+
+    memcpy(copy, symbols, n * sizeof(uint32_t));
+    double start = now_ns();
+    wavelet_build_simple(levels, stride, copy, tmp, n, N_WAVELET_BITS);
+    report("wavelet: build simple", now_ns() - start, n);
+
+    zp7_wavelet_t wm;
+    start = now_ns();
+    zp7_wavelet_build(&wm, symbols, n, N_WAVELET_BITS);
+    report("wavelet: build zp7", now_ns() - start, n);
+
+    start = now_ns();
+    for (int i = 0; i < N_WAVELET_QUERIES; i++)
+        sink += zp7_wavelet_access(&wm, rand_next(r) % n);
+    report("wavelet: access", now_ns() - start, N_WAVELET_QUERIES);
+
+    start = now_ns();
+    for (int i = 0; i < N_WAVELET_QUERIES; i++)
+        sink += zp7_wavelet_rank(&wm, rand_next(r) & 0xFF, rand_next(r) % n);
+    report("wavelet: rank", now_ns() - start, N_WAVELET_QUERIES);
+
+    // Select among the occurrences of common symbols
+    start = now_ns();
+    for (int i = 0; i < N_WAVELET_QUERIES; i++) {
+        size_t pos = 0;
+        zp7_wavelet_select(&wm, rand_next(r) & 0x0F, rand_next(r) % 100000,
+                &pos);
+        sink += pos;
+    }
+    report("wavelet: select", now_ns() - start, N_WAVELET_QUERIES);
+
+    zp7_wavelet_free(&wm);
+    free(symbols);
+    free(copy);
+    free(tmp);
+    free(levels);
+}
+
+// Radix sort by scattered key bits, compared to building contiguous keys
+// with zp7_pext_64() first and sorting (key, value) pairs by them
+
+#define N_SORT_VALUES       (1 << 24)
+
+typedef struct {
+    uint64_t key, value;
+} sort_pair_t;
+
+static void sort_pairs(sort_pair_t *data, sort_pair_t *tmp, size_t n,
+        int key_bits) {
+    static size_t count[256];
+    for (int shift = 0; shift < key_bits; shift += 8) {
+        memset(count, 0, sizeof(count));
+        for (size_t i = 0; i < n; i++)
+            count[data[i].key >> shift & 0xFF]++;
+        size_t offset = 0;
+        for (int j = 0; j < 256; j++) {
+            size_t c = count[j];
+            count[j] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; i++)
+            tmp[count[data[i].key >> shift & 0xFF]++] = data[i];
+        sort_pair_t *t = data;
+        data = tmp;
+        tmp = t;
+    }
+}
+
+void bench_sort() {
+    size_t n = N_SORT_VALUES;
+    uint64_t *values = malloc(n * sizeof(uint64_t));
+    uint64_t *data = malloc(n * sizeof(uint64_t));
+    uint64_t *tmp = malloc(n * sizeof(uint64_t));
+    sort_pair_t *pairs = malloc(n * sizeof(sort_pair_t));
+    sort_pair_t *pairs_tmp = malloc(n * sizeof(sort_pair_t));
+    rand_ctx_t r[1];
+    rand_init(r);
+    for (size_t i = 0; i < n; i++)
+        values[i] = rand_next(r);
+
+    int sizes[] = { 16, 32 };
+    for (int s = 0; s < (int)ARRAY_SIZE(sizes); s++) {
+        // A mask with the given number of scattered bits
+        uint64_t mask = 0;
+        while ((int)popcnt(mask) < sizes[s])
+            mask |= 1ULL << (rand_next(r) & 63);
+
+        char name[64];
+        double start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            pairs[i].key = zp7_pext_64(values[i], mask);
+            pairs[i].value = values[i];
+        }
+        sort_pairs(pairs, pairs_tmp, n, sizes[s]);
+        snprintf(name, sizeof(name), "sort: %d-bit keys, pext first",
+                sizes[s]);
+        report(name, now_ns() - start, n);
+
+        int digits[] = { 8, 11 };
+        for (int d = 0; d < (int)ARRAY_SIZE(digits); d++) {
+            memcpy(data, values, n * sizeof(uint64_t));
+            start = now_ns();
+            zp7_radix_sort_64(data, tmp, n, mask, digits[d]);
+            snprintf(name, sizeof(name), "sort: %d-bit keys, %d-bit digits",
+                    sizes[s], digits[d]);
+            report(name, now_ns() - start, n);
+        }
+    }
+    free(values);
+    free(data);
+    free(tmp);
+    free(pairs);
+    free(pairs_tmp);
+}
+
+// Scans of packed codes, compared to unpacking a block of codes and
+// comparing them one at a time
+
+#define N_SCAN_CODES        (1 << 26)
+#define N_SCAN_REPS         (4)
+
+static void scan_unpack(uint64_t *result, const uint64_t *packed, size_t n,
+        int code_bits, uint32_t lo, uint32_t hi) {
+    int per_word = zp7_scan_per_word(code_bits);
+    uint32_t code_mask = (uint32_t)(-1ULL >> (64 - code_bits));
+    // Blocks of whole words, with room for the last word's padding
+    uint32_t codes[1024 + 64];
+    size_t block = 1024 / per_word * per_word;
+    for (size_t b = 0, w = 0; b < n; b += block) {
+        size_t len = n - b < block ? n - b : block;
+        for (size_t i = 0; i < len; w++) {
+            for (int f = 0; f < per_word; f++, i++)
+                codes[i] = packed[w] >> (f * (code_bits + 1)) & code_mask;
+        }
+        for (size_t i = 0; i < len; i++) {
+            size_t j = b + i;
+            if (j % 64 == 0)
+                result[j / 64] = 0;
+            result[j / 64] |= (uint64_t)(lo <= codes[i] && codes[i] <= hi) <<
+                (j % 64);
+        }
+    }
+}
+
+void bench_scan() {
+    size_t n = N_SCAN_CODES;
+    uint32_t *codes = malloc(n * sizeof(uint32_t));
+    uint64_t *packed = malloc(n * sizeof(uint64_t));
+    uint64_t *result = malloc((n / 64 + 1) * sizeof(uint64_t));
+    rand_ctx_t r[1];
+    rand_init(r);
+
+    int sizes[] = { 3, 7, 12 };
+    for (int s = 0; s < (int)ARRAY_SIZE(sizes); s++) {
+        int code_bits = sizes[s];
+        uint32_t max = (1U << code_bits) - 1;
+        for (size_t i = 0; i < n; i++)
+            codes[i] = rand_next(r) & max;
+        zp7_scan_pack(packed, codes, n, code_bits);
+        uint32_t lo = max / 4, hi = max / 2;
+
+        char name[64];
+        double start = now_ns();
+        for (int i = 0; i < N_SCAN_REPS; i++)
+            scan_unpack(result, packed, n, code_bits, lo, hi);
+        snprintf(name, sizeof(name), "scan: %d-bit unpack between",
+                code_bits);
+        report(name, now_ns() - start, (double)N_SCAN_REPS * n);
+
+        const char *ops[] = { "eq", "lt", "gt", "between" };
+        for (int op = 0; op < 4; op++) {
+            start = now_ns();
+            for (int i = 0; i < N_SCAN_REPS; i++)
+                zp7_scan_64(result, packed, n, code_bits, op, lo, hi);
+            snprintf(name, sizeof(name), "scan: %d-bit zp7 %s", code_bits,
+                    ops[op]);
+            report(name, now_ns() - start, (double)N_SCAN_REPS * n);
+        }
+    }
+    free(codes);
+    free(packed);
+    free(result);
+}
+
+// Bitshuffle at each element size, in blocks of the default streaming size
+// like a compressor would use, compared to moving each bit separately
+
+#define N_BITSHUFFLE_BYTES  (1 << 20)
+#define N_BITSHUFFLE_REPS   (64)
+
+static void bitshuffle_simple(uint8_t *dst, const uint8_t *src, size_t n,
+        size_t s) {
+    memset(dst, 0, n * s);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t bit = 0; bit < 8 * s; bit++) {
+            size_t out = bit * n + i;
+            dst[out / 8] |= (uint8_t)((src[i * s + bit / 8] >> (bit % 8) & 1)
+                    << (out % 8));
+        }
+    }
+}
+
+void bench_bitshuffle() {
+    size_t size = N_BITSHUFFLE_BYTES;
+    uint8_t *src = malloc(size), *dst = malloc(size), *back = malloc(size);
+    uint8_t tmp[ZP7_BITSHUFFLE_BLOCK_BYTES];
+    rand_ctx_t r[1];
+    rand_init(r);
+    // Slowly varying 16-bit values, not that it matters for speed
+    for (size_t i = 0; i < size; i++)
+        src[i] = (uint8_t)(i % 2 ? i >> 12 : rand_next(r) & 0x0F);
+
+    size_t sizes[] = { 1, 2, 3, 4, 5, 8 };
+    for (int e = 0; e < (int)ARRAY_SIZE(sizes); e++) {
+        size_t s = sizes[e];
+        size_t block = ZP7_BITSHUFFLE_BLOCK_BYTES / s & ~(size_t)7;
+        size_t n = size / s / block * block;
+        char name[64];
+        double start;
+
+        if (s == 1 || s == 4) {
+            start = now_ns();
+            for (size_t i = 0; i < n; i += block)
+                bitshuffle_simple(dst + i * s, src + i * s, block, s);
+            snprintf(name, sizeof(name), "bitshuffle: %zu-byte simple", s);
+            report_rate(name, now_ns() - start, (double)n * s);
+        }
+
+        start = now_ns();
+        for (int k = 0; k < N_BITSHUFFLE_REPS; k++) {
+            for (size_t i = 0; i < n; i += block)
+                zp7_bitshuffle(dst + i * s, src + i * s, block, s, tmp);
+        }
+        snprintf(name, sizeof(name), "bitshuffle: %zu-byte shuffle", s);
+        report_rate(name, now_ns() - start, (double)N_BITSHUFFLE_REPS * n * s);
+
+        start = now_ns();
+        for (int k = 0; k < N_BITSHUFFLE_REPS; k++) {
+            for (size_t i = 0; i < n; i += block)
+                zp7_bitunshuffle(back + i * s, dst + i * s, block, s, tmp);
+        }
+        snprintf(name, sizeof(name), "bitshuffle: %zu-byte unshuffle", s);
+        report_rate(name, now_ns() - start, (double)N_BITSHUFFLE_REPS * n * s);
+        sink = back[n * s / 2];
+    }
+    free(src);
+    free(dst);
+    free(back);
+}
+
+// Bit streams, writing and reading fields one at a time and in bulk, for a
+// few mask densities
+
+#define N_BITIO_WORDS       (1 << 16)
+#define N_BITIO_REPS        (64)
+
+void bench_bitio() {
+    size_t n = N_BITIO_WORDS;
+    uint64_t *src = malloc(n * sizeof(uint64_t));
+    uint64_t *dst = malloc(n * sizeof(uint64_t));
+    uint64_t *buf = malloc((n + 1) * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++)
+        src[i] = bench_masks[i % ARRAY_SIZE(bench_masks)] * (i + 1);
+
+    uint64_t masks[] = { 0x00000000000FF0F0ULL, bench_masks[0],
+        bench_masks[1] & bench_masks[2] };
+    const char *names[] = { "field", "random", "sparse" };
+    for (int m = 0; m < (int)ARRAY_SIZE(masks); m++) {
+        zp7_masks_64_t p = zp7_ppp_64(masks[m]);
+        zp7_bit_writer_t w[1];
+        zp7_bit_reader_t r[1];
+        char name[64];
+
+        double start = now_ns();
+        for (int k = 0; k < N_BITIO_REPS; k++) {
+            zp7_bit_writer_init(w, buf, n + 1);
+            for (size_t i = 0; i < n; i++)
+                zp7_bit_append_pext(w, src[i], &p);
+            zp7_bit_writer_finish(w);
+        }
+        snprintf(name, sizeof(name), "bitio: %s append_pext", names[m]);
+        report(name, now_ns() - start, (double)N_BITIO_REPS * n);
+
+        start = now_ns();
+        for (int k = 0; k < N_BITIO_REPS; k++) {
+            zp7_bit_writer_init(w, buf, n + 1);
+            zp7_bit_append_pext_array(w, src, n, &p);
+            zp7_bit_writer_finish(w);
+        }
+        snprintf(name, sizeof(name), "bitio: %s append_pext_array", names[m]);
+        report(name, now_ns() - start, (double)N_BITIO_REPS * n);
+
+        start = now_ns();
+        for (int k = 0; k < N_BITIO_REPS; k++) {
+            zp7_bit_reader_init(r, buf, w->n_words);
+            for (size_t i = 0; i < n; i++)
+                dst[i] = zp7_bit_read_pdep(r, &p);
+        }
+        snprintf(name, sizeof(name), "bitio: %s read_pdep", names[m]);
+        report(name, now_ns() - start, (double)N_BITIO_REPS * n);
+
+        start = now_ns();
+        for (int k = 0; k < N_BITIO_REPS; k++) {
+            zp7_bit_reader_init(r, buf, w->n_words);
+            zp7_bit_read_pdep_array(r, dst, n, &p);
+        }
+        snprintf(name, sizeof(name), "bitio: %s read_pdep_array", names[m]);
+        report(name, now_ns() - start, (double)N_BITIO_REPS * n);
+        sink = dst[n / 2];
+    }
+    free(src);
+    free(dst);
+    free(buf);
+}
+
+// Pixel format conversion, compared to the usual shifts and masks for each
+// channel, in megapixels per second
+
+#define N_PIXELS            (1 << 20)
+#define N_PIXEL_REPS        (16)
+
+static void rgb565_to_argb8888_simple(uint32_t *dst, const uint16_t *src,
+        size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t r = src[i] >> 11, g = src[i] >> 5 & 63, b = src[i] & 31;
+        dst[i] = 0xFF000000U | (r << 3 | r >> 2) << 16 | (g << 2 | g >> 4) << 8 |
+            (b << 3 | b >> 2);
+    }
+}
+
+static void argb8888_to_rgb565_simple(uint16_t *dst, const uint32_t *src,
+        size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t x = src[i];
+        dst[i] = (uint16_t)((x >> 8 & 0xF800) | (x >> 5 & 0x07E0) |
+                (x >> 3 & 0x001F));
+    }
+}
+
+static void rgb10a2_to_rgba16_simple(uint64_t *dst, const uint32_t *src,
+        size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t x = src[i];
+        uint64_t y = (uint64_t)((x >> 30) * 0x5555) << 48;
+        for (int c = 0; c < 3; c++) {
+            uint64_t v = x >> (10 * c) & 1023;
+            y |= (v << 6 | v >> 4) << (16 * c);
+        }
+        dst[i] = y;
+    }
+}
+
+static void v210_to_uyvy16_simple(uint16_t *dst, const uint32_t *src,
+        size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        for (int c = 0; c < 3; c++) {
+            uint32_t v = src[i] >> (10 * c) & 1023;
+            dst[3 * i + c] = (uint16_t)(v << 6 | v >> 4);
+        }
+    }
+}
+
+#define BENCH_PIXELS(name, fn, dst, src, n_pixels)                          \
+    do {                                                                    \
+        double start = now_ns();                                            \
+        for (int i = 0; i < N_PIXEL_REPS; i++)                              \
+            fn(dst, src, N_PIXELS);                                         \
+        double ns = now_ns() - start;                                       \
+        printf("%-40s %8.1f Mpixel/s\n", name,                              \
+                (double)N_PIXEL_REPS * (n_pixels) / ns * 1000);             \
+        sink = dst[N_PIXELS / 2];                                           \
+    } while (0)
+
+void bench_pixel() {
+    uint16_t *p16 = malloc(N_PIXELS * sizeof(uint16_t));
+    uint16_t *uyvy = malloc(3 * N_PIXELS * sizeof(uint16_t));
+    uint32_t *p32 = malloc(N_PIXELS * sizeof(uint32_t));
+    uint32_t *argb = malloc(N_PIXELS * sizeof(uint32_t));
+    uint64_t *rgba16 = malloc(N_PIXELS * sizeof(uint64_t));
+    rand_ctx_t r[1];
+    rand_init(r);
+    for (size_t i = 0; i < N_PIXELS; i++) {
+        p16[i] = (uint16_t)rand_next(r);
+        p32[i] = (uint32_t)rand_next(r);
+    }
+
+    BENCH_PIXELS("pixel: rgb565 -> argb8888 simple",
+            rgb565_to_argb8888_simple, argb, p16, N_PIXELS);
+    BENCH_PIXELS("pixel: rgb565 -> argb8888 zp7", zp7_rgb565_to_argb8888,
+            argb, p16, N_PIXELS);
+    BENCH_PIXELS("pixel: argb8888 -> rgb565 simple",
+            argb8888_to_rgb565_simple, p16, argb, N_PIXELS);
+    BENCH_PIXELS("pixel: argb8888 -> rgb565 zp7", zp7_argb8888_to_rgb565,
+            p16, argb, N_PIXELS);
+    BENCH_PIXELS("pixel: rgb555 -> argb8888 zp7", zp7_rgb555_to_argb8888,
+            argb, p16, N_PIXELS);
+    BENCH_PIXELS("pixel: argb8888 -> rgb555 zp7", zp7_argb8888_to_rgb555,
+            p16, argb, N_PIXELS);
+    BENCH_PIXELS("pixel: rgb10a2 -> rgba16 simple",
+            rgb10a2_to_rgba16_simple, rgba16, p32, N_PIXELS);
+    BENCH_PIXELS("pixel: rgb10a2 -> rgba16 zp7", zp7_rgb10a2_to_rgba16,
+            rgba16, p32, N_PIXELS);
+    BENCH_PIXELS("pixel: rgba16 -> rgb10a2 zp7", zp7_rgba16_to_rgb10a2,
+            p32, rgba16, N_PIXELS);
+    // Six pixels in every four words
+    BENCH_PIXELS("pixel: v210 -> uyvy16 simple", v210_to_uyvy16_simple,
+            uyvy, p32, N_PIXELS * 1.5);
+    BENCH_PIXELS("pixel: v210 -> uyvy16 zp7", zp7_v210_to_uyvy16, uyvy, p32,
+            N_PIXELS * 1.5);
+    BENCH_PIXELS("pixel: uyvy16 -> v210 zp7", zp7_uyvy16_to_v210, p32, uyvy,
+            N_PIXELS * 1.5);
+    free(p16);
+    free(uyvy);
+    free(p32);
+    free(argb);
+    free(rgba16);
+}
+
+// Nucleotide packing, compared to a table lookup per base, in gigabases per
+// second
+
+#define N_BASES             (1 << 24)
+#define N_BASE_REPS         (8)
+
+static void dna_pack2_simple(uint64_t *dst, const char *src, size_t n) {
+    static uint8_t codes[256];
+    codes['C'] = 1, codes['G'] = 3, codes['T'] = 2;
+    for (size_t i = 0; i < n / 32; i++) {
+        uint64_t x = 0;
+        for (int k = 0; k < 32; k++)
+            x |= (uint64_t)codes[(uint8_t)src[32 * i + k]] << (2 * k);
+        dst[i] = x;
+    }
+}
+
+static void dna_unpack2_simple(char *dst, const uint64_t *src, size_t n) {
+    static const char letters[4] = { 'A', 'C', 'T', 'G' };
+    for (size_t i = 0; i < n; i++)
+        dst[i] = letters[src[i / 32] >> (2 * (i % 32)) & 3];
+}
+
+static void dna_revcomp_simple(char *dst, const char *src, size_t n) {
+    static char comp[256];
+    comp['A'] = 'T', comp['C'] = 'G', comp['G'] = 'C', comp['T'] = 'A';
+    comp['N'] = 'N';
+    for (size_t i = 0; i < n; i++)
+        dst[i] = comp[(uint8_t)src[n - 1 - i]];
+}
+
+#define BENCH_BASES(name, fn, dst, src)                                     \
+    do {                                                                    \
+        double start = now_ns();                                            \
+        for (int i = 0; i < N_BASE_REPS; i++)                               \
+            fn(dst, src, N_BASES);                                          \
+        double ns = now_ns() - start;                                       \
+        printf("%-40s %8.2f Gbase/s\n", name,                               \
+                (double)N_BASE_REPS * N_BASES / ns);                        \
+        sink = dst[N_BASES / 64];                                           \
+    } while (0)
+
+void bench_dna() {
+    char *seq = malloc(N_BASES);
+    char *out = malloc(N_BASES);
+    uint64_t *packed = malloc(N_BASES / 16 * sizeof(uint64_t));
+    uint64_t *packed_rc = malloc(N_BASES / 16 * sizeof(uint64_t));
+    rand_ctx_t r[1];
+    rand_init(r);
+    for (size_t i = 0; i < N_BASES; i++)
+        seq[i] = "ACGT"[rand_next(r) & 3];
+
+    BENCH_BASES("dna: pack2 simple", dna_pack2_simple, packed, seq);
+    BENCH_BASES("dna: pack2 zp7", zp7_dna_pack2, packed, seq);
+    BENCH_BASES("dna: unpack2 simple", dna_unpack2_simple, out, packed);
+    BENCH_BASES("dna: unpack2 zp7", zp7_dna_unpack2, out, packed);
+    BENCH_BASES("dna: pack4 zp7", zp7_dna_pack4, packed, seq);
+    BENCH_BASES("dna: unpack4 zp7", zp7_dna_unpack4, out, packed);
+    BENCH_BASES("dna: revcomp simple", dna_revcomp_simple, out, seq);
+    // An odd length, so the words have to be shifted
+    zp7_dna_pack2(packed, seq, N_BASES - 1);
+    BENCH_BASES("dna: revcomp2 zp7", zp7_dna_revcomp2, packed_rc, packed);
+    zp7_dna_pack4(packed, seq, N_BASES - 1);
+    BENCH_BASES("dna: revcomp4 zp7", zp7_dna_revcomp4, packed_rc, packed);
+    free(seq);
+    free(out);
+    free(packed);
+    free(packed_rc);
+}
+
+typedef struct {
+    const char *name;
+    void (*fn)();
+} bench_t;
+
+bench_t benches[] = {
+    { "ppp", bench_ppp },
+    { "pre", bench_pre },
+    { "array", bench_array },
+    { "batch", bench_batch },
+    { "parallel", bench_parallel },
+    { "compact", bench_compact },
+    { "flatten", bench_flatten },
+    { "roaring", bench_roaring },
+    { "wavelet", bench_wavelet },
+    { "sort", bench_sort },
+    { "scan", bench_scan },
+    { "bitshuffle", bench_bitshuffle },
+    { "bitio", bench_bitio },
+    { "pixel", bench_pixel },
+    { "dna", bench_dna },
+#ifdef HAS_GFNI
+    { "gfni", bench_gfni },
+#endif
+#ifdef HAS_BITALG
+    { "bitalg", bench_bitalg },
+#endif
+#if defined(HAS_SSSE3) || defined(HAS_AVX2)
+    { "pshufb", bench_pshufb },
+#endif
+};
+
+int main(int argc, char **argv) {
+    rand_ctx_t r[1];
+    rand_init(r);
+    for (int i = 0; i < ARRAY_SIZE(bench_masks); i++)
+        bench_masks[i] = rand_next(r);
+
+    for (int b = 0; b < ARRAY_SIZE(benches); b++) {
+        int run = argc < 2;
+        for (int i = 1; i < argc; i++)
+            run |= strstr(benches[b].name, argv[i]) != NULL;
+        if (run)
+            benches[b].fn();
+    }
+    return 0;
+}
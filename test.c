@@ -20,16 +20,77 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-#include <immintrin.h>
+// On x86, test against the native PEXT/PDEP instructions, and use all the
+// available instructions in ZP7. Elsewhere (like when cross-compiling and
+// running under qemu), the HAS_* defines should be passed on the command line,
+// e.g. for AArch64:
+//
+//     aarch64-linux-gnu-gcc -O2 -march=armv8-a+crypto -DHAS_PMULL -DHAS_NEON
+//         -static test.c -o test && qemu-aarch64 ./test
+//
+// and the results are checked against simple bit-by-bit loops instead. The
+// SSSE3, AVX2, GFNI and BITALG code is tested when compiling for a target that
+// has them (along with AVX-512 VBMI for the last two), e.g. with
+// -march=icelake-server.
+#if defined(__x86_64__)
+#   include <immintrin.h>
 
-#define HAS_CLMUL
-#define HAS_BZHI
-#define HAS_POPCNT
+#   define HAS_CLMUL
+#   define HAS_BZHI
+#   define HAS_POPCNT
+#   if defined(__GFNI__) && defined(__AVX512VBMI__)
+#       define HAS_GFNI
+#   endif
+#   if defined(__AVX512BITALG__) && defined(__AVX512VBMI__)
+#       define HAS_BITALG
+#   endif
+#   ifdef __SSE2__
+#       define HAS_SSE2
+#   endif
+#   ifdef __SSSE3__
+#       define HAS_SSSE3
+#   endif
+#   ifdef __AVX2__
+#       define HAS_AVX2
+#   endif
+
+#   define ref_pext_64     _pext_u64
+#   define ref_pdep_64     _pdep_u64
+#else
+uint64_t ref_pext_64(uint64_t a, uint64_t mask) {
+    uint64_t r = 0;
+    for (uint64_t bit = 1; mask; bit <<= 1, mask &= mask - 1)
+        if (a & mask & -mask)
+            r |= bit;
+    return r;
+}
+
+uint64_t ref_pdep_64(uint64_t a, uint64_t mask) {
+    uint64_t r = 0;
+    for (uint64_t bit = 1; mask; bit <<= 1, mask &= mask - 1)
+        if (a & bit)
+            r |= mask & -mask;
+    return r;
+}
+#endif
 
 #include "zp7.c"
+#include "zp7_table.c"
+#include "zp7_parallel.c"
+#include "zp7_roaring.c"
+#include "zp7_wavelet.c"
+#include "zp7_sort.c"
+#include "zp7_scan.c"
+#include "zp7_bitshuffle.c"
+#include "zp7_bitio.c"
+#include "zp7_pixel.c"
+#include "zp7_dna.c"
 
 #define ARRAY_SIZE(a)       (sizeof(a) / sizeof((a)[0]))
 
@@ -61,6 +122,1053 @@ void rand_init(rand_ctx_t *x) {
         (void)rand_next(x);
 }
 
+// Test the scalar carry-less multiply and popcount helpers directly, since
+// they're inline assembly or intrinsics on some targets (PMULL/NEON on
+// AArch64, Zbc/Zbb on RISC-V) and an error there would otherwise only show up
+// as a wrong PPP
+void test_primitives(rand_ctx_t *r) {
+    for (int test = 0; test < 100000; test++) {
+        uint64_t a = rand_next(r), b = rand_next(r);
+        if (test & 1)
+            a &= rand_next(r);
+        if (test < 2)
+            a = -test;
+
+        uint64_t pop = 0;
+        for (uint64_t x = a; x; x &= x - 1)
+            pop++;
+        if (popcnt(a) != pop) {
+            printf("FAIL POPCNT: %016llx\n", a);
+            exit(1);
+        }
+
+#if defined(HAS_PMULL) || defined(HAS_ZBC)
+        uint64_t prod = 0;
+        for (int i = 0; i < 64; i++)
+            if (b >> i & 1)
+                prod ^= a << i;
+        if (clmul_64(a, b) != prod) {
+            printf("FAIL CLMUL: %016llx %016llx\n", a, b);
+            exit(1);
+        }
+#else
+        (void)b;
+#endif
+    }
+}
+
+// Round-trip a table of precomputed masks through a file, and make sure
+// corrupted files are rejected
+void test_table(rand_ctx_t *r) {
+    enum { N_MASKS = 1000 };
+    static zp7_masks_64_t masks[N_MASKS];
+    for (int i = 0; i < N_MASKS; i++)
+        masks[i] = zp7_ppp_64(rand_next(r));
+
+    char path[] = "/tmp/zp7_table_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("FAIL TABLE: can't create temp file\n");
+        exit(1);
+    }
+    close(fd);
+
+    zp7_table_t table[1];
+    if (zp7_table_write(path, masks, N_MASKS) != 0 ||
+            zp7_table_open(path, table, 0) != 0 ||
+            table->count != N_MASKS ||
+            memcmp(table->masks, masks, sizeof(masks)) != 0) {
+        printf("FAIL TABLE: round trip\n");
+        exit(1);
+    }
+    for (int i = 0; i < N_MASKS; i++) {
+        uint64_t input = rand_next(r);
+        if (zp7_pext_pre_64(input, &table->masks[i]) !=
+                ref_pext_64(input, masks[i].mask)) {
+            printf("FAIL TABLE: PEXT\n");
+            exit(1);
+        }
+    }
+    zp7_table_close(table);
+
+    // Flip one bit in the last entry
+    FILE *f = fopen(path, "r+b");
+    fseek(f, -1, SEEK_END);
+    int c = fgetc(f);
+    fseek(f, -1, SEEK_END);
+    fputc(c ^ 1, f);
+    fclose(f);
+    if (zp7_table_open(path, table, 0) != ZP7_TABLE_ERR_CHECKSUM ||
+            zp7_table_open(path, table, ZP7_TABLE_NO_VERIFY) != 0) {
+        printf("FAIL TABLE: checksum\n");
+        exit(1);
+    }
+    zp7_table_close(table);
+    unlink(path);
+}
+
+// Test the bulk same-mask functions, with odd lengths to cover any tail
+// handling in the vector paths. The arrays go past ZP7_GFNI_MIN_ARRAY and
+// ZP7_PSHUFB_MIN_ARRAY, so the dispatch to those kernels gets tested too.
+void test_array(rand_ctx_t *r) {
+    enum { N_WORDS = 3000 };
+    static uint64_t src[N_WORDS], dst[N_WORDS];
+    for (int test = 0; test < 1000; test++) {
+        uint64_t m = rand_next(r);
+        if (test & 1)
+            m &= rand_next(r);
+        zp7_masks_64_t masks = zp7_ppp_64(m);
+        int n = rand_next(r) % N_WORDS;
+        for (int i = 0; i < n; i++)
+            src[i] = rand_next(r);
+
+        zp7_pext_pre_array_64(dst, src, n, &masks);
+        for (int i = 0; i < n; i++) {
+            if (dst[i] != ref_pext_64(src[i], m)) {
+                printf("FAIL PEXT ARRAY!\n");
+                printf("%016llx %016llx\n", m, src[i]);
+                exit(1);
+            }
+        }
+        zp7_pdep_pre_array_64(dst, src, n, &masks);
+        for (int i = 0; i < n; i++) {
+            if (dst[i] != ref_pdep_64(src[i], m)) {
+                printf("FAIL PDEP ARRAY!\n");
+                printf("%016llx %016llx\n", m, src[i]);
+                exit(1);
+            }
+        }
+    }
+}
+
+// Test the batches and the per-word mask array functions
+void test_batch(rand_ctx_t *r) {
+    enum { N_WORDS = 1000 };
+    static uint64_t src[N_WORDS], mask[N_WORDS], dst[N_WORDS];
+    for (int test = 0; test < 1000; test++) {
+        int n = rand_next(r) % N_WORDS;
+        for (int i = 0; i < n; i++) {
+            src[i] = rand_next(r);
+            mask[i] = rand_next(r);
+            if (i & 1)
+                mask[i] &= rand_next(r);
+            if (i & 2)
+                mask[i] |= rand_next(r);
+        }
+        mask[0] = 0;
+        mask[1] = -1;
+
+        uint64_t d_2[2], d_4[4];
+        zp7_pext_x2_64(d_2, src, mask);
+        zp7_pext_x4_64(d_4, src, mask);
+        zp7_pext_array_64(dst, src, mask, n);
+        for (int i = 0; i < n; i++) {
+            uint64_t e = ref_pext_64(src[i], mask[i]);
+            if (dst[i] != e || (i < 2 && d_2[i] != e) ||
+                    (i < 4 && d_4[i] != e)) {
+                printf("FAIL PEXT BATCH!\n");
+                printf("%016llx %016llx\n", mask[i], src[i]);
+                exit(1);
+            }
+        }
+        zp7_pdep_x2_64(d_2, src, mask);
+        zp7_pdep_x4_64(d_4, src, mask);
+        zp7_pdep_array_64(dst, src, mask, n);
+        for (int i = 0; i < n; i++) {
+            uint64_t e = ref_pdep_64(src[i], mask[i]);
+            if (dst[i] != e || (i < 2 && d_2[i] != e) ||
+                    (i < 4 && d_4[i] != e)) {
+                printf("FAIL PDEP BATCH!\n");
+                printf("%016llx %016llx\n", mask[i], src[i]);
+                exit(1);
+            }
+        }
+    }
+}
+
+// Count how many times each item is visited by zp7_pool_run()
+static void count_items(void *arg, size_t begin, size_t end) {
+    atomic_int *counts = (atomic_int *)arg;
+    for (size_t i = begin; i < end; i++)
+        atomic_fetch_add(&counts[i], 1);
+}
+
+// Test the thread pool and the parallel bulk functions against the serial
+// ones, with more threads than chunks and vice versa
+void test_parallel(rand_ctx_t *r) {
+    enum { N_ITEMS = 10007 };
+    static atomic_int counts[N_ITEMS];
+    int thread_counts[] = { 1, 3, 8 };
+    for (int t = 0; t < ARRAY_SIZE(thread_counts); t++) {
+        zp7_pool_t *pool = zp7_pool_create(thread_counts[t], 0);
+        if (!pool) {
+            printf("FAIL PARALLEL: can't create pool\n");
+            exit(1);
+        }
+        size_t chunks[] = { 1, 100, 5000, N_ITEMS };
+        for (int c = 0; c < ARRAY_SIZE(chunks); c++) {
+            for (int i = 0; i < N_ITEMS; i++)
+                atomic_init(&counts[i], 0);
+            zp7_pool_run(pool, N_ITEMS, chunks[c], count_items, counts);
+            for (int i = 0; i < N_ITEMS; i++) {
+                if (atomic_load(&counts[i]) != 1) {
+                    printf("FAIL PARALLEL: item %d visited %d times\n", i,
+                            atomic_load(&counts[i]));
+                    exit(1);
+                }
+            }
+        }
+
+        size_t n = ZP7_POOL_MIN_ARRAY + 3 * ZP7_POOL_CHUNK + 5;
+        uint64_t *src = malloc(n * sizeof(uint64_t));
+        uint64_t *mask = malloc(n * sizeof(uint64_t));
+        uint64_t *dst = malloc(n * sizeof(uint64_t));
+        uint64_t *expected = malloc(n * sizeof(uint64_t));
+        for (size_t i = 0; i < n; i++) {
+            src[i] = rand_next(r);
+            mask[i] = rand_next(r);
+        }
+        zp7_masks_64_t masks = zp7_ppp_64(mask[0]);
+
+        zp7_pext_pre_array_64(expected, src, n, &masks);
+        zp7_pext_pre_array_parallel_64(pool, dst, src, n, &masks);
+        int fail = memcmp(dst, expected, n * sizeof(uint64_t));
+        zp7_pdep_pre_array_64(expected, src, n, &masks);
+        zp7_pdep_pre_array_parallel_64(pool, dst, src, n, &masks);
+        fail |= memcmp(dst, expected, n * sizeof(uint64_t));
+        zp7_pext_array_64(expected, src, mask, n);
+        zp7_pext_array_parallel_64(pool, dst, src, mask, n);
+        fail |= memcmp(dst, expected, n * sizeof(uint64_t));
+        zp7_pdep_array_64(expected, src, mask, n);
+        zp7_pdep_array_parallel_64(pool, dst, src, mask, n);
+        fail |= memcmp(dst, expected, n * sizeof(uint64_t));
+        size_t bits = zp7_compact_64(expected, src, mask, n);
+        fail |= zp7_compact_parallel_64(pool, dst, src, mask, n) != bits;
+        fail |= memcmp(dst, expected, (bits + 63) / 64 * sizeof(uint64_t));
+        if (fail) {
+            printf("FAIL PARALLEL: %d threads\n", thread_counts[t]);
+            exit(1);
+        }
+
+        free(src);
+        free(mask);
+        free(dst);
+        free(expected);
+        zp7_pool_destroy(pool);
+    }
+}
+
+// Bit-by-bit bitstream compaction, for checking zp7_compact_64()
+size_t ref_compact_64(uint64_t *dst, const uint64_t *src,
+        const uint64_t *mask, size_t n) {
+    size_t bits = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (mask[i] >> b & 1) {
+                if (bits % 64 == 0)
+                    dst[bits / 64] = 0;
+                dst[bits / 64] |= (src[i] >> b & 1) << (bits % 64);
+                bits++;
+            }
+        }
+    }
+    return bits;
+}
+
+// Test serial and parallel compaction with a mix of dense, sparse and empty
+// stretches of masks. The parallel version is also run with tiny chunks, so
+// that many chunks share output words.
+void test_compact(rand_ctx_t *r) {
+    enum { N_WORDS = 5000 };
+    static uint64_t src[N_WORDS], mask[N_WORDS];
+    static uint64_t expected[N_WORDS], dst[N_WORDS];
+    zp7_pool_t *pool = zp7_pool_create(3, 0);
+    for (int test = 0; test < 200; test++) {
+        size_t n = rand_next(r) % N_WORDS;
+        for (size_t i = 0; i < n; i++) {
+            src[i] = rand_next(r);
+            switch ((i / 37 + test) % 4) {
+                case 0: mask[i] = rand_next(r); break;
+                case 1: mask[i] = rand_next(r) & rand_next(r) &
+                        rand_next(r); break;
+                case 2: mask[i] = 0; break;
+                case 3: mask[i] = -(rand_next(r) & 1); break;
+            }
+        }
+        size_t bits = ref_compact_64(expected, src, mask, n);
+        size_t words = (bits + 63) / 64;
+
+        size_t chunks[] = { 1, 3, 64, 1000 };
+        for (int c = -1; c < (int)ARRAY_SIZE(chunks); c++) {
+            memset(dst, 0xAA, sizeof(dst));
+            size_t b = c < 0 ? zp7_compact_64(dst, src, mask, n) :
+                zp7_compact_parallel(pool, dst, src, mask, n, chunks[c]);
+            if (b != bits || memcmp(dst, expected, words * sizeof(uint64_t))) {
+                printf("FAIL COMPACT: n=%zu chunk=%zu\n", n,
+                        c < 0 ? 0 : chunks[c]);
+                exit(1);
+            }
+        }
+    }
+    zp7_pool_destroy(pool);
+}
+
+// Test bitmap flattening at a range of densities, against the positions of
+// the set bits found one at a time
+void test_flatten(rand_ctx_t *r) {
+    enum { N_WORDS = 200 };
+    uint64_t bitmap[N_WORDS];
+    static uint32_t expected[N_WORDS * 64], dst[N_WORDS * 64 + 8];
+    for (int test = 0; test < 2000; test++) {
+        size_t n = rand_next(r) % N_WORDS;
+        size_t count = 0;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t m = rand_next(r);
+            // Thin out or fill in the bits by a varying amount
+            for (int k = 0; k < (test + i) % 4; k++)
+                m &= rand_next(r);
+            if ((test + i / 16) % 5 == 0)
+                m = ~m;
+            bitmap[i] = m;
+            for (int b = 0; b < 64; b++)
+                if (m >> b & 1)
+                    expected[count++] = i * 64 + b;
+        }
+        size_t c = zp7_flatten_64(dst, bitmap, n);
+        if (c != count || memcmp(dst, expected, count * sizeof(uint32_t))) {
+            printf("FAIL FLATTEN: n=%zu\n", n);
+            exit(1);
+        }
+    }
+}
+
+// Fill a reference bitset over the first N_KEYS containers with a different
+// kind of data in each: sparse values, dense random bits, or long runs. Keys
+// can also be left empty.
+static void roaring_fill(rand_ctx_t *r, uint64_t *bits, int n_keys) {
+    for (int key = 0; key < n_keys; key++) {
+        uint64_t *words = bits + key * ZP7_ROARING_WORDS;
+        memset(words, 0, ZP7_ROARING_WORDS * sizeof(uint64_t));
+        switch (rand_next(r) % 4) {
+            case 0:
+                for (int i = rand_next(r) % 5000; i > 0; i--) {
+                    uint32_t x = rand_next(r) & 0xFFFF;
+                    words[x >> 6] |= 1ULL << (x & 63);
+                }
+                break;
+            case 1:
+                for (int i = 0; i < ZP7_ROARING_WORDS; i++)
+                    words[i] = rand_next(r) | rand_next(r);
+                break;
+            case 2:
+                for (int i = rand_next(r) % 20; i > 0; i--) {
+                    uint32_t lo = rand_next(r) & 0xFFFF;
+                    uint32_t hi = lo + rand_next(r) % 5000;
+                    words_set_range(words, lo, hi < 0xFFFF ? hi : 0xFFFF);
+                }
+                break;
+            case 3:
+                break;
+        }
+    }
+}
+
+static int roaring_build(zp7_roaring_t *set, const uint64_t *bits,
+        int n_keys) {
+    zp7_roaring_init(set);
+    for (uint32_t x = 0; x < (uint32_t)n_keys << 16; x++) {
+        if (bits[x >> 6] >> (x & 63) & 1 && zp7_roaring_add(set, x) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Check the queries on SET against the reference bitset
+static void roaring_check(rand_ctx_t *r, const zp7_roaring_t *set,
+        const uint64_t *bits, int n_keys, const char *stage) {
+    uint32_t n_values = (uint32_t)n_keys << 16;
+    static uint32_t values[8 << 16];
+    uint64_t card = 0;
+    for (uint32_t x = 0; x < n_values; x++) {
+        if (bits[x >> 6] >> (x & 63) & 1)
+            values[card++] = x;
+    }
+    int fail = zp7_roaring_cardinality(set) != card;
+    for (int test = 0; test < 1000 && !fail; test++) {
+        uint32_t x = rand_next(r) % n_values;
+        uint64_t rank = 0;
+        while (rank < card && values[rank] <= x)
+            rank++;
+        fail |= zp7_roaring_contains(set, x) != (bits[x >> 6] >> (x & 63) & 1);
+        fail |= zp7_roaring_rank(set, x) != rank;
+        uint32_t y;
+        if (card) {
+            uint64_t k = rand_next(r) % card;
+            fail |= zp7_roaring_select(set, k, &y) != 0 || y != values[k];
+        }
+        fail |= zp7_roaring_select(set, card, &y) != ZP7_ROARING_ERR_RANGE;
+    }
+    if (fail) {
+        printf("FAIL ROARING: %s\n", stage);
+        exit(1);
+    }
+}
+
+// Test compressed bitmaps against plain bitsets, with every combination of
+// container types in the intersections
+void test_roaring(rand_ctx_t *r) {
+    enum { N_KEYS = 8 };
+    static uint64_t bits_a[N_KEYS * ZP7_ROARING_WORDS];
+    static uint64_t bits_b[N_KEYS * ZP7_ROARING_WORDS];
+    static uint32_t expected[N_KEYS << 16], dst[(N_KEYS << 16) + 8];
+    for (int test = 0; test < 20; test++) {
+        roaring_fill(r, bits_a, N_KEYS);
+        roaring_fill(r, bits_b, N_KEYS);
+
+        zp7_roaring_t a, b;
+        if (roaring_build(&a, bits_a, N_KEYS) ||
+                roaring_build(&b, bits_b, N_KEYS)) {
+            printf("FAIL ROARING: out of memory\n");
+            exit(1);
+        }
+        // Check before and after converting to runs, then after adding
+        // values back to the run containers
+        for (int stage = 0; stage < 3; stage++) {
+            if (stage == 1 && (zp7_roaring_optimize(&a) ||
+                    zp7_roaring_optimize(&b))) {
+                printf("FAIL ROARING: out of memory\n");
+                exit(1);
+            }
+            if (stage == 2) {
+                for (int i = 0; i < 100; i++) {
+                    uint32_t x = rand_next(r) % (N_KEYS << 16);
+                    bits_a[x >> 6] |= 1ULL << (x & 63);
+                    zp7_roaring_add(&a, x);
+                }
+            }
+            size_t count = 0;
+            for (uint32_t x = 0; x < N_KEYS << 16; x++) {
+                if ((bits_a[x >> 6] & bits_b[x >> 6]) >> (x & 63) & 1)
+                    expected[count++] = x;
+            }
+            const char *stages[] = { "built", "optimized", "added" };
+            roaring_check(r, &a, bits_a, N_KEYS, stages[stage]);
+            roaring_check(r, &b, bits_b, N_KEYS, stages[stage]);
+            size_t n = zp7_roaring_and_to_list(dst, &a, &b);
+            if (n != count || memcmp(dst, expected, n * sizeof(uint32_t)) ||
+                    zp7_roaring_and_cardinality(&a, &b) != count) {
+                printf("FAIL ROARING: intersection, %s\n", stages[stage]);
+                exit(1);
+            }
+        }
+        zp7_roaring_free(&a);
+        zp7_roaring_free(&b);
+    }
+}
+
+// Test wavelet matrices against scans of the symbols, with a range of
+// sequence lengths and symbol sizes
+void test_wavelet(rand_ctx_t *r) {
+    enum { N_SYMBOLS = 3000 };
+    static uint32_t symbols[N_SYMBOLS];
+    int sizes[] = { 1, 3, 8, 13, 32 };
+    for (int test = 0; test < 100; test++) {
+        size_t n = rand_next(r) % N_SYMBOLS;
+        int n_bits = sizes[test % ARRAY_SIZE(sizes)];
+        // Use fewer distinct symbols than the size allows, so there are
+        // repeats to rank and select
+        uint32_t max = (uint32_t)(-1ULL >> (64 - n_bits));
+        uint32_t range = n_bits < 6 ? max + 1 : 50;
+        uint32_t base = (uint32_t)rand_next(r) & max & ~63U;
+        for (size_t i = 0; i < n; i++)
+            symbols[i] = base + rand_next(r) % range;
+
+        zp7_wavelet_t wm;
+        if (zp7_wavelet_build(&wm, symbols, n, n_bits) != 0) {
+            printf("FAIL WAVELET: out of memory\n");
+            exit(1);
+        }
+        int fail = 0;
+        for (size_t i = 0; i < n; i++)
+            fail |= zp7_wavelet_access(&wm, i) != symbols[i];
+        for (int q = 0; q < 200 && !fail; q++) {
+            uint32_t c = n && q % 4 ? symbols[rand_next(r) % n] :
+                (uint32_t)rand_next(r) & max;
+            size_t i = rand_next(r) % (n + 1);
+            size_t rank = 0, count = 0;
+            for (size_t j = 0; j < n; j++) {
+                rank += j < i && symbols[j] == c;
+                count += symbols[j] == c;
+            }
+            fail |= zp7_wavelet_rank(&wm, c, i) != rank;
+
+            size_t pos;
+            if (count) {
+                size_t k = rand_next(r) % count, j = 0;
+                for (size_t seen = 0; ; j++) {
+                    if (symbols[j] == c && seen++ == k)
+                        break;
+                }
+                fail |= zp7_wavelet_select(&wm, c, k, &pos) != 0 || pos != j;
+            }
+            fail |= zp7_wavelet_select(&wm, c, count, &pos) !=
+                ZP7_WAVELET_ERR_RANGE;
+        }
+        if (fail) {
+            printf("FAIL WAVELET: n=%zu bits=%d\n", n, n_bits);
+            exit(1);
+        }
+        zp7_wavelet_free(&wm);
+    }
+
+    // Symbol sizes outside 1 to 32 bits are rejected
+    zp7_wavelet_t wm;
+    int bad_sizes[] = { -1, 0, 33 };
+    for (int i = 0; i < (int)ARRAY_SIZE(bad_sizes); i++) {
+        if (zp7_wavelet_build(&wm, symbols, 10, bad_sizes[i]) !=
+                ZP7_WAVELET_ERR_RANGE) {
+            printf("FAIL WAVELET: bits=%d accepted\n", bad_sizes[i]);
+            exit(1);
+        }
+    }
+}
+
+// For checking the radix sort: sort by key, then by original position, so
+// the order is stable
+typedef struct {
+    uint64_t key;
+    size_t index;
+    uint64_t value;
+} sort_entry_t;
+
+static int sort_entry_cmp(const void *a, const void *b) {
+    const sort_entry_t *x = (const sort_entry_t *)a;
+    const sort_entry_t *y = (const sort_entry_t *)b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Test the radix sort with masks of all sizes and various digit sizes,
+// with few distinct keys to check the stability
+void test_sort(rand_ctx_t *r) {
+    enum { N_VALUES = 5000 };
+    static uint64_t data[N_VALUES], tmp[N_VALUES];
+    static sort_entry_t expected[N_VALUES];
+    int digits[] = { 8, 11, 1, 5 };
+    for (int test = 0; test < 300; test++) {
+        size_t n = rand_next(r) % N_VALUES;
+        uint64_t mask = rand_next(r);
+        for (int i = test % 4; i > 0; i--)
+            mask &= rand_next(r);
+        if (test % 50 == 0)
+            mask = test % 100 ? -1ULL : 0;
+        for (size_t i = 0; i < n; i++) {
+            data[i] = rand_next(r);
+            if (test & 1)
+                data[i] &= ~(mask & rand_next(r) & rand_next(r));
+            expected[i].key = ref_pext_64(data[i], mask);
+            expected[i].index = i;
+            expected[i].value = data[i];
+        }
+        qsort(expected, n, sizeof(sort_entry_t), sort_entry_cmp);
+
+        int digit_bits = digits[test % ARRAY_SIZE(digits)];
+        int fail = zp7_radix_sort_64(data, tmp, n, mask, digit_bits) != 0;
+        for (size_t i = 0; i < n; i++)
+            fail |= data[i] != expected[i].value;
+        if (fail) {
+            printf("FAIL SORT: n=%zu mask=%016llx digits=%d\n", n,
+                    mask, digit_bits);
+            exit(1);
+        }
+    }
+    if (zp7_radix_sort_64(data, tmp, 10, -1ULL, 12) != ZP7_SORT_ERR_DIGIT) {
+        printf("FAIL SORT: digit size not rejected\n");
+        exit(1);
+    }
+}
+
+// Test scans of packed codes against comparisons of the codes themselves,
+// for every predicate and a range of code sizes. The constants are often
+// taken from the column, so that equality matches.
+void test_scan(rand_ctx_t *r) {
+    enum { N_CODES = 3000 };
+    static uint32_t codes[N_CODES];
+    static uint64_t packed[N_CODES], result[N_CODES / 64 + 1];
+    int sizes[] = { 1, 3, 7, 12, 20, 31, 32 };
+    for (int test = 0; test < 500; test++) {
+        size_t n = rand_next(r) % N_CODES;
+        int code_bits = sizes[test % ARRAY_SIZE(sizes)];
+        uint32_t max = (uint32_t)(-1ULL >> (64 - code_bits));
+        uint32_t range = (uint32_t)rand_next(r) & max;
+        for (size_t i = 0; i < n; i++)
+            codes[i] = (uint32_t)rand_next(r) % ((uint64_t)range + 1);
+        zp7_scan_pack(packed, codes, n, code_bits);
+
+        int op = test / ARRAY_SIZE(sizes) % 4;
+        uint32_t lo = (uint32_t)rand_next(r) & max;
+        uint32_t hi = (uint32_t)rand_next(r) & max;
+        if (n && test & 1)
+            lo = codes[rand_next(r) % n];
+        if (n && test & 2)
+            hi = codes[rand_next(r) % n];
+
+        memset(result, 0xAA, sizeof(result));
+        int fail = zp7_scan_64(result, packed, n, code_bits, op, lo, hi) != 0;
+        for (size_t i = 0; i < n; i++) {
+            uint32_t x = codes[i];
+            int expected = op == ZP7_SCAN_EQ ? x == lo :
+                op == ZP7_SCAN_LT ? x < lo :
+                op == ZP7_SCAN_GT ? x > lo : lo <= x && x <= hi;
+            fail |= (int)(result[i / 64] >> (i % 64) & 1) != expected;
+        }
+        if (n % 64)
+            fail |= result[n / 64] >> (n % 64) != 0;
+        if (fail) {
+            printf("FAIL SCAN: n=%zu bits=%d op=%d\n", n, code_bits, op);
+            exit(1);
+        }
+    }
+
+    // Bad code sizes and predicates are rejected
+    int bad_sizes[] = { 0, 33 }, bad_ops[] = { -1, 4 };
+    for (int i = 0; i < 2; i++) {
+        if (zp7_scan_64(result, packed, 10, bad_sizes[i], ZP7_SCAN_EQ, 0,
+                    0) != ZP7_SCAN_ERR_BITS ||
+                zp7_scan_64(result, packed, 10, 8, bad_ops[i], 0, 0) !=
+                    ZP7_SCAN_ERR_OP) {
+            printf("FAIL SCAN: bad arguments accepted\n");
+            exit(1);
+        }
+    }
+}
+
+// Test merging PDEP into existing words, single and bulk. The arrays go up
+// to a few thousand words, so the bulk kernels get used where available.
+void test_merge(rand_ctx_t *r) {
+    enum { N_WORDS = 3000 };
+    static uint64_t src[N_WORDS], dst[N_WORDS], expected[N_WORDS];
+    for (int test = 0; test < 2000; test++) {
+        uint64_t m = rand_next(r);
+        if (test & 1)
+            m &= rand_next(r);
+        if (test & 2)
+            m |= rand_next(r);
+        if (test < 2)
+            m = -test;
+        zp7_masks_64_t masks = zp7_ppp_64(m);
+        size_t n = test % 10 == 0 ? rand_next(r) % N_WORDS :
+            rand_next(r) % 100;
+        for (size_t i = 0; i < n; i++) {
+            src[i] = rand_next(r);
+            dst[i] = rand_next(r);
+            expected[i] = (dst[i] & ~m) | ref_pdep_64(src[i], m);
+            if (zp7_pdep_merge_pre_64(dst[i], src[i], &masks) != expected[i] ||
+                    zp7_pdep_merge_64(dst[i], src[i], m) != expected[i]) {
+                printf("FAIL MERGE: %016llx %016llx %016llx\n", m, dst[i],
+                        src[i]);
+                exit(1);
+            }
+        }
+        zp7_pdep_merge_pre_array_64(dst, src, n, &masks);
+        if (memcmp(dst, expected, n * sizeof(uint64_t))) {
+            printf("FAIL MERGE ARRAY: %016llx n=%zu\n", m, n);
+            exit(1);
+        }
+    }
+}
+
+// Test the MSB-aligned variants against the regular functions, with the
+// result (or input) shifted to the top
+void test_msb(rand_ctx_t *r) {
+    for (int test = 0; test < 1000000; test++) {
+        uint64_t m = rand_next(r);
+        if (test & 1)
+            m &= rand_next(r);
+        if (test & 2)
+            m |= rand_next(r);
+        if (test & 4)
+            m >>= rand_next(r) % 64;
+        if (test < 2)
+            m = -test;
+        uint64_t a = rand_next(r);
+        uint64_t pop = popcnt(m);
+        uint64_t shift = 64 - pop;
+
+        uint64_t pext = pop ? ref_pext_64(a, m) << shift : 0;
+        uint64_t pdep = pop ? ref_pdep_64(a >> shift, m) : 0;
+        zp7_msb_masks_64_t masks = zp7_ppp_msb_64(m);
+        if (zp7_pext_msb_pre_64(a, &masks) != pext ||
+                zp7_pext_msb_64(a, m) != pext ||
+                zp7_pdep_msb_pre_64(a, &masks) != pdep ||
+                zp7_pdep_msb_64(a, m) != pdep) {
+            printf("FAIL MSB: %016llx %016llx\n", m, a);
+            exit(1);
+        }
+    }
+}
+
+// Test bitshuffling against the layout built a bit at a time, for every
+// element size, and that unshuffling gives back the input. The stream API
+// is fed in random pieces and checked against shuffling each block.
+void test_bitshuffle(rand_ctx_t *r) {
+    enum { N_BYTES = 8 * 1000 };
+    static uint8_t src[N_BYTES], dst[N_BYTES], tmp[N_BYTES], back[N_BYTES],
+            expected[N_BYTES];
+    for (int test = 0; test < 800; test++) {
+        size_t s = test % 8 + 1;
+        size_t n = rand_next(r) % (N_BYTES / s + 1);
+        if (test & 8)
+            n &= ~(size_t)7;
+        for (size_t i = 0; i < n * s; i++)
+            src[i] = (uint8_t)rand_next(r);
+        if (test & 16) {
+            for (size_t i = 0; i < n * s; i++)
+                src[i] &= 0x81;
+        }
+
+        size_t n_8 = n & ~(size_t)7;
+        memset(expected, 0, n * s);
+        for (size_t i = 0; i < n_8; i++) {
+            for (size_t bit = 0; bit < 8 * s; bit++) {
+                int x = src[i * s + bit / 8] >> (bit % 8) & 1;
+                size_t out = bit * n_8 + i;
+                expected[out / 8] |= (uint8_t)(x << (out % 8));
+            }
+        }
+        memcpy(expected + n_8 * s, src + n_8 * s, (n - n_8) * s);
+
+        if (zp7_bitshuffle(dst, src, n, s, tmp) ||
+                memcmp(dst, expected, n * s)) {
+            printf("FAIL BITSHUFFLE: n=%zu size=%zu\n", n, s);
+            exit(1);
+        }
+        if (zp7_bitunshuffle(back, dst, n, s, tmp) ||
+                memcmp(back, src, n * s)) {
+            printf("FAIL BITUNSHUFFLE: n=%zu size=%zu\n", n, s);
+            exit(1);
+        }
+
+        // Streams, in both directions
+        int unshuffle = test & 1;
+        size_t block_elems = 8 * (rand_next(r) % 40 + 1);
+        if (test & 2)
+            block_elems = 0;
+        zp7_bitshuffle_stream_t stream[1];
+        if (zp7_bitshuffle_stream_init(stream, s, block_elems, unshuffle)) {
+            printf("FAIL BITSHUFFLE STREAM INIT\n");
+            exit(1);
+        }
+        size_t in = 0, out = 0;
+        while (in < n * s) {
+            size_t len = rand_next(r) % (stream->block_size * 2 + 1);
+            if (len > n * s - in)
+                len = n * s - in;
+            out += zp7_bitshuffle_stream_write(stream, dst + out, src + in,
+                    len);
+            in += len;
+        }
+        out += zp7_bitshuffle_stream_finish(stream, dst + out);
+        int fail = out != n * s;
+        for (size_t b = 0; b < n * s && !fail; b += stream->block_size) {
+            size_t size = n * s - b;
+            if (size > stream->block_size)
+                size = stream->block_size;
+            if (unshuffle)
+                zp7_bitunshuffle(expected, src + b, size / s, s, tmp);
+            else
+                zp7_bitshuffle(expected, src + b, size / s, s, tmp);
+            fail |= memcmp(dst + b, expected, size) != 0;
+        }
+        zp7_bitshuffle_stream_free(stream);
+        if (fail) {
+            printf("FAIL BITSHUFFLE STREAM: n=%zu size=%zu\n", n, s);
+            exit(1);
+        }
+    }
+    if (zp7_bitshuffle(dst, src, 8, 0, tmp) != ZP7_BITSHUFFLE_ERR_SIZE ||
+            zp7_bitshuffle(dst, src, 8, 9, tmp) != ZP7_BITSHUFFLE_ERR_SIZE) {
+        printf("FAIL BITSHUFFLE SIZE\n");
+        exit(1);
+    }
+}
+
+// Test bit streams: write a random mix of PEXT fields and plain fields,
+// single and bulk, then read them back the same way and check that each
+// PDEP gives back the masked input. Also check running out of room.
+void test_bitio(rand_ctx_t *r) {
+    enum { N_OPS = 300, N_BULK = 40 };
+    static uint64_t buf[N_OPS * N_BULK + 1], src[N_OPS][N_BULK],
+            dst[N_BULK];
+    static uint64_t masks[N_OPS];
+    static int kind[N_OPS], count[N_OPS];
+    for (int test = 0; test < 200; test++) {
+        zp7_bit_writer_t w[1];
+        zp7_bit_writer_init(w, buf, ARRAY_SIZE(buf));
+        uint64_t bits = 0;
+        for (int i = 0; i < N_OPS; i++) {
+            uint64_t m = rand_next(r);
+            if (i & 1)
+                m &= rand_next(r);
+            if (i & 2)
+                m >>= rand_next(r) % 64;
+            if (i % 16 == 0)
+                m = -(uint64_t)(i % 32 == 0);
+            masks[i] = m;
+            kind[i] = rand_next(r) % 3;
+            count[i] = kind[i] == 2 ? (int)(rand_next(r) % N_BULK) : 1;
+            for (int k = 0; k < count[i]; k++)
+                src[i][k] = rand_next(r);
+            zp7_masks_64_t p = zp7_ppp_64(m);
+            int n = (int)popcnt(m), err;
+            if (kind[i] == 0)
+                err = zp7_bit_append_pext(w, src[i][0], &p);
+            else if (kind[i] == 1)
+                err = zp7_bit_write(w, src[i][0], n);
+            else
+                err = zp7_bit_append_pext_array(w, src[i], count[i], &p);
+            bits += (uint64_t)n * count[i];
+            if (err || zp7_bit_writer_bits(w) != bits) {
+                printf("FAIL BITIO WRITE\n");
+                exit(1);
+            }
+        }
+        zp7_bit_writer_finish(w);
+
+        zp7_bit_reader_t rd[1];
+        zp7_bit_reader_init(rd, buf, w->n_words);
+        for (int i = 0; i < N_OPS; i++) {
+            uint64_t m = masks[i];
+            zp7_masks_64_t p = zp7_ppp_64(m);
+            int n = (int)popcnt(m), fail = 0;
+            if (kind[i] == 0)
+                fail = zp7_bit_read_pdep(rd, &p) != (src[i][0] & m);
+            else if (kind[i] == 1) {
+                uint64_t low = n < 64 ? (1ULL << n) - 1 : -1ULL;
+                fail = zp7_bit_read(rd, n) != (src[i][0] & low);
+            } else {
+                zp7_bit_read_pdep_array(rd, dst, count[i], &p);
+                for (int k = 0; k < count[i]; k++)
+                    fail |= dst[k] != (src[i][k] & m);
+            }
+            if (fail) {
+                printf("FAIL BITIO READ: op %d kind %d mask %016llx\n", i,
+                        kind[i], m);
+                exit(1);
+            }
+        }
+        // Everything left is padding
+        if (zp7_bit_reader_bits(rd) != bits ||
+                zp7_bit_read(rd, 64) != 0 || zp7_bit_read(rd, 64) != 0) {
+            printf("FAIL BITIO END\n");
+            exit(1);
+        }
+    }
+
+    // A one-word buffer takes 64 bits. More can be buffered, but not stored.
+    zp7_bit_writer_t w[1];
+    zp7_bit_writer_init(w, buf, 1);
+    if (zp7_bit_write(w, -1, 40) || zp7_bit_write(w, 0, 24) ||
+            zp7_bit_write(w, 1, 1) ||
+            zp7_bit_write(w, 1, 63) != ZP7_BITIO_ERR_FULL ||
+            zp7_bit_writer_bits(w) != 65 || buf[0] != 0xFFFFFFFFFFULL ||
+            zp7_bit_writer_finish(w) != ZP7_BITIO_ERR_FULL) {
+        printf("FAIL BITIO FULL\n");
+        exit(1);
+    }
+}
+
+// Scale a BITS-bit value to 8 or 16 bits by repeating its bits
+static uint32_t widen_channel(uint32_t x, int bits, int to) {
+    uint32_t r = 0;
+    for (int b = to - bits; b > -bits; b -= bits)
+        r |= b >= 0 ? x << b : x >> -b;
+    return r & ((1U << to) - 1);
+}
+
+// Test the pixel conversions against converting each channel separately.
+// Packing after unpacking gives back the input, except for the ignored top
+// bit of RGB555.
+void test_pixel(rand_ctx_t *r) {
+    enum { N = 3000 };
+    static uint16_t p16[N], back16[N], uyvy[3 * N];
+    static uint32_t p32[N], argb[N], back32[N];
+    static uint64_t rgba16[N];
+    for (int test = 0; test < 100; test++) {
+        size_t n = rand_next(r) % N;
+        for (size_t i = 0; i < n; i++) {
+            p16[i] = (uint16_t)rand_next(r);
+            p32[i] = (uint32_t)rand_next(r);
+        }
+        int fail = 0;
+
+        zp7_rgb565_to_argb8888(argb, p16, n);
+        zp7_argb8888_to_rgb565(back16, argb, n);
+        for (size_t i = 0; i < n; i++) {
+            uint32_t x = p16[i];
+            uint32_t e = 0xFF000000U | widen_channel(x >> 11, 5, 8) << 16 |
+                widen_channel(x >> 5 & 63, 6, 8) << 8 |
+                widen_channel(x & 31, 5, 8);
+            fail |= argb[i] != e || back16[i] != x;
+        }
+        zp7_rgb555_to_argb8888(argb, p16, n);
+        zp7_argb8888_to_rgb555(back16, argb, n);
+        for (size_t i = 0; i < n; i++) {
+            uint32_t x = p16[i];
+            uint32_t e = 0xFF000000U | widen_channel(x >> 10 & 31, 5, 8) << 16 |
+                widen_channel(x >> 5 & 31, 5, 8) << 8 |
+                widen_channel(x & 31, 5, 8);
+            fail |= argb[i] != e || back16[i] != (x & 0x7FFF);
+        }
+        if (fail) {
+            printf("FAIL PIXEL 16: n=%zu\n", n);
+            exit(1);
+        }
+
+        zp7_rgb10a2_to_rgba16(rgba16, p32, n);
+        zp7_rgba16_to_rgb10a2(back32, rgba16, n);
+        for (size_t i = 0; i < n; i++) {
+            uint32_t x = p32[i];
+            uint64_t e = (uint64_t)widen_channel(x >> 30, 2, 16) << 48;
+            for (int c = 0; c < 3; c++)
+                e |= (uint64_t)widen_channel(x >> (10 * c) & 1023, 10, 16) <<
+                    (16 * c);
+            fail |= rgba16[i] != e || back32[i] != x;
+        }
+        if (fail) {
+            printf("FAIL PIXEL RGB10A2: n=%zu\n", n);
+            exit(1);
+        }
+
+        zp7_v210_to_uyvy16(uyvy, p32, n);
+        zp7_uyvy16_to_v210(back32, uyvy, n);
+        for (size_t i = 0; i < n; i++) {
+            uint32_t x = p32[i];
+            for (int c = 0; c < 3; c++) {
+                fail |= uyvy[3 * i + c] !=
+                    widen_channel(x >> (10 * c) & 1023, 10, 16);
+            }
+            fail |= back32[i] != (x & 0x3FFFFFFF);
+        }
+        if (fail) {
+            printf("FAIL PIXEL V210: n=%zu\n", n);
+            exit(1);
+        }
+    }
+}
+
+// Reverse complement of an upper case sequence
+static void revcomp_simple(char *dst, const char *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        char c = src[n - 1 - i];
+        dst[i] = c == 'A' ? 'T' : c == 'C' ? 'G' : c == 'G' ? 'C' :
+            c == 'T' ? 'A' : c;
+    }
+}
+
+void test_dna(rand_ctx_t *r) {
+    enum { N = 3000 };
+    static const char letters[] = "ACGTNacgtn";
+    static char seq[N], upper[N], rc[N], back[N];
+    static uint64_t packed[N / 16 + 1], packed_rc[N / 16 + 1];
+    for (int test = 0; test < 1000; test++) {
+        size_t n = rand_next(r) % N;
+        if (test < 64)
+            n = test;
+        for (int bits = 2; bits <= 4; bits += 2) {
+            // N only has a 4-bit code
+            int n_letters = bits == 2 ? 4 : 5;
+            for (size_t i = 0; i < n; i++) {
+                int l = rand_next(r) % n_letters;
+                seq[i] = letters[l + (rand_next(r) & 1) * 5];
+                upper[i] = letters[l];
+            }
+            revcomp_simple(rc, upper, n);
+
+            size_t per_word = 64 / bits;
+            size_t n_words = (n + per_word - 1) / per_word;
+            int fail = 0;
+            if (bits == 2)
+                zp7_dna_pack2(packed, seq, n);
+            else
+                zp7_dna_pack4(packed, seq, n);
+            for (size_t i = 0; i < n_words * per_word; i++) {
+                uint64_t code = packed[i / per_word] >>
+                    (bits * (i % per_word)) & ((1 << bits) - 1);
+                // The codes are bits 1-2 or 1-3 of the character
+                uint64_t e = i < n ?
+                    (uint64_t)(seq[i] >> 1 & (bits == 2 ? 3 : 7)) : 0;
+                fail |= code != e;
+            }
+            memset(back, 0, n);
+            if (bits == 2)
+                zp7_dna_unpack2(back, packed, n);
+            else
+                zp7_dna_unpack4(back, packed, n);
+            fail |= memcmp(back, upper, n) != 0;
+
+            if (bits == 2)
+                zp7_dna_revcomp2(packed_rc, packed, n);
+            else
+                zp7_dna_revcomp4(packed_rc, packed, n);
+            // The padding has to stay zero
+            if (n % per_word)
+                fail |= packed_rc[n_words - 1] >> (bits * (n % per_word)) != 0;
+            if (bits == 2)
+                zp7_dna_unpack2(back, packed_rc, n);
+            else
+                zp7_dna_unpack4(back, packed_rc, n);
+            fail |= memcmp(back, rc, n) != 0;
+            if (fail) {
+                printf("FAIL DNA %d-BIT: n=%zu\n", bits, n);
+                exit(1);
+            }
+        }
+    }
+}
+
+// Test one of the backends with their own precomputed masks, single-word and
+// bulk. PREFIX is the prefix of the function names, e.g. zp7_gfni_ for
+// zp7_gfni_pre_64(), zp7_gfni_pext_pre_64(), etc.
+#define TEST_BACKEND(r, name, masks_t, prefix)                              \
+    do {                                                                    \
+        enum { N_WORDS = 100 };                                             \
+        uint64_t src[N_WORDS], dst[N_WORDS];                                \
+        for (int test = 0; test < 100000; test++) {                         \
+            uint64_t m = rand_next(r);                                      \
+            if (test & 1)                                                   \
+                m &= rand_next(r);                                          \
+            if (test & 2)                                                   \
+                m |= rand_next(r);                                          \
+            if (test < 2)                                                   \
+                m = -test;                                                  \
+            masks_t masks = prefix##pre_64(m);                              \
+            int n = rand_next(r) % N_WORDS;                                 \
+            for (int i = 0; i < n; i++)                                     \
+                src[i] = rand_next(r);                                      \
+                                                                            \
+            prefix##pext_pre_array_64(dst, src, n, &masks);                 \
+            for (int i = 0; i < n; i++) {                                   \
+                if (dst[i] != ref_pext_64(src[i], m) ||                     \
+                        prefix##pext_pre_64(src[i], &masks) != dst[i]) {    \
+                    printf("FAIL %s PEXT!\n", name);                        \
+                    printf("%016llx %016llx\n", m, src[i]);                 \
+                    exit(1);                                                \
+                }                                                           \
+            }                                                               \
+            prefix##pdep_pre_array_64(dst, src, n, &masks);                 \
+            for (int i = 0; i < n; i++) {                                   \
+                if (dst[i] != ref_pdep_64(src[i], m) ||                     \
+                        prefix##pdep_pre_64(src[i], &masks) != dst[i]) {    \
+                    printf("FAIL %s PDEP!\n", name);                        \
+                    printf("%016llx %016llx\n", m, src[i]);                 \
+                    exit(1);                                                \
+                }                                                           \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+
 int main() {
     rand_ctx_t r[1];
     rand_init(r);
@@ -75,11 +1183,24 @@ int main() {
         // For each input mask, test 32 random input values
         for (int i = 0; i < ARRAY_SIZE(masks); i++) {
             uint64_t m = masks[i];
+
+#ifndef ZP7_32BIT
+            // Test the portable PPP variants against the one in use
+            zp7_masks_64_t p_0 = zp7_ppp_64(m);
+            zp7_masks_64_t p_1 = zp7_ppp_serial_64(m);
+            zp7_masks_64_t p_2 = zp7_ppp_bytewise_64(m);
+            if (memcmp(&p_0, &p_1, sizeof(p_0)) ||
+                    memcmp(&p_0, &p_2, sizeof(p_0))) {
+                printf("FAIL PPP!\n");
+                printf("%016llx\n", m);
+                exit(1);
+            }
+#endif
             for (int j = 0; j < 32; j++) {
                 uint64_t input = rand_next(r);
 
                 // Test PEXT
-                uint64_t e_1 = _pext_u64(input, m);
+                uint64_t e_1 = ref_pext_64(input, m);
                 uint64_t e_2 = zp7_pext_64(input, m);
                 if (e_1 != e_2) {
                     printf("FAIL PEXT!\n");
@@ -90,7 +1211,7 @@ int main() {
                 tests++;
 
                 // Test PDEP
-                uint64_t d_1 = _pdep_u64(input, m);
+                uint64_t d_1 = ref_pdep_64(input, m);
                 uint64_t d_2 = zp7_pdep_64(input, m);
                 if (d_1 != d_2) {
                     printf("FAIL PDEP!\n");
@@ -102,6 +1223,34 @@ int main() {
             }
         }
     }
+
+    test_primitives(r);
+    test_table(r);
+    test_array(r);
+    test_batch(r);
+    test_parallel(r);
+    test_compact(r);
+    test_flatten(r);
+    test_merge(r);
+    test_msb(r);
+    test_roaring(r);
+    test_wavelet(r);
+    test_sort(r);
+    test_scan(r);
+    test_bitshuffle(r);
+    test_bitio(r);
+    test_pixel(r);
+    test_dna(r);
+#ifdef HAS_GFNI
+    TEST_BACKEND(r, "GFNI", zp7_gfni_masks_64_t, zp7_gfni_);
+#endif
+#ifdef HAS_BITALG
+    TEST_BACKEND(r, "BITALG", zp7_bitalg_masks_64_t, zp7_bitalg_);
+#endif
+#if defined(HAS_SSSE3) || defined(HAS_AVX2)
+    TEST_BACKEND(r, "PSHUFB", zp7_pshufb_masks_64_t, zp7_pshufb_);
+#endif
+
     printf("Passed %llu tests.\n", tests);
     return 0;
 }
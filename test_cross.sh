@@ -0,0 +1,139 @@
+#!/bin/sh
+# ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+#
+# Copyright (c) 2020 Zach Wegner
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# Cross-build test.c and bench.c for the backends that don't run on x86,
+# run the tests under qemu user-mode emulation, and compare each backend's
+# benchmarks against the portable code built for the same target:
+#
+#     ./test_cross.sh [aarch64] [sve2] [riscv64]
+#
+# Without arguments, all of them are run. The compilers and emulators come
+# from these variables, shown with their defaults:
+#
+#     AARCH64_CC="aarch64-linux-gnu-gcc"
+#     AARCH64_CLANG="clang --target=aarch64-linux-gnu"
+#     RISCV64_CC="riscv64-linux-gnu-gcc"
+#     QEMU_AARCH64="qemu-aarch64"
+#     QEMU_RISCV64="qemu-riscv64"
+#
+# Benchmark numbers under qemu only show the emulator's speed. On real
+# hardware, set the QEMU variable to an empty string to run the binaries
+# directly.
+
+set -e
+
+AARCH64_CC=${AARCH64_CC:-aarch64-linux-gnu-gcc}
+AARCH64_CLANG=${AARCH64_CLANG:-clang --target=aarch64-linux-gnu}
+RISCV64_CC=${RISCV64_CC:-riscv64-linux-gnu-gcc}
+QEMU_AARCH64=${QEMU_AARCH64-qemu-aarch64}
+QEMU_RISCV64=${QEMU_RISCV64-qemu-riscv64}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# Build test.c and bench.c as test-NAME and bench-NAME, with the compiler
+# command CC and the flags FLAGS
+build() {
+    name=$1 cc=$2 flags=$3
+    echo "== Building $name: $cc $flags"
+    $cc -O2 $flags -static -pthread test.c -o "$dir/test-$name"
+    $cc -O3 $flags -static -pthread bench.c -o "$dir/bench-$name"
+}
+
+# Run a built binary with the emulator QEMU and its CPU model, if any
+run() {
+    qemu=$1 cpu=$2
+    shift 2
+    if [ -z "$qemu" ]; then
+        "$@"
+    elif [ -n "$cpu" ]; then
+        $qemu -cpu "$cpu" "$@"
+    else
+        $qemu "$@"
+    fi
+}
+
+# AArch64: the PMULL PPP and NEON popcount against the portable code
+test_aarch64() {
+    build aarch64-pmull "$AARCH64_CC" \
+        "-march=armv8-a+crypto -DHAS_PMULL -DHAS_NEON"
+    build aarch64-portable "$AARCH64_CC" "-march=armv8-a"
+    for v in pmull portable; do
+        echo "== Testing aarch64-$v"
+        run "$QEMU_AARCH64" "" "$dir/test-aarch64-$v"
+    done
+    for v in pmull portable; do
+        echo "== Benchmarking aarch64-$v"
+        run "$QEMU_AARCH64" "" "$dir/bench-aarch64-$v" ppp
+    done
+}
+
+# AArch64 with SVE2 BitPerm, built with both GCC and Clang. The tests and
+# the array benchmark run on qemu's max CPU, which has BitPerm, and on a
+# Cortex-A72, which has no SVE at all, so the arrays take the fallback path.
+# Without qemu they only run on the host's CPU.
+test_sve2() {
+    flags="-march=armv8-a+crypto -DHAS_PMULL -DHAS_NEON -DHAS_SVE2_BITPERM"
+    build sve2-gcc "$AARCH64_CC" "$flags"
+    build sve2-clang "$AARCH64_CLANG" "$flags"
+    cpus="max cortex-a72"
+    [ -n "$QEMU_AARCH64" ] || cpus=host
+    for v in gcc clang; do
+        for cpu in $cpus; do
+            echo "== Testing sve2-$v on $cpu"
+            run "$QEMU_AARCH64" "${cpu#host}" "$dir/test-sve2-$v"
+        done
+    done
+    for v in gcc clang; do
+        for cpu in $cpus; do
+            echo "== Benchmarking sve2-$v on $cpu"
+            run "$QEMU_AARCH64" "${cpu#host}" "$dir/bench-sve2-$v" array
+        done
+    done
+}
+
+# RISC-V: the Zbc PPP and Zbb popcount against the portable code
+test_riscv64() {
+    build riscv64-zbc "$RISCV64_CC" "-march=rv64gc_zbb_zbc -DHAS_ZBC -DHAS_ZBB"
+    build riscv64-portable "$RISCV64_CC" "-march=rv64gc"
+    for v in zbc portable; do
+        echo "== Testing riscv64-$v"
+        run "$QEMU_RISCV64" max "$dir/test-riscv64-$v"
+    done
+    for v in zbc portable; do
+        echo "== Benchmarking riscv64-$v"
+        run "$QEMU_RISCV64" max "$dir/bench-riscv64-$v" ppp
+    done
+}
+
+for target in ${*:-aarch64 sve2 riscv64}; do
+    case $target in
+        aarch64) test_aarch64 ;;
+        sve2) test_sve2 ;;
+        riscv64) test_riscv64 ;;
+        *)
+            echo "unknown target: $target" >&2
+            exit 2
+            ;;
+    esac
+done
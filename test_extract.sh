@@ -0,0 +1,82 @@
+#!/bin/sh
+# ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+#
+# Copyright (c) 2020 Zach Wegner
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# Test zp7-extract end to end: run it on the same input with -o, with stdout
+# redirected to a file (both new and appended to), through a pipe, and with
+# the input from a pipe, and check that every way gives the same output. An
+# all-ones mask gives a known answer: the input, zero-padded to whole words.
+# Run it from the top of the tree:
+#
+#     ./test_extract.sh
+#
+# CC and CFLAGS are used to build the tool.
+
+set -e
+
+CC=${CC:-cc}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+$CC -O2 $CFLAGS -pthread zp7_extract.c -o "$dir/zp7-extract"
+x="$dir/zp7-extract"
+
+fail() {
+    echo "FAIL EXTRACT: $1"
+    exit 1
+}
+
+# A few MB, so the output takes several blocks, with a partial word at the
+# end
+head -c 5000003 /dev/urandom > "$dir/in.bin"
+
+# The known answer for the all-ones mask
+cp "$dir/in.bin" "$dir/padded.bin"
+printf '\0\0\0\0\0' >> "$dir/padded.bin"
+"$x" -q -m 0xffffffffffffffff -o "$dir/ones.bin" "$dir/in.bin"
+cmp -s "$dir/ones.bin" "$dir/padded.bin" || fail "all-ones mask"
+
+for op in "" -d; do
+    for threads in 1 0; do
+        args="-q $op -t $threads -m 0xff00ff00f0f0f0f0,0x123456789abcdef0"
+        "$x" $args -o "$dir/ref.bin" "$dir/in.bin"
+
+        "$x" $args "$dir/in.bin" > "$dir/stdout.bin"
+        cmp -s "$dir/ref.bin" "$dir/stdout.bin" || fail "stdout to a file"
+
+        printf 'existing' > "$dir/append.bin"
+        "$x" $args "$dir/in.bin" >> "$dir/append.bin"
+        { printf 'existing'; cat "$dir/ref.bin"; } > "$dir/expected.bin"
+        cmp -s "$dir/expected.bin" "$dir/append.bin" ||
+            fail "stdout appended to a file"
+
+        "$x" $args "$dir/in.bin" | cat > "$dir/pipe.bin"
+        cmp -s "$dir/ref.bin" "$dir/pipe.bin" || fail "stdout to a pipe"
+
+        cat "$dir/in.bin" | "$x" $args -o "$dir/stream.bin"
+        cmp -s "$dir/ref.bin" "$dir/stream.bin" || fail "input from a pipe"
+
+        cat "$dir/in.bin" | "$x" $args | cat > "$dir/both.bin"
+        cmp -s "$dir/ref.bin" "$dir/both.bin" || fail "pipes on both sides"
+    done
+done
+echo "Passed zp7-extract tests."
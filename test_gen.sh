@@ -0,0 +1,156 @@
+#!/bin/sh
+# ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+#
+# Copyright (c) 2020 Zach Wegner
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# Test zp7-gen: generate functions for a list of masks that covers all three
+# forms (stages, runs and multiply), and check them against zp7_pext_64() and
+# zp7_pdep_64() on random inputs. Also check that a bad input line doesn't
+# leave a truncated header behind, and that the generated code pasted into
+# zp7_pixel.c and zp7_dna.c is what zp7-gen makes of the masks listed with
+# it. Run it from the top of the tree:
+#
+#     ./test_gen.sh
+#
+# CC and CFLAGS are used to build the check, e.g. CFLAGS="-march=native
+# -DHAS_CLMUL -DHAS_BZHI -DHAS_POPCNT" to compare against the native paths.
+
+set -e
+
+CC=${CC:-cc}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+$CC -O2 zp7_gen.c -o "$dir/zp7-gen"
+
+cat > "$dir/masks.txt" <<MASKS
+zero        0
+one         1
+top         0x8000000000000000
+all         0xffffffffffffffff
+low         0xff
+field       0x0000ffff00000000
+two_fields  0xff000000000000ff
+nibbles     0x0f0f0f0f0f0f0f0f
+odd         0xaaaaaaaaaaaaaaaa
+even        0x5555555555555555
+diag        0x8040201008040201
+bytes_lsb   0x0101010101010101
+rgb565_r    0xf800f800f800f800
+dna_lo      0x0606060606060606
+sparse      0x1000000100001001
+mixed       0x123456789abcdef0
+dense       0xfedcba9876543210
+random_1    0x9e3779b97f4a7c15
+random_2    0xc2b2ae3d27d4eb4f
+random_3    0x165667b19e3779f9
+MASKS
+
+"$dir/zp7-gen" -p gen -o "$dir/masks.h" "$dir/masks.txt"
+for form in stages runs multiply; do
+    if ! grep -q ": $form, " "$dir/masks.h"; then
+        echo "FAIL GEN: no mask uses the $form form"
+        exit 1
+    fi
+done
+
+# A table of the generated functions, one line per mask
+awk '{ printf "    { \"%s\", %s, gen_pext_%s, gen_pdep_%s },\n",
+        $1, $2, $1, $1 }' "$dir/masks.txt" > "$dir/table.h"
+
+cat > "$dir/check.c" <<'CHECK'
+#include <stdio.h>
+
+#include "zp7.c"
+#include "masks.h"
+
+typedef struct {
+    const char *name;
+    uint64_t mask;
+    uint64_t (*pext)(uint64_t);
+    uint64_t (*pdep)(uint64_t);
+} gen_t;
+
+static const gen_t gens[] = {
+#include "table.h"
+};
+
+int main(void) {
+    uint64_t x = 0x89ABCDEF01234567ULL;
+    for (size_t g = 0; g < sizeof(gens) / sizeof(gens[0]); g++) {
+        for (int i = 0; i < 100000; i++) {
+            // xorshift64, with the all-zero and all-one inputs thrown in
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            uint64_t a = i == 0 ? 0 : i == 1 ? ~0ULL : x;
+            if (gens[g].pext(a) != zp7_pext_64(a, gens[g].mask) ||
+                    gens[g].pdep(a) != zp7_pdep_64(a, gens[g].mask)) {
+                printf("FAIL GEN: %s a=%016llx\n", gens[g].name,
+                        (unsigned long long)a);
+                return 1;
+            }
+        }
+    }
+    printf("Passed %zu masks.\n", sizeof(gens) / sizeof(gens[0]));
+    return 0;
+}
+CHECK
+
+$CC -O2 $CFLAGS -I. -I"$dir" "$dir/check.c" -o "$dir/check"
+"$dir/check"
+
+# A bad line fails, and leaves the existing header untouched
+cp "$dir/masks.h" "$dir/old.h"
+if printf 'a 0xff\nb zz\n' | "$dir/zp7-gen" -o "$dir/masks.h" 2> /dev/null; then
+    echo "FAIL GEN: bad input accepted"
+    exit 1
+fi
+if ! cmp -s "$dir/masks.h" "$dir/old.h" || [ -e "$dir/masks.h.tmp" ]; then
+    echo "FAIL GEN: bad input changed the output"
+    exit 1
+fi
+
+# The pasted code follows a comment naming the prefix and listing the masks,
+# and has to match zp7-gen's output for them, minus the include guard
+for src in zp7_pixel.c zp7_dna.c; do
+    prefix=$(sed -n 's|^// Output of zp7-gen -p \([a-z0-9_]*\) .*|\1|p' "$src")
+    sed -n '/^\/\/ Output of zp7-gen/,/^$/p' "$src" |
+        sed -n 's|^//     \([a-z0-9_]*\)  *\(0x[0-9A-Fa-f]*\)$|\1 \2|p' \
+        > "$dir/listed.txt"
+    "$dir/zp7-gen" -p "$prefix" "$dir/listed.txt" |
+        sed '1,/^#include <stdint.h>$/d' | sed '1d;$d' | sed '$d' \
+        > "$dir/expected.c"
+    start=$(grep -n -x -F "$(head -n 1 "$dir/expected.c")" "$src" | head -n 1 |
+        cut -d: -f1)
+    lines=$(wc -l < "$dir/expected.c")
+    if [ -z "$start" ] || [ ! -s "$dir/listed.txt" ]; then
+        echo "FAIL GEN: no generated code found in $src"
+        exit 1
+    fi
+    sed -n "$start,$((start + lines - 1))p" "$src" > "$dir/pasted.c"
+    if ! cmp -s "$dir/expected.c" "$dir/pasted.c"; then
+        echo "FAIL GEN: $src doesn't match zp7-gen -p $prefix:"
+        diff -u "$dir/expected.c" "$dir/pasted.c"
+        exit 1
+    fi
+done
+echo "Generated code in zp7_pixel.c and zp7_dna.c is up to date."
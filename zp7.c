@@ -20,11 +20,48 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#ifndef ZP7_C
+#define ZP7_C
+
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
-#if defined(HAS_CLMUL) || defined(HAS_BZHI) || defined(HAS_POPCNT)
+#if defined(HAS_CLMUL) || defined(HAS_BZHI) || defined(HAS_POPCNT) || \
+    defined(HAS_GFNI) || defined(HAS_BITALG) || defined(HAS_SSSE3) || \
+    defined(HAS_AVX2)
 #   include <immintrin.h>
 #endif
+#if defined(HAS_PMULL) || defined(HAS_NEON)
+#   include <arm_neon.h>
+#endif
+#ifdef HAS_SVE2_BITPERM
+#   include <arm_sve.h>
+#   include <sys/auxv.h>
+#endif
+
+// Moves between 64-bit integers and the low lane of an XMM register.
+// _mm_cvtsi64_si128() and _mm_cvtsi128_si64() only exist on x86-64, so
+// 32-bit x86 builds each half separately.
+#if defined(HAS_GFNI) || defined(HAS_BITALG) || defined(HAS_SSSE3) || \
+    defined(HAS_AVX2)
+static inline __m128i xmm_from_64(uint64_t a) {
+#if UINTPTR_MAX == 0xFFFFFFFF
+    return _mm_set_epi32(0, 0, (int)(a >> 32), (int)a);
+#else
+    return _mm_cvtsi64_si128(a);
+#endif
+}
+
+static inline uint64_t xmm_to_64(__m128i x) {
+#if UINTPTR_MAX == 0xFFFFFFFF
+    return (uint32_t)_mm_cvtsi128_si32(x) |
+        (uint64_t)(uint32_t)_mm_cvtsi128_si32(_mm_srli_epi64(x, 32)) << 32;
+#else
+    return _mm_cvtsi128_si64(x);
+#endif
+}
+#endif
 
 // ZP7: branchless PEXT/PDEP replacement code for non-Intel processors
 //
@@ -65,6 +102,10 @@
 // For processors with the CLMUL instructions (most x86 CPUs since ~2010), we
 // can do the parallel prefix XOR and left shift in one instruction, by
 // doing a carry-less multiply by -2. This is enabled with the HAS_CLMUL define.
+// AArch64 processors with the crypto extensions have the same operation in the
+// PMULL instruction, which is enabled with the HAS_PMULL define, and RISC-V
+// processors with the Zbc extension have it in the CLMUL instruction, which is
+// enabled with the HAS_ZBC define.
 //
 // Anyways, once we have these six 64-bit values of the PPP, we can use each
 // PPP bit to shift input bits by a power of two. That is, input bits that are
@@ -87,12 +128,31 @@
 
 #define N_BITS      (6)
 
+// On 32-bit hosts, every 64-bit shift and AND above turns into a sequence of
+// instructions on register pairs. Instead, we treat a 64-bit PEXT/PDEP as two
+// independent 32-bit ones on the halves of the input, each with its own
+// five-value PPP, and merge the results with a shift by the popcount of the
+// low half of the mask. This is enabled automatically for 32-bit targets, and
+// can be forced on elsewhere (mostly for testing) by defining ZP7_32BIT.
+#if !defined(ZP7_32BIT) && UINTPTR_MAX == 0xFFFFFFFF
+#   define ZP7_32BIT
+#endif
+
+#ifdef ZP7_32BIT
+typedef struct {
+    uint64_t mask;
+    // PPP for the low and high halves of the mask
+    uint32_t ppp_bit_32[2][N_BITS - 1];
+    // Popcount of the low and high halves of the mask
+    uint32_t pop_32[2];
+} zp7_masks_64_t;
+#else
 typedef struct {
     uint64_t mask;
     uint64_t ppp_bit[N_BITS];
 } zp7_masks_64_t;
+#endif
 
-#ifndef HAS_CLMUL
 // If we don't have access to the CLMUL instruction, emulate it with
 // shifts and XORs
 static inline uint64_t prefix_sum(uint64_t x) {
@@ -100,6 +160,24 @@ static inline uint64_t prefix_sum(uint64_t x) {
         x ^= x << (1 << i);
     return x;
 }
+
+// Low 64 bits of a carry-less multiply, for the architectures where that's a
+// scalar operation. On x86, CLMUL works on XMM registers, so that case is
+// handled separately.
+#if defined(HAS_PMULL)
+static inline uint64_t clmul_64(uint64_t a, uint64_t b) {
+    // poly64_t is its own type in GCC, and not implicitly converted
+    poly128_t r = vmull_p64((poly64_t)a, (poly64_t)b);
+    return vgetq_lane_u64(vreinterpretq_u64_p128(r), 0);
+}
+#elif defined(HAS_ZBC)
+// Compilers don't consistently provide intrinsics for Zbc yet, so use
+// inline assembly
+static inline uint64_t clmul_64(uint64_t a, uint64_t b) {
+    uint64_t r;
+    __asm__("clmul %0, %1, %2" : "=r"(r) : "r"(a), "r"(b));
+    return r;
+}
 #endif
 
 #ifndef HAS_POPCNT
@@ -116,18 +194,242 @@ uint64_t popcnt_64(uint64_t x) {
 }
 #endif
 
+// Population count, with whatever instructions are available. On AArch64,
+// there's no scalar popcount, but the NEON CNT instruction counts the bits in
+// each byte of a vector, which we can then sum across the vector. On RISC-V,
+// the Zbb extension has CPOP.
+static inline uint64_t popcnt(uint64_t x) {
+#if defined(HAS_POPCNT) && defined(ZP7_32BIT)
+    return _mm_popcnt_u32((uint32_t)x) + _mm_popcnt_u32((uint32_t)(x >> 32));
+#elif defined(HAS_POPCNT)
+    return _popcnt64(x);
+#elif defined(HAS_NEON)
+    return vaddv_u8(vcnt_u8(vcreate_u8(x)));
+#elif defined(HAS_ZBB)
+    // GCC and Clang compile this to CPOP when Zbb is enabled
+    return __builtin_popcountll(x);
+#else
+    return popcnt_64(x);
+#endif
+}
+
+#ifndef ZP7_32BIT
+
+// Portable PPP, serial version: five prefix XORs in a row, one per bit of
+// the PPP, each one depending on the carries from the previous. That's a
+// dependency chain of about 60 shift/XOR ops, which is what we're stuck with
+// without CLMUL. This is used instead of zp7_ppp_bytewise_64() below if
+// ZP7_SERIAL_PPP is defined.
+static inline zp7_masks_64_t zp7_ppp_serial_64(uint64_t mask) {
+    zp7_masks_64_t r;
+    r.mask = mask;
+
+    // Count *unset* bits
+    mask = ~mask;
+
+    for (int i = 0; i < N_BITS - 1; i++) {
+        // Do a 1-bit parallel prefix popcount, shifted left by 1
+        uint64_t bit = prefix_sum(mask << 1);
+        r.ppp_bit[i] = bit;
+
+        // Get the carry bit of the 1-bit parallel prefix popcount. On
+        // the next iteration, we will sum this bit to get the next mask
+        mask &= bit;
+    }
+    // The last iteration won't carry, so just use neg/shift. See the CLMUL
+    // case in zp7_ppp_64() for justification.
+    r.ppp_bit[N_BITS - 1] = -mask << 1;
+
+    return r;
+}
+
+// Portable PPP, bytewise version. Rather than building the PPP up one bit at
+// a time across all 64 bits, we split each count into two parts: the number of
+// unset mask bits in the bytes below each bit's byte, and the number of unset
+// bits below it in its own byte.
+//
+// The first part is the same for all eight bits of a byte, and is computed
+// horizontally: the usual SWAR popcount gives a count for each byte, and a
+// multiply by 0x0101010101010101 gives a prefix sum of those counts across the
+// bytes (the largest total is 64, so no byte overflows into the next). Shifting
+// that left by a byte makes it count only the bytes strictly below. We then
+// broadcast each bit of each byte's count to the whole byte, with another
+// multiply, which gives six "vertical" values just like the PPP.
+//
+// The second part is at most 7, so it only needs three vertical values. These
+// are built with a log-depth parallel prefix add within each byte: first the
+// count of unset bits in a window of one bit below each bit, then two, then
+// four, each step adding the previous result to a copy of itself shifted by
+// the window size, masked so nothing crosses a byte boundary.
+//
+// The two parts are independent, so they run in parallel, and are finally
+// summed with a vertical ripple-carry adder. Overall this is a few more
+// instructions than the serial version, but the dependency chain is about
+// half as long.
+static inline zp7_masks_64_t zp7_ppp_bytewise_64(uint64_t mask) {
+    const uint64_t m_1 = 0x5555555555555555LLU;
+    const uint64_t m_2 = 0x3333333333333333LLU;
+    const uint64_t m_4 = 0x0f0f0f0f0f0f0f0fLLU;
+    const uint64_t lo_bits = 0x0101010101010101LLU;
+
+    zp7_masks_64_t r;
+    r.mask = mask;
+
+    // Count *unset* bits
+    mask = ~mask;
+
+    // Per-byte popcount, prefix-summed across bytes and shifted up one byte
+    uint64_t bytes = mask - ((mask >> 1) & m_1);
+    bytes = (bytes & m_2) + ((bytes >> 2) & m_2);
+    bytes = (bytes + (bytes >> 4)) & m_4;
+    bytes = (bytes * lo_bits) << 8;
+
+    // Broadcast each bit of the byte counts across its byte
+    uint64_t hi[N_BITS];
+    for (int i = 0; i < N_BITS; i++)
+        hi[i] = ((bytes >> i) & lo_bits) * 0xFF;
+
+    // Within-byte counts, for windows of 1, 2 and 4 bits below each bit
+    uint64_t w1 = (mask << 1) & ~lo_bits;
+
+    uint64_t t_0 = (w1 << 1) & ~lo_bits;
+    uint64_t w2_0 = w1 ^ t_0;
+    uint64_t w2_1 = w1 & t_0;
+
+    const uint64_t hi_6 = 0xFCFCFCFCFCFCFCFCLLU;
+    uint64_t u_0 = (w2_0 << 2) & hi_6;
+    uint64_t u_1 = (w2_1 << 2) & hi_6;
+    uint64_t carry = w2_0 & u_0;
+    uint64_t w4_0 = w2_0 ^ u_0;
+    uint64_t w4_1 = w2_1 ^ u_1 ^ carry;
+    uint64_t w4_2 = (w2_1 & u_1) | (carry & (w2_1 ^ u_1));
+
+    // Window of 8 bits, which is the whole byte. The sum is at most 7, so
+    // there's no carry out of the top bit
+    const uint64_t hi_4 = 0xF0F0F0F0F0F0F0F0LLU;
+    uint64_t v_0 = (w4_0 << 4) & hi_4;
+    uint64_t v_1 = (w4_1 << 4) & hi_4;
+    uint64_t v_2 = (w4_2 << 4) & hi_4;
+    carry = w4_0 & v_0;
+    uint64_t lo[3];
+    lo[0] = w4_0 ^ v_0;
+    lo[1] = w4_1 ^ v_1 ^ carry;
+    carry = (w4_1 & v_1) | (carry & (w4_1 ^ v_1));
+    lo[2] = w4_2 ^ v_2 ^ carry;
+
+    // Add the two parts
+    carry = 0;
+    for (int i = 0; i < 3; i++) {
+        r.ppp_bit[i] = hi[i] ^ lo[i] ^ carry;
+        carry = (hi[i] & lo[i]) | (carry & (hi[i] ^ lo[i]));
+    }
+    for (int i = 3; i < N_BITS; i++) {
+        r.ppp_bit[i] = hi[i] ^ carry;
+        carry &= hi[i];
+    }
+
+    return r;
+}
+
+#endif
+
+#ifdef ZP7_32BIT
+
+// 32-bit versions of the PPP and PEXT/PDEP, used on the two halves of each
+// 64-bit operation on 32-bit hosts. These all work exactly like the 64-bit
+// versions, but with five PPP values instead of six.
+
+static inline uint32_t popcnt_32(uint32_t x) {
+#ifdef HAS_POPCNT
+    return _mm_popcnt_u32(x);
+#else
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0f0f0f0f;
+    return (x * 0x01010101) >> 24;
+#endif
+}
+
+static inline void ppp_32(uint32_t mask, uint32_t *ppp_bit) {
+    // Count *unset* bits
+    mask = ~mask;
+
+#ifdef HAS_CLMUL
+    // CLMUL is still available in 32-bit mode, and only the low 32 bits of
+    // the product matter
+    __m128i m = _mm_cvtsi32_si128(mask);
+    __m128i neg_2 = _mm_cvtsi32_si128(-2);
+    for (int i = 0; i < N_BITS - 2; i++) {
+        __m128i bit = _mm_clmulepi64_si128(m, neg_2, 0);
+        ppp_bit[i] = _mm_cvtsi128_si32(bit);
+        m = _mm_and_si128(m, bit);
+    }
+    ppp_bit[N_BITS - 2] = -(uint32_t)_mm_cvtsi128_si32(m) << 1;
+#else
+    for (int i = 0; i < N_BITS - 2; i++) {
+        uint32_t bit = mask << 1;
+        for (int j = 0; j < N_BITS - 1; j++)
+            bit ^= bit << (1 << j);
+        ppp_bit[i] = bit;
+        mask &= bit;
+    }
+    // The last iteration can't carry, as in the 64-bit version
+    ppp_bit[N_BITS - 2] = -mask << 1;
+#endif
+}
+
+static inline uint32_t pext_32(uint32_t a, uint32_t mask,
+        const uint32_t *ppp_bit) {
+    a &= mask;
+    for (int i = 0; i < N_BITS - 1; i++) {
+        uint32_t shift = 1 << i;
+        uint32_t bit = ppp_bit[i];
+        a = (a & ~bit) | ((a & bit) >> shift);
+    }
+    return a;
+}
+
+static inline uint32_t pdep_32(uint32_t a, uint32_t pop,
+        const uint32_t *ppp_bit) {
+    // Mask the low POP bits. As with the 64-bit version, a shift by the full
+    // width needs special handling
+#ifdef HAS_BZHI
+    a = _bzhi_u32(a, pop);
+#else
+    uint32_t pop_mask = (1U << (pop & 31)) & ~(pop >> 5);
+    a &= pop_mask - 1;
+#endif
+    for (int i = N_BITS - 2; i >= 0; i--) {
+        uint32_t shift = 1 << i;
+        uint32_t bit = ppp_bit[i] >> shift;
+        a = (a & ~bit) + ((a & bit) << shift);
+    }
+    return a;
+}
+
+#endif
+
 // Parallel-prefix-popcount. This is used by both the PEXT/PDEP polyfills.
 // It can also be called separately and cached, if the mask values will be used
 // more than once (these can be shared across PEXT and PDEP calls if they use
 // the same masks). 
 zp7_masks_64_t zp7_ppp_64(uint64_t mask) {
+#if defined(ZP7_32BIT)
+    zp7_masks_64_t r;
+    r.mask = mask;
+    for (int h = 0; h < 2; h++) {
+        uint32_t half = (uint32_t)(mask >> (32 * h));
+        ppp_32(half, r.ppp_bit_32[h]);
+        r.pop_32[h] = popcnt_32(half);
+    }
+    return r;
+#elif defined(HAS_CLMUL)
     zp7_masks_64_t r;
     r.mask = mask;
 
     // Count *unset* bits
     mask = ~mask;
 
-#ifdef HAS_CLMUL
     // Move the mask and -2 to XMM registers for CLMUL
     __m128i m = _mm_cvtsi64_si128(mask);
     __m128i neg_2 = _mm_cvtsi64_si128(-2LL);
@@ -149,27 +451,44 @@ zp7_masks_64_t zp7_ppp_64(uint64_t mask) {
     // bits set in ~mask. If two bits are set, one of them is the top bit, which
     // gets shifted out, since we're counting bits below each mask bit.
     r.ppp_bit[N_BITS - 1] = -_mm_cvtsi128_si64(m) << 1;
-#else
+
+    return r;
+#elif defined(HAS_PMULL) || defined(HAS_ZBC)
+    zp7_masks_64_t r;
+    r.mask = mask;
+
+    // Count *unset* bits
+    mask = ~mask;
+
+    // Same as the CLMUL case above, but the carry-less multiply works on
+    // general-purpose registers
     for (int i = 0; i < N_BITS - 1; i++) {
-        // Do a 1-bit parallel prefix popcount, shifted left by 1
-        uint64_t bit = prefix_sum(mask << 1);
+        uint64_t bit = clmul_64(mask, -2LL);
         r.ppp_bit[i] = bit;
-
-        // Get the carry bit of the 1-bit parallel prefix popcount. On
-        // the next iteration, we will sum this bit to get the next mask
         mask &= bit;
     }
-    // The last iteration won't carry, so just use neg/shift. See the CLMUL
-    // case above for justification.
     r.ppp_bit[N_BITS - 1] = -mask << 1;
-#endif
 
     return r;
+#elif defined(ZP7_SERIAL_PPP)
+    return zp7_ppp_serial_64(mask);
+#else
+    return zp7_ppp_bytewise_64(mask);
+#endif
 }
 
 // PEXT
 
 uint64_t zp7_pext_pre_64(uint64_t a, const zp7_masks_64_t *masks) {
+#ifdef ZP7_32BIT
+    // Extract each half separately, then put the high half's bits right
+    // above the low half's
+    uint32_t lo = pext_32((uint32_t)a, (uint32_t)masks->mask,
+            masks->ppp_bit_32[0]);
+    uint32_t hi = pext_32((uint32_t)(a >> 32), (uint32_t)(masks->mask >> 32),
+            masks->ppp_bit_32[1]);
+    return lo | ((uint64_t)hi << masks->pop_32[0]);
+#else
     // Mask only the bits that are set in the input mask. Otherwise they collide
     // with input bits and screw everything up
     a &= masks->mask;
@@ -183,6 +502,7 @@ uint64_t zp7_pext_pre_64(uint64_t a, const zp7_masks_64_t *masks) {
         a = (a & ~bit) | ((a & bit) >> shift);
     }
     return a;
+#endif
 }
 
 uint64_t zp7_pext_64(uint64_t a, uint64_t mask) {
@@ -192,31 +512,39 @@ uint64_t zp7_pext_64(uint64_t a, uint64_t mask) {
 
 // PDEP
 
-uint64_t zp7_pdep_pre_64(uint64_t a, const zp7_masks_64_t *masks) {
-#ifdef HAS_POPCNT
-    uint64_t popcnt = _popcnt64(masks->mask);
-#else
-    uint64_t popcnt = popcnt_64(masks->mask);
-#endif
-
-    // Mask just the bits that will end up in the final result--the low P bits,
-    // where P is the popcount of the mask. The other bits would collide.
-    // We need special handling for the mask==-1 case: because 64-bit shifts are
-    // implicitly modulo 64 on x86 (and (uint64_t)1 << 64 is technically
-    // undefined behavior in C), the regular "a &= (1 << pop) - 1" doesn't
-    // work: (1 << popcnt(-1)) - 1 == (1 << 64) - 1 == (1 << 0) - 1 == 0, but
-    // this should be -1. The BZHI instruction (introduced with BMI2, the same
-    // instructions as PEXT/PDEP) handles this properly, but isn't portable.
-
+#ifndef ZP7_32BIT
+// Mask just the bits that will end up in the final result--the low P bits,
+// where P is the popcount of the mask. The other bits would collide.
+// We need special handling for the mask==-1 case: because 64-bit shifts are
+// implicitly modulo 64 on x86 (and (uint64_t)1 << 64 is technically
+// undefined behavior in C), the regular "a &= (1 << pop) - 1" doesn't
+// work: (1 << popcnt(-1)) - 1 == (1 << 64) - 1 == (1 << 0) - 1 == 0, but
+// this should be -1. The BZHI instruction (introduced with BMI2, the same
+// instructions as PEXT/PDEP) handles this properly, but isn't portable.
+static inline uint64_t pdep_mask_input(uint64_t a, uint64_t pop) {
 #ifdef HAS_BZHI
-    a = _bzhi_u64(a, popcnt);
+    return _bzhi_u64(a, pop);
 #else
     // If we don't have BZHI, use a portable workaround.  Since (mask == -1)
     // is equivalent to popcnt(mask) >> 6, use that to mask out the 1 << 64
     // case.
-    uint64_t pop_mask = (1ULL << popcnt) & ~(popcnt >> 6);
-    a &= pop_mask - 1;
+    uint64_t pop_mask = (1ULL << pop) & ~(pop >> 6);
+    return a & (pop_mask - 1);
 #endif
+}
+#endif
+
+uint64_t zp7_pdep_pre_64(uint64_t a, const zp7_masks_64_t *masks) {
+#ifdef ZP7_32BIT
+    // The low half of the mask takes the low bits of the input, and the high
+    // half takes the bits right above those
+    uint32_t lo = pdep_32((uint32_t)a, masks->pop_32[0],
+            masks->ppp_bit_32[0]);
+    uint32_t hi = pdep_32((uint32_t)(a >> masks->pop_32[0]), masks->pop_32[1],
+            masks->ppp_bit_32[1]);
+    return lo | ((uint64_t)hi << 32);
+#else
+    a = pdep_mask_input(a, popcnt(masks->mask));
 
     // For each bit in the PPP, shift left only those bits that are set in
     // that bit's mask. We do this in the opposite order compared to PEXT
@@ -229,9 +557,1409 @@ uint64_t zp7_pdep_pre_64(uint64_t a, const zp7_masks_64_t *masks) {
         a = (a & ~bit) + ((a & bit) << shift);
     }
     return a;
+#endif
 }
 
 uint64_t zp7_pdep_64(uint64_t a, uint64_t mask) {
     zp7_masks_64_t masks = zp7_ppp_64(mask);
     return zp7_pdep_pre_64(a, &masks);
 }
+
+// PDEP into an existing word: (DST & ~mask) | PDEP(A, mask), for setting one
+// field of a word that holds others. The bits of DST outside the mask are
+// disjoint from everything in the last shift stage, so they're merged in
+// with the bits that stay put in that stage, in parallel with the shift,
+// which keeps the dependency chain as long as a plain PDEP.
+uint64_t zp7_pdep_merge_pre_64(uint64_t dst, uint64_t a,
+        const zp7_masks_64_t *masks) {
+#ifdef ZP7_32BIT
+    return (dst & ~masks->mask) | zp7_pdep_pre_64(a, masks);
+#else
+    a = pdep_mask_input(a, popcnt(masks->mask));
+    for (int i = N_BITS - 1; i >= 1; i--) {
+        uint64_t shift = 1 << i;
+        uint64_t bit = masks->ppp_bit[i] >> shift;
+        a = (a & ~bit) + ((a & bit) << shift);
+    }
+    uint64_t bit = masks->ppp_bit[0] >> 1;
+    return ((a & ~bit) | (dst & ~masks->mask)) + ((a & bit) << 1);
+#endif
+}
+
+uint64_t zp7_pdep_merge_64(uint64_t dst, uint64_t a, uint64_t mask) {
+    zp7_masks_64_t masks = zp7_ppp_64(mask);
+    return zp7_pdep_merge_pre_64(dst, a, &masks);
+}
+
+// MSB-aligned PEXT/PDEP
+//
+// MSB-first bitstreams (network protocols, video codecs, etc.) want the
+// extracted bits packed at the top of the word rather than the bottom, and
+// PDEP to take its input bits from the top. With the regular functions,
+// that's a shift by 64 minus the popcount around every call. Instead, these
+// variants mirror the whole algorithm: the PPP counts the unset mask bits
+// *above* each bit, PEXT shifts left by those counts, and PDEP shifts right.
+// Bit-reversing the mask turns one problem into the other, which is how the
+// masks are computed, so the precomputation is slower than zp7_ppp_64().
+// The PDEP input mask (the top popcount(mask) bits) is precomputed too, so
+// the per-call work is the same as for the regular functions, minus the
+// popcount.
+//
+// On 32-bit hosts, these just shift the results of the regular two-halves
+// code, with the shift precomputed.
+
+typedef struct {
+    uint64_t mask;
+    // The top popcount(mask) bits, which PDEP takes its input from
+    uint64_t top;
+#ifdef ZP7_32BIT
+    zp7_masks_64_t masks;
+    uint32_t shift;
+#else
+    uint64_t ppp_bit[N_BITS];
+#endif
+} zp7_msb_masks_64_t;
+
+#ifndef ZP7_32BIT
+static inline uint64_t bit_reverse_64(uint64_t x) {
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return __builtin_bswap64(x);
+}
+#endif
+
+zp7_msb_masks_64_t zp7_ppp_msb_64(uint64_t mask) {
+    zp7_msb_masks_64_t r;
+    uint64_t pop = popcnt(mask);
+    r.mask = mask;
+    r.top = pop ? -1ULL << (64 - pop) : 0;
+#ifdef ZP7_32BIT
+    r.masks = zp7_ppp_64(mask);
+    // With an empty mask, the result is zero anyway, so avoid shifting by 64
+    r.shift = pop ? (uint32_t)(64 - pop) : 0;
+#else
+    zp7_masks_64_t reversed = zp7_ppp_64(bit_reverse_64(mask));
+    for (int i = 0; i < N_BITS; i++)
+        r.ppp_bit[i] = bit_reverse_64(reversed.ppp_bit[i]);
+#endif
+    return r;
+}
+
+// PEXT, with the result in the top popcount(mask) bits
+uint64_t zp7_pext_msb_pre_64(uint64_t a, const zp7_msb_masks_64_t *masks) {
+#ifdef ZP7_32BIT
+    return zp7_pext_pre_64(a, &masks->masks) << masks->shift;
+#else
+    a &= masks->mask;
+    for (int i = 0; i < N_BITS; i++) {
+        uint64_t shift = 1 << i;
+        uint64_t bit = masks->ppp_bit[i];
+        a = (a & ~bit) | ((a & bit) << shift);
+    }
+    return a;
+#endif
+}
+
+uint64_t zp7_pext_msb_64(uint64_t a, uint64_t mask) {
+    zp7_msb_masks_64_t masks = zp7_ppp_msb_64(mask);
+    return zp7_pext_msb_pre_64(a, &masks);
+}
+
+// PDEP, with the input taken from the top popcount(mask) bits
+uint64_t zp7_pdep_msb_pre_64(uint64_t a, const zp7_msb_masks_64_t *masks) {
+#ifdef ZP7_32BIT
+    return zp7_pdep_pre_64(a >> masks->shift, &masks->masks);
+#else
+    a &= masks->top;
+    for (int i = N_BITS - 1; i >= 0; i--) {
+        uint64_t shift = 1 << i;
+        uint64_t bit = masks->ppp_bit[i] << shift;
+        a = (a & ~bit) | ((a & bit) >> shift);
+    }
+    return a;
+#endif
+}
+
+uint64_t zp7_pdep_msb_64(uint64_t a, uint64_t mask) {
+    zp7_msb_masks_64_t masks = zp7_ppp_msb_64(mask);
+    return zp7_pdep_msb_pre_64(a, &masks);
+}
+
+// Batches
+//
+// When PEXT/PDEP is needed for several unrelated (input, mask) pairs, doing
+// them one at a time leaves most of the processor idle: the PPP is a chain of
+// five dependent carry-less multiplies (or worse, without CLMUL), followed by
+// a chain of six dependent shift stages, and there's little else to do in the
+// meantime, especially on in-order cores. These functions do two or four
+// pairs at once, with the PPP steps and shift stages interleaved across the
+// pairs, so there are always independent instructions to issue. They
+// compute DST[I] = PEXT/PDEP(A[I], MASK[I]).
+//
+// On 32-bit hosts, each PEXT/PDEP is already two independent halves, so the
+// pairs are just done one at a time.
+
+#ifndef ZP7_32BIT
+static inline void ppp_batch(zp7_masks_64_t *masks, const uint64_t *mask,
+        int n) {
+#if defined(HAS_CLMUL)
+    // The same steps as zp7_ppp_64(), just interleaved
+    __m128i m[4];
+    __m128i neg_2 = _mm_cvtsi64_si128(-2LL);
+    for (int k = 0; k < n; k++) {
+        masks[k].mask = mask[k];
+        m[k] = _mm_cvtsi64_si128(~mask[k]);
+    }
+    for (int i = 0; i < N_BITS - 1; i++) {
+        for (int k = 0; k < n; k++) {
+            __m128i bit = _mm_clmulepi64_si128(m[k], neg_2, 0);
+            masks[k].ppp_bit[i] = _mm_cvtsi128_si64(bit);
+            m[k] = _mm_and_si128(m[k], bit);
+        }
+    }
+    for (int k = 0; k < n; k++)
+        masks[k].ppp_bit[N_BITS - 1] = -_mm_cvtsi128_si64(m[k]) << 1;
+#elif defined(HAS_PMULL) || defined(HAS_ZBC)
+    uint64_t m[4];
+    for (int k = 0; k < n; k++) {
+        masks[k].mask = mask[k];
+        m[k] = ~mask[k];
+    }
+    for (int i = 0; i < N_BITS - 1; i++) {
+        for (int k = 0; k < n; k++) {
+            uint64_t bit = clmul_64(m[k], -2LL);
+            masks[k].ppp_bit[i] = bit;
+            m[k] &= bit;
+        }
+    }
+    for (int k = 0; k < n; k++)
+        masks[k].ppp_bit[N_BITS - 1] = -m[k] << 1;
+#else
+    // The portable PPP is long enough that the compiler can interleave the
+    // inlined calls by itself
+    for (int k = 0; k < n; k++)
+        masks[k] = zp7_ppp_64(mask[k]);
+#endif
+}
+#endif
+
+static inline void pext_batch(uint64_t *dst, const uint64_t *a,
+        const uint64_t *mask, int n) {
+#ifdef ZP7_32BIT
+    for (int k = 0; k < n; k++)
+        dst[k] = zp7_pext_64(a[k], mask[k]);
+#else
+    zp7_masks_64_t masks[4];
+    ppp_batch(masks, mask, n);
+
+    uint64_t x[4];
+    for (int k = 0; k < n; k++)
+        x[k] = a[k] & mask[k];
+    for (int i = 0; i < N_BITS; i++) {
+        for (int k = 0; k < n; k++) {
+            uint64_t bit = masks[k].ppp_bit[i];
+            x[k] = (x[k] & ~bit) | ((x[k] & bit) >> (1 << i));
+        }
+    }
+    for (int k = 0; k < n; k++)
+        dst[k] = x[k];
+#endif
+}
+
+static inline void pdep_batch(uint64_t *dst, const uint64_t *a,
+        const uint64_t *mask, int n) {
+#ifdef ZP7_32BIT
+    for (int k = 0; k < n; k++)
+        dst[k] = zp7_pdep_64(a[k], mask[k]);
+#else
+    zp7_masks_64_t masks[4];
+    ppp_batch(masks, mask, n);
+
+    uint64_t x[4];
+    for (int k = 0; k < n; k++)
+        x[k] = pdep_mask_input(a[k], popcnt(mask[k]));
+    for (int i = N_BITS - 1; i >= 0; i--) {
+        for (int k = 0; k < n; k++) {
+            uint64_t bit = masks[k].ppp_bit[i] >> (1 << i);
+            x[k] = (x[k] & ~bit) + ((x[k] & bit) << (1 << i));
+        }
+    }
+    for (int k = 0; k < n; k++)
+        dst[k] = x[k];
+#endif
+}
+
+void zp7_pext_x2_64(uint64_t *dst, const uint64_t *a, const uint64_t *mask) {
+    pext_batch(dst, a, mask, 2);
+}
+
+void zp7_pext_x4_64(uint64_t *dst, const uint64_t *a, const uint64_t *mask) {
+    pext_batch(dst, a, mask, 4);
+}
+
+void zp7_pdep_x2_64(uint64_t *dst, const uint64_t *a, const uint64_t *mask) {
+    pdep_batch(dst, a, mask, 2);
+}
+
+void zp7_pdep_x4_64(uint64_t *dst, const uint64_t *a, const uint64_t *mask) {
+    pdep_batch(dst, a, mask, 4);
+}
+
+// GFNI
+//
+// Processors with GFNI and AVX-512 (Ice Lake, Zen 4 and later) have another
+// way of moving bits around: GF2P8AFFINEQB multiplies each byte by an 8x8 bit
+// matrix, with a separate matrix for each 64-bit lane. With the right matrix,
+// this can gather the bits of a byte selected by one byte of the mask to the
+// bottom of the byte, which replaces the PPP shifts by 1, 2 and 4. What's left
+// is moving whole bytes around, but not quite: the bits from each byte end up
+// at an arbitrary bit offset in the result (the popcount of the mask bits
+// below that byte), so each byte's bits can be split across two result bytes.
+//
+// To handle this, the matrix for each byte also rotates the gathered bits
+// left by the offset mod 8. The rotated bits from mask byte B then belong in
+// result byte (offset >> 3) (the "low" part, the bits that didn't wrap around)
+// and the next byte up (the "high" part, the bits that did). Those are masks
+// that only depend on the mask, so they're precomputed along with the
+// matrices. Since the matrix is per lane rather than per byte, byte B of the
+// input first has to be copied into lane B with a byte shuffle.
+//
+// For PEXT of a single word, we then AND each lane with byte masks that keep
+// the low/high parts in the right result bytes, and OR all the lanes together.
+// For PDEP, we go the other way: each lane B gathers the two input bytes that
+// feed result byte B, selects the low and high parts from them, and un-rotates
+// and scatters the bits within the byte with the inverse matrix.
+//
+// For the bulk functions, we process eight words at a time, transposing the
+// bytes so that lane B holds byte B of each word, which lets the matrix for
+// each byte apply to all eight words at once. PDEP works the same as above,
+// with 64-bit lane shuffles instead of byte shuffles. For PEXT, several lanes
+// can feed the same result byte, so we OR their low parts together with a
+// segmented scan (runs of lanes with the same target byte get combined into
+// the last lane of the run) before shuffling the lanes into place.
+//
+// All of this needs AVX-512 BW and VBMI as well as GFNI, and is enabled with
+// HAS_GFNI. It uses its own precomputed mask struct, since the PPP values
+// aren't needed at all. The matrices are more expensive to compute than the
+// PPP, so this is only worthwhile when a mask is reused many times.
+
+#if defined(HAS_GFNI) || defined(HAS_BITALG)
+
+// Byte shuffle that swaps byte B of lane W with byte W of lane B, so that
+// lane B holds byte B of each of eight words. This is its own inverse. The
+// bulk GFNI and BITALG functions both work on transposed blocks of words.
+static inline __m512i transpose_bytes_512(__m512i x) {
+    const __m512i index = _mm512_set_epi64(
+            0x3F372F271F170F07, 0x3E362E261E160E06,
+            0x3D352D251D150D05, 0x3C342C241C140C04,
+            0x3B332B231B130B03, 0x3A322A221A120A02,
+            0x3931292119110901, 0x3830282018100800);
+    return _mm512_permutexvar_epi8(index, x);
+}
+
+#endif
+
+#ifdef HAS_GFNI
+
+// Minimum length for the generic bulk functions to switch to GFNI
+#ifndef ZP7_GFNI_MIN_ARRAY
+#   define ZP7_GFNI_MIN_ARRAY  (1024)
+#endif
+
+typedef struct {
+    uint64_t mask;
+    // Per-lane matrices for gathering/rotating each byte (PEXT) and the
+    // inverse (PDEP)
+    __m512i pext_matrix;
+    __m512i pdep_matrix;
+    // For single-word PEXT: for each lane B, the bits of each result byte
+    // that come from mask byte B
+    __m512i pext_bytes;
+    // Rotated bits for each lane that go to the low result byte
+    __m512i lo_bits;
+    // The input lanes that feed each result lane, for PDEP
+    __m512i lo_index;
+    __m512i hi_index;
+    // For bulk PEXT: the last lane of the run of lanes feeding each result
+    // lane, and which result lanes have any such lanes
+    __m512i lo_last;
+    __m512i hi_last;
+    __mmask8 lo_valid;
+    __mmask8 hi_valid;
+    // Which lanes get combined with the lane 1, 2, and 4 below in the scan
+    __mmask8 scan[3];
+} zp7_gfni_masks_64_t;
+
+zp7_gfni_masks_64_t zp7_gfni_pre_64(uint64_t mask) {
+    // Each lane is built up as a 64-bit integer, with byte I of lane B at
+    // bits 8*I through 8*I+7
+    uint64_t pext_matrix[8], pdep_matrix[8], pext_bytes[8], lo_bits[8];
+    uint64_t lo_index[8], hi_index[8], lo_last[8] = { 0 }, hi_last[8] = { 0 };
+    uint8_t target[8];
+
+    zp7_gfni_masks_64_t r;
+    r.mask = mask;
+    r.lo_valid = r.hi_valid = 0;
+
+    // Number of mask bits below the current byte
+    uint64_t offset = 0;
+    for (int b = 0; b < 8; b++) {
+        uint32_t m = (mask >> (8 * b)) & 0xFF;
+        int rot = offset & 7;
+        int lo = offset >> 3;
+
+        // Build the matrices. Row 7-R of a matrix (that is, byte 7-R) selects
+        // the input bits for output bit R. Only loop over the set bits, since
+        // branching on every bit of a random mask mispredicts a lot.
+        pext_matrix[b] = pdep_matrix[b] = 0;
+        uint32_t bits = 0;
+        for (int k = 0; m; m &= m - 1, k++) {
+            int s = __builtin_ctz(m);
+            int rotated = (rot + k) & 7;
+            pext_matrix[b] |= (uint64_t)(1 << s) << (8 * (7 - rotated));
+            pdep_matrix[b] |= (uint64_t)(1 << rotated) << (8 * (7 - s));
+            bits |= 1 << rotated;
+        }
+        uint64_t lo_part = bits & (0xFF << rot);
+        uint64_t hi_part = bits & ~lo_part;
+
+        // The high part of lane 7 is always empty, since there aren't enough
+        // bits left to wrap around, so the shift by 64 is never used
+        pext_bytes[b] = lo_part << (8 * lo);
+        if (hi_part)
+            pext_bytes[b] |= hi_part << (8 * (lo + 1));
+        lo_bits[b] = lo_part * 0x0101010101010101ULL;
+
+        lo_index[b] = lo;
+        hi_index[b] = lo < 7 ? lo + 1 : 7;
+
+        // Result lanes for the scan. Lanes are visited in increasing order,
+        // so the last assignment wins.
+        target[b] = lo;
+        lo_last[lo] = b;
+        r.lo_valid |= 1 << lo;
+        if (lo < 7) {
+            hi_last[lo + 1] = b;
+            r.hi_valid |= 1 << (lo + 1);
+        }
+
+        offset += popcnt(bits);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        int shift = 1 << i;
+        r.scan[i] = 0;
+        for (int b = shift; b < 8; b++)
+            if (target[b - shift] == target[b])
+                r.scan[i] |= 1 << b;
+    }
+
+    r.pext_matrix = _mm512_loadu_si512(pext_matrix);
+    r.pdep_matrix = _mm512_loadu_si512(pdep_matrix);
+    r.pext_bytes = _mm512_loadu_si512(pext_bytes);
+    r.lo_bits = _mm512_loadu_si512(lo_bits);
+    r.lo_index = _mm512_loadu_si512(lo_index);
+    r.hi_index = _mm512_loadu_si512(hi_index);
+    r.lo_last = _mm512_loadu_si512(lo_last);
+    r.hi_last = _mm512_loadu_si512(hi_last);
+    return r;
+}
+
+// PEXT of eight words
+static inline __m512i gfni_pext_8(__m512i a, const zp7_gfni_masks_64_t *masks) {
+    const __m512i zero = _mm512_setzero_si512();
+    a = transpose_bytes_512(a);
+    a = _mm512_gf2p8affine_epi64_epi8(a, masks->pext_matrix, 0);
+    __m512i lo = _mm512_and_si512(a, masks->lo_bits);
+    __m512i hi = _mm512_andnot_si512(masks->lo_bits, a);
+
+    // Segmented OR scan of the low parts. The lane shifts are by 1, 2 and 4
+    // lanes up. Only the last lane in each run can have any bits wrap around
+    // into the next byte, so the high parts don't need this.
+    lo = _mm512_mask_or_epi64(lo, masks->scan[0], lo,
+            _mm512_alignr_epi64(lo, zero, 7));
+    lo = _mm512_mask_or_epi64(lo, masks->scan[1], lo,
+            _mm512_alignr_epi64(lo, zero, 6));
+    lo = _mm512_mask_or_epi64(lo, masks->scan[2], lo,
+            _mm512_alignr_epi64(lo, zero, 4));
+
+    lo = _mm512_maskz_permutexvar_epi64(masks->lo_valid, masks->lo_last, lo);
+    hi = _mm512_maskz_permutexvar_epi64(masks->hi_valid, masks->hi_last, hi);
+    return transpose_bytes_512(_mm512_or_si512(lo, hi));
+}
+
+// PDEP of eight words
+static inline __m512i gfni_pdep_8(__m512i a, const zp7_gfni_masks_64_t *masks) {
+    a = transpose_bytes_512(a);
+    __m512i lo = _mm512_permutexvar_epi64(masks->lo_index, a);
+    __m512i hi = _mm512_permutexvar_epi64(masks->hi_index, a);
+    // Bitwise select: lo_bits ? lo : hi
+    a = _mm512_ternarylogic_epi64(masks->lo_bits, lo, hi, 0xCA);
+    a = _mm512_gf2p8affine_epi64_epi8(a, masks->pdep_matrix, 0);
+    return transpose_bytes_512(a);
+}
+
+uint64_t zp7_gfni_pext_pre_64(uint64_t a, const zp7_gfni_masks_64_t *masks) {
+    // Copy byte B of the input to every byte of lane B
+    const __m512i index = _mm512_set_epi64(
+            0x0707070707070707, 0x0606060606060606,
+            0x0505050505050505, 0x0404040404040404,
+            0x0303030303030303, 0x0202020202020202,
+            0x0101010101010101, 0x0000000000000000);
+    __m512i x = _mm512_castsi128_si512(xmm_from_64(a));
+    x = _mm512_permutexvar_epi8(index, x);
+    x = _mm512_gf2p8affine_epi64_epi8(x, masks->pext_matrix, 0);
+    x = _mm512_and_si512(x, masks->pext_bytes);
+
+    // OR the lanes together
+    __m256i y = _mm256_or_si256(_mm512_castsi512_si256(x),
+            _mm512_extracti64x4_epi64(x, 1));
+    __m128i z = _mm_or_si128(_mm256_castsi256_si128(y),
+            _mm256_extracti128_si256(y, 1));
+    z = _mm_or_si128(z, _mm_unpackhi_epi64(z, z));
+    return xmm_to_64(z);
+}
+
+uint64_t zp7_gfni_pdep_pre_64(uint64_t a, const zp7_gfni_masks_64_t *masks) {
+    // The transposes make the bulk version work fine for one word, and the
+    // result is just the first lane
+    __m512i x = _mm512_zextsi128_si512(xmm_from_64(a));
+    return xmm_to_64(_mm512_castsi512_si128(gfni_pdep_8(x, masks)));
+}
+
+void zp7_gfni_pext_pre_array_64(uint64_t *dst, const uint64_t *src, size_t n,
+        const zp7_gfni_masks_64_t *masks) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i a = _mm512_loadu_si512(src + i);
+        _mm512_storeu_si512(dst + i, gfni_pext_8(a, masks));
+    }
+    if (i < n) {
+        __mmask8 tail = (1 << (n - i)) - 1;
+        __m512i a = _mm512_maskz_loadu_epi64(tail, src + i);
+        _mm512_mask_storeu_epi64(dst + i, tail, gfni_pext_8(a, masks));
+    }
+}
+
+void zp7_gfni_pdep_pre_array_64(uint64_t *dst, const uint64_t *src, size_t n,
+        const zp7_gfni_masks_64_t *masks) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i a = _mm512_loadu_si512(src + i);
+        _mm512_storeu_si512(dst + i, gfni_pdep_8(a, masks));
+    }
+    if (i < n) {
+        __mmask8 tail = (1 << (n - i)) - 1;
+        __m512i a = _mm512_maskz_loadu_epi64(tail, src + i);
+        _mm512_mask_storeu_epi64(dst + i, tail, gfni_pdep_8(a, masks));
+    }
+}
+
+#endif
+
+// AVX-512 BITALG
+//
+// AVX-512 BITALG (Ice Lake, Zen 4 and later) has VPSHUFBITQMB, which gathers
+// eight arbitrary bits from each 64-bit lane of a vector, selected by the
+// eight bytes of the corresponding lane of an index vector, into a 64-bit mask
+// register. That's a PEXT, given an index vector with the position of each set
+// bit of the mask, which only depends on the mask. With the input broadcast to
+// all eight lanes, one instruction gives the whole result, and bits past the
+// popcount of the mask are cleared with a write-mask.
+//
+// PDEP works too: if each index byte is instead the number of mask bits below
+// that bit position (the same thing the PPP computes, just stored
+// horizontally), each result bit gets the right input bit, and using the mask
+// itself as the write-mask clears the bits that aren't in the mask. This
+// makes the multishift/byte shuffle approach unnecessary.
+//
+// For the bulk functions, there's a different input word in each lane, so
+// each VPSHUFBITQMB handles eight words but only produces eight result bits
+// for each of them: byte I of the mask register is one byte of the result for
+// word I. For PEXT, we only need as many of these as there are bytes in the
+// popcount of the mask, and for PDEP, only as many as there are nonzero bytes
+// in the mask, which makes this very fast for sparse masks. The result bytes
+// are moved into vector lanes and then transposed into place with VPERMB.
+//
+// This needs AVX-512 BW, VBMI and BITALG, and is enabled with HAS_BITALG.
+
+#ifdef HAS_BITALG
+
+typedef struct {
+    uint64_t mask;
+    // Lane I of the PEXT index holds the positions of set bits 8*I through
+    // 8*I+7 of the mask, and lane I of the PDEP index holds the number of
+    // mask bits below bits 8*I through 8*I+7. Both are used as whole vectors
+    // for single words, and one lane at a time for the bulk functions.
+    uint64_t pext_index[8];
+    uint64_t pdep_index[8];
+    // Low POPCOUNT bits set, for clearing PEXT results
+    uint64_t pext_valid;
+    // Number of bytes in the result of PEXT
+    int pext_bytes;
+    // Nonzero bytes of the mask, which are the only PDEP result bytes that
+    // need computing
+    int pdep_bytes;
+    uint8_t pdep_byte[8];
+} zp7_bitalg_masks_64_t;
+
+zp7_bitalg_masks_64_t zp7_bitalg_pre_64(uint64_t mask) {
+    zp7_bitalg_masks_64_t r;
+    r.mask = mask;
+
+    uint8_t pext_index[64] = { 0 }, pdep_index[64];
+    int pop = 0;
+    for (uint64_t m = mask; m; m &= m - 1)
+        pext_index[pop++] = __builtin_ctzll(m);
+    pdep_index[0] = 0;
+    for (int i = 1; i < 64; i++)
+        pdep_index[i] = popcnt(mask << (64 - i));
+    memcpy(r.pext_index, pext_index, sizeof(pext_index));
+    memcpy(r.pdep_index, pdep_index, sizeof(pdep_index));
+
+    r.pext_valid = pop < 64 ? (1ULL << pop) - 1 : -1ULL;
+    r.pext_bytes = (pop + 7) / 8;
+    r.pdep_bytes = 0;
+    for (int b = 0; b < 8; b++)
+        if ((mask >> (8 * b)) & 0xFF)
+            r.pdep_byte[r.pdep_bytes++] = b;
+    return r;
+}
+
+uint64_t zp7_bitalg_pext_pre_64(uint64_t a,
+        const zp7_bitalg_masks_64_t *masks) {
+    __m512i index = _mm512_loadu_si512(masks->pext_index);
+    return _mm512_mask_bitshuffle_epi64_mask(masks->pext_valid,
+            _mm512_set1_epi64(a), index);
+}
+
+uint64_t zp7_bitalg_pdep_pre_64(uint64_t a,
+        const zp7_bitalg_masks_64_t *masks) {
+    __m512i index = _mm512_loadu_si512(masks->pdep_index);
+    return _mm512_mask_bitshuffle_epi64_mask(masks->mask,
+            _mm512_set1_epi64(a), index);
+}
+
+// Eight words at a time, as described above. The result bytes for all eight
+// words are put in lane B of R, which is then transposed.
+static inline __m512i bitalg_pext_8(__m512i a,
+        const zp7_bitalg_masks_64_t *masks) {
+    __m512i r = _mm512_setzero_si512();
+    for (int b = 0; b < masks->pext_bytes; b++) {
+        uint64_t valid = ((masks->pext_valid >> (8 * b)) & 0xFF) *
+            0x0101010101010101ULL;
+        __m512i index = _mm512_set1_epi64(masks->pext_index[b]);
+        __mmask64 bits = _mm512_mask_bitshuffle_epi64_mask(valid, a, index);
+        r = _mm512_mask_set1_epi64(r, 1 << b, bits);
+    }
+    return transpose_bytes_512(r);
+}
+
+static inline __m512i bitalg_pdep_8(__m512i a,
+        const zp7_bitalg_masks_64_t *masks) {
+    __m512i r = _mm512_setzero_si512();
+    for (int i = 0; i < masks->pdep_bytes; i++) {
+        int b = masks->pdep_byte[i];
+        uint64_t valid = ((masks->mask >> (8 * b)) & 0xFF) *
+            0x0101010101010101ULL;
+        __m512i index = _mm512_set1_epi64(masks->pdep_index[b]);
+        __mmask64 bits = _mm512_mask_bitshuffle_epi64_mask(valid, a, index);
+        r = _mm512_mask_set1_epi64(r, 1 << b, bits);
+    }
+    return transpose_bytes_512(r);
+}
+
+void zp7_bitalg_pext_pre_array_64(uint64_t *dst, const uint64_t *src,
+        size_t n, const zp7_bitalg_masks_64_t *masks) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i a = _mm512_loadu_si512(src + i);
+        _mm512_storeu_si512(dst + i, bitalg_pext_8(a, masks));
+    }
+    if (i < n) {
+        __mmask8 tail = (1 << (n - i)) - 1;
+        __m512i a = _mm512_maskz_loadu_epi64(tail, src + i);
+        _mm512_mask_storeu_epi64(dst + i, tail, bitalg_pext_8(a, masks));
+    }
+}
+
+void zp7_bitalg_pdep_pre_array_64(uint64_t *dst, const uint64_t *src,
+        size_t n, const zp7_bitalg_masks_64_t *masks) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i a = _mm512_loadu_si512(src + i);
+        _mm512_storeu_si512(dst + i, bitalg_pdep_8(a, masks));
+    }
+    if (i < n) {
+        __mmask8 tail = (1 << (n - i)) - 1;
+        __m512i a = _mm512_maskz_loadu_epi64(tail, src + i);
+        _mm512_mask_storeu_epi64(dst + i, tail, bitalg_pdep_8(a, masks));
+    }
+}
+
+#endif
+
+// PSHUFB
+//
+// The PPP shifts by 1, 2 and 4 look like they only move bits around within a
+// byte, which would make them a good fit for a PSHUFB table lookup, leaving
+// only the byte-sized shifts for the PPP. Unfortunately they don't: the
+// shift for each bit is the number of unset mask bits below it, which has
+// nothing to do with byte boundaries. But PSHUFB can do the whole job with
+// no PPP at all, in two different ways for single words and for arrays.
+//
+// For a single word, the idea is the same as VPSHUFBITQMB in the BITALG code
+// above, built from smaller pieces. For each result bit, a PSHUFB copies the
+// input byte holding the bit it comes from into one byte of a vector, an AND
+// with a one-bit mask (and a compare) selects the bit, and PMOVMSKB packs the
+// bytes back into bits. Both the byte indices and the bit masks only depend
+// on the mask: for PEXT, result bit I comes from the Ith set bit of the mask,
+// and for PDEP, result bit I comes from input bit R, where R is the number of
+// mask bits below I, as long as mask bit I is set. Unused result bits get a
+// byte index with the high bit set, which makes PSHUFB write a zero byte.
+// Each 16 result bits take one XMM register, and all four are independent, so
+// the dependency chain is just five instructions, compared to six rounds of
+// shift/AND/OR for the PPP. With AVX2, two YMM registers are enough.
+//
+// For arrays, that's too many instructions per word. Instead, we transpose
+// blocks of 16 words (32 with AVX2) so that each vector holds the same byte
+// of every word, like the GFNI code does. Then every input nibble is a PSHUFB
+// index for all 16 words at once, and a 16-entry table maps each nibble value
+// to the bits it contributes to one byte of the result, which are ORed into
+// that result byte's vector. Each input nibble feeds at most two result bytes
+// for PEXT, and each result byte takes at most three input nibbles for PDEP,
+// so there are at most 32 lookups. The list of (input nibble, result byte,
+// table) triples only depends on the mask, and is the same kernel for both
+// PEXT and PDEP. Since the result bytes are just separate vectors, the byte
+// shifts of the PPP aren't needed either.
+//
+// This needs SSSE3, and is enabled with HAS_SSSE3. Defining HAS_AVX2 as well
+// uses 256-bit vectors. Like the other backends, it uses its own precomputed
+// mask struct.
+
+#if defined(HAS_SSSE3) || defined(HAS_AVX2)
+
+// Maximum number of table lookups, as described above
+#define ZP7_PSHUFB_MAX_OPS  (32)
+
+// Minimum length for the generic bulk PDEP functions to switch to PSHUFB
+#ifndef ZP7_PSHUFB_MIN_ARRAY
+#   define ZP7_PSHUFB_MIN_ARRAY    (1024)
+#endif
+
+typedef struct {
+    uint8_t src[ZP7_PSHUFB_MAX_OPS];
+    uint8_t dst[ZP7_PSHUFB_MAX_OPS];
+    // Each table is 16 bytes, stored as two words for faster precomputation
+    uint64_t table[ZP7_PSHUFB_MAX_OPS][2];
+    int n_ops;
+    // The lookups are sorted by result byte. This is the index of the first
+    // lookup for each result byte after B.
+    uint8_t dst_end[8];
+} zp7_pshufb_ops_t;
+
+typedef struct {
+    uint64_t mask;
+    // For each result bit, the input byte it comes from, and a mask for the
+    // bit within that byte
+    uint8_t pext_byte[64], pext_bit[64];
+    uint8_t pdep_byte[64], pdep_bit[64];
+    // Table lookups for the bulk functions
+    zp7_pshufb_ops_t pext_ops, pdep_ops;
+} zp7_pshufb_masks_64_t;
+
+// Add input bit SRC -> result bit DST to the table lookups. For both PEXT
+// and PDEP, the bits are added with SRC and DST in increasing order, so the
+// lookup for the same input nibble and result byte, if there is one, is
+// always the last one.
+static void pshufb_add_bit(zp7_pshufb_ops_t *ops, int src, int dst) {
+    int i = ops->n_ops - 1;
+    if (i < 0 || ops->src[i] != src >> 2 || ops->dst[i] != dst >> 3) {
+        i = ops->n_ops++;
+        ops->src[i] = src >> 2;
+        ops->dst[i] = dst >> 3;
+        ops->table[i][0] = ops->table[i][1] = 0;
+    }
+    // Low and high eight table entries with a given bit of the nibble set
+    static const uint64_t nibble_bit[4][2] = {
+        { 0x0100010001000100ULL, 0x0100010001000100ULL },
+        { 0x0101000001010000ULL, 0x0101000001010000ULL },
+        { 0x0101010100000000ULL, 0x0101010100000000ULL },
+        { 0x0000000000000000ULL, 0x0101010101010101ULL },
+    };
+    ops->table[i][0] |= nibble_bit[src & 3][0] << (dst & 7);
+    ops->table[i][1] |= nibble_bit[src & 3][1] << (dst & 7);
+}
+
+static void pshufb_finish_ops(zp7_pshufb_ops_t *ops) {
+    for (int b = 0, i = 0; b < 8; b++) {
+        while (i < ops->n_ops && ops->dst[i] == b)
+            i++;
+        ops->dst_end[b] = i;
+    }
+}
+
+zp7_pshufb_masks_64_t zp7_pshufb_pre_64(uint64_t mask) {
+    zp7_pshufb_masks_64_t r;
+    r.mask = mask;
+    memset(r.pext_byte, 0x80, sizeof(r.pext_byte));
+    memset(r.pext_bit, 1, sizeof(r.pext_bit));
+    memset(r.pdep_byte, 0x80, sizeof(r.pdep_byte));
+    memset(r.pdep_bit, 1, sizeof(r.pdep_bit));
+    r.pext_ops.n_ops = 0;
+    r.pdep_ops.n_ops = 0;
+
+    int rank = 0;
+    for (uint64_t m = mask; m; m &= m - 1, rank++) {
+        int pos = __builtin_ctzll(m);
+        r.pext_byte[rank] = pos >> 3;
+        r.pext_bit[rank] = 1 << (pos & 7);
+        r.pdep_byte[pos] = rank >> 3;
+        r.pdep_bit[pos] = 1 << (rank & 7);
+        pshufb_add_bit(&r.pext_ops, pos, rank);
+        pshufb_add_bit(&r.pdep_ops, rank, pos);
+    }
+    pshufb_finish_ops(&r.pext_ops);
+    pshufb_finish_ops(&r.pdep_ops);
+    return r;
+}
+
+// Gather 64 bits from A, as described above
+static inline uint64_t pshufb_gather(uint64_t a, const uint8_t *byte,
+        const uint8_t *bit) {
+#ifdef HAS_AVX2
+    __m256i v = _mm256_set1_epi64x(a);
+    uint64_t r = 0;
+    for (int i = 0; i < 2; i++) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(bit + 32 * i));
+        __m256i x = _mm256_shuffle_epi8(v,
+                _mm256_loadu_si256((const __m256i *)(byte + 32 * i)));
+        x = _mm256_cmpeq_epi8(_mm256_and_si256(x, b), b);
+        r |= (uint64_t)(uint32_t)_mm256_movemask_epi8(x) << (32 * i);
+    }
+    return r;
+#else
+    __m128i v = xmm_from_64(a);
+    uint64_t r = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(bit + 16 * i));
+        __m128i x = _mm_shuffle_epi8(v,
+                _mm_loadu_si128((const __m128i *)(byte + 16 * i)));
+        x = _mm_cmpeq_epi8(_mm_and_si128(x, b), b);
+        r |= (uint64_t)_mm_movemask_epi8(x) << (16 * i);
+    }
+    return r;
+#endif
+}
+
+uint64_t zp7_pshufb_pext_pre_64(uint64_t a,
+        const zp7_pshufb_masks_64_t *masks) {
+    return pshufb_gather(a, masks->pext_byte, masks->pext_bit);
+}
+
+uint64_t zp7_pshufb_pdep_pre_64(uint64_t a,
+        const zp7_pshufb_masks_64_t *masks) {
+    return pshufb_gather(a, masks->pdep_byte, masks->pdep_bit);
+}
+
+// Vector operations for the bulk functions. With AVX2, everything works
+// within 128-bit lanes, so the low and high lanes each process their own
+// block of 16 words (every other pair of words in a block of 32).
+#ifdef HAS_AVX2
+#   define ZP7_PSHUFB_WORDS     (32)
+typedef __m256i zp7_pshufb_vec_t;
+#   define pshufb_load(p)       _mm256_loadu_si256((const __m256i *)(p))
+#   define pshufb_store(p, x)   _mm256_storeu_si256((__m256i *)(p), x)
+#   define pshufb_table(p)      _mm256_broadcastsi128_si256( \
+                                    _mm_loadu_si128((const __m128i *)(p)))
+#   define pshufb_set(...)      _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+#   define pshufb_zero          _mm256_setzero_si256
+#   define pshufb_shuffle       _mm256_shuffle_epi8
+#   define pshufb_and           _mm256_and_si256
+#   define pshufb_or            _mm256_or_si256
+#   define pshufb_srli_16       _mm256_srli_epi16
+#   define pshufb_unpacklo_16   _mm256_unpacklo_epi16
+#   define pshufb_unpackhi_16   _mm256_unpackhi_epi16
+#   define pshufb_unpacklo_32   _mm256_unpacklo_epi32
+#   define pshufb_unpackhi_32   _mm256_unpackhi_epi32
+#   define pshufb_unpacklo_64   _mm256_unpacklo_epi64
+#   define pshufb_unpackhi_64   _mm256_unpackhi_epi64
+#else
+#   define ZP7_PSHUFB_WORDS     (16)
+typedef __m128i zp7_pshufb_vec_t;
+#   define pshufb_load(p)       _mm_loadu_si128((const __m128i *)(p))
+#   define pshufb_store(p, x)   _mm_storeu_si128((__m128i *)(p), x)
+#   define pshufb_table(p)      _mm_loadu_si128((const __m128i *)(p))
+#   define pshufb_set(...)      _mm_setr_epi8(__VA_ARGS__)
+#   define pshufb_zero          _mm_setzero_si128
+#   define pshufb_shuffle       _mm_shuffle_epi8
+#   define pshufb_and           _mm_and_si128
+#   define pshufb_or            _mm_or_si128
+#   define pshufb_srli_16       _mm_srli_epi16
+#   define pshufb_unpacklo_16   _mm_unpacklo_epi16
+#   define pshufb_unpackhi_16   _mm_unpackhi_epi16
+#   define pshufb_unpacklo_32   _mm_unpacklo_epi32
+#   define pshufb_unpackhi_32   _mm_unpackhi_epi32
+#   define pshufb_unpacklo_64   _mm_unpacklo_epi64
+#   define pshufb_unpackhi_64   _mm_unpackhi_epi64
+#endif
+
+// Transpose an 8x8 matrix of 16-bit elements in each 128-bit lane. This is
+// its own inverse.
+static inline void pshufb_transpose_16(zp7_pshufb_vec_t *v) {
+    zp7_pshufb_vec_t t[8], u[8];
+    for (int i = 0; i < 4; i++) {
+        t[2 * i + 0] = pshufb_unpacklo_16(v[2 * i], v[2 * i + 1]);
+        t[2 * i + 1] = pshufb_unpackhi_16(v[2 * i], v[2 * i + 1]);
+    }
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            u[4 * i + 2 * j + 0] = pshufb_unpacklo_32(t[4 * i + j],
+                    t[4 * i + j + 2]);
+            u[4 * i + 2 * j + 1] = pshufb_unpackhi_32(t[4 * i + j],
+                    t[4 * i + j + 2]);
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        v[2 * i + 0] = pshufb_unpacklo_64(u[i], u[i + 4]);
+        v[2 * i + 1] = pshufb_unpackhi_64(u[i], u[i + 4]);
+    }
+}
+
+// Apply the table lookups in OPS to one block of words. Each vector of SRC
+// holds two words per 128-bit lane, which get interleaved bytewise so that
+// the 16-bit element B holds byte B of both. After the transpose, vector B
+// then holds byte B of every word, with the words in order. The results are
+// transposed back the same way.
+static inline void pshufb_block(uint64_t *dst, const uint64_t *src,
+        const zp7_pshufb_ops_t *ops) {
+    const int words = ZP7_PSHUFB_WORDS / 8;
+    zp7_pshufb_vec_t v[8], nibble[16], r[8];
+
+    const zp7_pshufb_vec_t interleave = pshufb_set(0, 8, 1, 9, 2, 10, 3, 11,
+            4, 12, 5, 13, 6, 14, 7, 15);
+    for (int i = 0; i < 8; i++)
+        v[i] = pshufb_shuffle(pshufb_load(src + words * i), interleave);
+    pshufb_transpose_16(v);
+
+    const zp7_pshufb_vec_t low_4 = pshufb_set(15, 15, 15, 15, 15, 15, 15, 15,
+            15, 15, 15, 15, 15, 15, 15, 15);
+    for (int i = 0; i < 8; i++) {
+        nibble[2 * i + 0] = pshufb_and(v[i], low_4);
+        nibble[2 * i + 1] = pshufb_and(pshufb_srli_16(v[i], 4), low_4);
+    }
+
+    // Accumulate each result byte in turn, so they can stay in registers
+    for (int b = 0, i = 0; b < 8; b++) {
+        r[b] = pshufb_zero();
+        for (; i < ops->dst_end[b]; i++) {
+            zp7_pshufb_vec_t x = pshufb_shuffle(pshufb_table(ops->table[i]),
+                    nibble[ops->src[i]]);
+            r[b] = pshufb_or(r[b], x);
+        }
+    }
+
+    pshufb_transpose_16(r);
+    const zp7_pshufb_vec_t deinterleave = pshufb_set(0, 2, 4, 6, 8, 10, 12,
+            14, 1, 3, 5, 7, 9, 11, 13, 15);
+    for (int i = 0; i < 8; i++)
+        pshufb_store(dst + words * i, pshufb_shuffle(r[i], deinterleave));
+}
+
+static void pshufb_array(uint64_t *dst, const uint64_t *src, size_t n,
+        const zp7_pshufb_ops_t *ops) {
+    size_t i = 0;
+    for (; i + ZP7_PSHUFB_WORDS <= n; i += ZP7_PSHUFB_WORDS)
+        pshufb_block(dst + i, src + i, ops);
+    // Do the remaining words in a zero-padded block
+    if (i < n) {
+        uint64_t buf[ZP7_PSHUFB_WORDS] = { 0 };
+        memcpy(buf, src + i, (n - i) * sizeof(uint64_t));
+        pshufb_block(buf, buf, ops);
+        memcpy(dst + i, buf, (n - i) * sizeof(uint64_t));
+    }
+}
+
+void zp7_pshufb_pext_pre_array_64(uint64_t *dst, const uint64_t *src,
+        size_t n, const zp7_pshufb_masks_64_t *masks) {
+    pshufb_array(dst, src, n, &masks->pext_ops);
+}
+
+void zp7_pshufb_pdep_pre_array_64(uint64_t *dst, const uint64_t *src,
+        size_t n, const zp7_pshufb_masks_64_t *masks) {
+    pshufb_array(dst, src, n, &masks->pdep_ops);
+}
+
+#endif
+
+// Bulk PEXT/PDEP
+//
+// These apply the same precomputed mask to each of N words in SRC, storing the
+// results in DST (which can be the same as SRC). With the mask fixed, there's
+// no dependency between words, so these loops are mostly limited by
+// throughput rather than the latency of the shift chain.
+//
+// On AArch64 processors with the SVE2 BitPerm extension, the BEXT/BDEP
+// instructions are vector versions of PEXT/PDEP, which are much faster than
+// anything we can do here. Support for these is compiled in with the
+// HAS_SVE2_BITPERM define, but since not all SVE2 processors implement
+// BitPerm, whether they're actually used is decided at runtime, with the
+// regular ZP7 code (using PMULL if HAS_PMULL is defined) as the fallback.
+// Only the bulk functions use BEXT/BDEP: for single words, the overhead of
+// moving to and from vector registers would eat most of the gains.
+//
+// With HAS_GFNI, arrays of at least ZP7_GFNI_MIN_ARRAY words use the GFNI
+// code above, which needs its own precomputed masks. Those are computed for
+// each call, which is why short arrays don't bother. Otherwise, with
+// HAS_SSSE3 or HAS_AVX2, PDEP of at least ZP7_PSHUFB_MIN_ARRAY words uses the
+// PSHUFB table lookups the same way. PEXT doesn't, since the lookups aren't
+// any faster than the regular code for it.
+//
+// There are also versions with a separate mask for each word, MASK[I] for
+// SRC[I]. These use BEXT/BDEP too if they're available, and otherwise the
+// four-way batches above when there's a carry-less multiply. The portable PPP
+// already has plenty of parallelism, and a plain loop over it lets the
+// compiler vectorize it, which the batches get in the way of.
+
+#if !defined(ZP7_32BIT) && (defined(HAS_CLMUL) || defined(HAS_PMULL) || \
+    defined(HAS_ZBC))
+#   define ZP7_BATCH_ARRAY  (1)
+#else
+#   define ZP7_BATCH_ARRAY  (0)
+#endif
+
+#ifdef HAS_SVE2_BITPERM
+
+#ifndef HWCAP2_SVEBITPERM
+#   define HWCAP2_SVEBITPERM   (1 << 4)
+#endif
+
+// The kernels are compiled for SVE2 BitPerm regardless of the target flags,
+// so they can live alongside the fallback code in the same binary.
+#define ZP7_SVE2_BITPERM_TARGET __attribute__((target("+sve2-bitperm")))
+
+// getauxval() just reads a table, so this isn't cached, which would race
+// when the bulk functions are called from several threads
+static int has_sve2_bitperm() {
+    return (getauxval(AT_HWCAP2) & HWCAP2_SVEBITPERM) != 0;
+}
+
+ZP7_SVE2_BITPERM_TARGET
+static void pext_array_sve2(uint64_t *dst, const uint64_t *src, size_t n,
+        uint64_t mask) {
+    for (size_t i = 0; i < n; i += svcntd()) {
+        svbool_t pg = svwhilelt_b64_u64(i, n);
+        svuint64_t a = svld1_u64(pg, src + i);
+        svst1_u64(pg, dst + i, svbext_n_u64(a, mask));
+    }
+}
+
+ZP7_SVE2_BITPERM_TARGET
+static void pdep_array_sve2(uint64_t *dst, const uint64_t *src, size_t n,
+        uint64_t mask) {
+    for (size_t i = 0; i < n; i += svcntd()) {
+        svbool_t pg = svwhilelt_b64_u64(i, n);
+        svuint64_t a = svld1_u64(pg, src + i);
+        svst1_u64(pg, dst + i, svbdep_n_u64(a, mask));
+    }
+}
+
+ZP7_SVE2_BITPERM_TARGET
+static void pext_masks_array_sve2(uint64_t *dst, const uint64_t *src,
+        const uint64_t *mask, size_t n) {
+    for (size_t i = 0; i < n; i += svcntd()) {
+        svbool_t pg = svwhilelt_b64_u64(i, n);
+        svuint64_t a = svld1_u64(pg, src + i);
+        svuint64_t m = svld1_u64(pg, mask + i);
+        svst1_u64(pg, dst + i, svbext_u64(a, m));
+    }
+}
+
+ZP7_SVE2_BITPERM_TARGET
+static void pdep_masks_array_sve2(uint64_t *dst, const uint64_t *src,
+        const uint64_t *mask, size_t n) {
+    for (size_t i = 0; i < n; i += svcntd()) {
+        svbool_t pg = svwhilelt_b64_u64(i, n);
+        svuint64_t a = svld1_u64(pg, src + i);
+        svuint64_t m = svld1_u64(pg, mask + i);
+        svst1_u64(pg, dst + i, svbdep_u64(a, m));
+    }
+}
+
+#endif
+
+void zp7_pext_pre_array_64(uint64_t *dst, const uint64_t *src, size_t n,
+        const zp7_masks_64_t *masks) {
+#ifdef HAS_SVE2_BITPERM
+    if (has_sve2_bitperm()) {
+        pext_array_sve2(dst, src, n, masks->mask);
+        return;
+    }
+#endif
+#ifdef HAS_GFNI
+    if (n >= ZP7_GFNI_MIN_ARRAY) {
+        zp7_gfni_masks_64_t gfni_masks = zp7_gfni_pre_64(masks->mask);
+        zp7_gfni_pext_pre_array_64(dst, src, n, &gfni_masks);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++)
+        dst[i] = zp7_pext_pre_64(src[i], masks);
+}
+
+void zp7_pdep_pre_array_64(uint64_t *dst, const uint64_t *src, size_t n,
+        const zp7_masks_64_t *masks) {
+#ifdef HAS_SVE2_BITPERM
+    if (has_sve2_bitperm()) {
+        pdep_array_sve2(dst, src, n, masks->mask);
+        return;
+    }
+#endif
+#ifdef HAS_GFNI
+    if (n >= ZP7_GFNI_MIN_ARRAY) {
+        zp7_gfni_masks_64_t gfni_masks = zp7_gfni_pre_64(masks->mask);
+        zp7_gfni_pdep_pre_array_64(dst, src, n, &gfni_masks);
+        return;
+    }
+#endif
+#if defined(HAS_SSSE3) || defined(HAS_AVX2)
+    if (n >= ZP7_PSHUFB_MIN_ARRAY) {
+        zp7_pshufb_masks_64_t pshufb_masks = zp7_pshufb_pre_64(masks->mask);
+        zp7_pshufb_pdep_pre_array_64(dst, src, n, &pshufb_masks);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++)
+        dst[i] = zp7_pdep_pre_64(src[i], masks);
+}
+
+// DST[I] = zp7_pdep_merge_pre_64(DST[I], SRC[I], MASKS). The BEXT/BDEP,
+// GFNI and PSHUFB kernels can't merge, so with those, blocks are deposited
+// into a buffer and merged afterwards.
+#define ZP7_MERGE_BLOCK     (256)
+
+void zp7_pdep_merge_pre_array_64(uint64_t *dst, const uint64_t *src,
+        size_t n, const zp7_masks_64_t *masks) {
+#if defined(HAS_SVE2_BITPERM) || defined(HAS_GFNI) || defined(HAS_SSSE3) || \
+    defined(HAS_AVX2)
+    int sve2 = 0, gfni = 0, pshufb = 0;
+#   ifdef HAS_SVE2_BITPERM
+    sve2 = has_sve2_bitperm();
+#   endif
+#   ifdef HAS_GFNI
+    zp7_gfni_masks_64_t gfni_masks;
+    gfni = !sve2 && n >= ZP7_GFNI_MIN_ARRAY;
+    if (gfni)
+        gfni_masks = zp7_gfni_pre_64(masks->mask);
+#   endif
+#   if defined(HAS_SSSE3) || defined(HAS_AVX2)
+    zp7_pshufb_masks_64_t pshufb_masks;
+    pshufb = !sve2 && !gfni && n >= ZP7_PSHUFB_MIN_ARRAY;
+    if (pshufb)
+        pshufb_masks = zp7_pshufb_pre_64(masks->mask);
+#   endif
+    if (sve2 || gfni || pshufb) {
+        uint64_t block[ZP7_MERGE_BLOCK];
+        for (size_t i = 0; i < n; i += ZP7_MERGE_BLOCK) {
+            size_t len = n - i < ZP7_MERGE_BLOCK ? n - i : ZP7_MERGE_BLOCK;
+#   ifdef HAS_SVE2_BITPERM
+            if (sve2)
+                pdep_array_sve2(block, src + i, len, masks->mask);
+#   endif
+#   ifdef HAS_GFNI
+            if (gfni)
+                zp7_gfni_pdep_pre_array_64(block, src + i, len, &gfni_masks);
+#   endif
+#   if defined(HAS_SSSE3) || defined(HAS_AVX2)
+            if (pshufb)
+                zp7_pshufb_pdep_pre_array_64(block, src + i, len,
+                        &pshufb_masks);
+#   endif
+            for (size_t k = 0; k < len; k++)
+                dst[i + k] = (dst[i + k] & ~masks->mask) | block[k];
+        }
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++)
+        dst[i] = zp7_pdep_merge_pre_64(dst[i], src[i], masks);
+}
+
+void zp7_pext_array_64(uint64_t *dst, const uint64_t *src,
+        const uint64_t *mask, size_t n) {
+#ifdef HAS_SVE2_BITPERM
+    if (has_sve2_bitperm()) {
+        pext_masks_array_sve2(dst, src, mask, n);
+        return;
+    }
+#endif
+    size_t i = 0;
+#if ZP7_BATCH_ARRAY
+    for (; i < (n & ~(size_t)3); i += 4)
+        zp7_pext_x4_64(dst + i, src + i, mask + i);
+#endif
+    for (; i < n; i++)
+        dst[i] = zp7_pext_64(src[i], mask[i]);
+}
+
+void zp7_pdep_array_64(uint64_t *dst, const uint64_t *src,
+        const uint64_t *mask, size_t n) {
+#ifdef HAS_SVE2_BITPERM
+    if (has_sve2_bitperm()) {
+        pdep_masks_array_sve2(dst, src, mask, n);
+        return;
+    }
+#endif
+    size_t i = 0;
+#if ZP7_BATCH_ARRAY
+    for (; i < (n & ~(size_t)3); i += 4)
+        zp7_pdep_x4_64(dst + i, src + i, mask + i);
+#endif
+    for (; i < n; i++)
+        dst[i] = zp7_pdep_64(src[i], mask[i]);
+}
+
+// Bitstream compaction
+//
+// Treating SRC and MASK as streams of N*64 bits, these keep just the bits of
+// SRC where MASK is set, packed together at the start of DST. That's a PEXT
+// of each word with its mask, with the results concatenated at bit offsets
+// given by the running popcount of the masks. DST needs room for one word
+// per 64 set mask bits, rounded up; bits past the end of the output in the
+// last word are cleared.
+//
+// The words are extracted in blocks with zp7_pext_array_64(), and then
+// packed into DST with a 64-bit accumulator. The packing works on any range
+// of the stream starting at any bit offset, which is what the multithreaded
+// version in zp7_parallel.c is built on: for that, the partially filled words
+// at each end of the range can be shared with other ranges, so they're
+// returned in EDGE rather than written to DST.
+
+typedef struct {
+    // Word index and value of the partial words at the start and end of the
+    // output, or ZP7_COMPACT_NO_EDGE if there's no partial word there. The
+    // start word is the one shared with the output before this range, if it
+    // doesn't start on a word boundary. The end word is the partially filled
+    // last word, unless that's also the start word.
+    size_t index[2];
+    uint64_t value[2];
+} zp7_compact_edge_t;
+
+#define ZP7_COMPACT_NO_EDGE ((size_t)-1)
+
+// Block size for extracting words before packing them
+#define ZP7_COMPACT_BLOCK   (256)
+
+// Compact N words to DST, starting at bit OFFSET. Returns the number of
+// output bits.
+static size_t zp7_compact_range_64(uint64_t *dst, size_t offset,
+        const uint64_t *src, const uint64_t *mask, size_t n,
+        zp7_compact_edge_t *edge) {
+    size_t w = offset / 64;
+    uint64_t acc = 0;
+    uint64_t acc_bits = offset % 64;
+    // Whether the next word written is shared with whatever comes before
+    int shared = acc_bits != 0;
+    edge->index[0] = edge->index[1] = ZP7_COMPACT_NO_EDGE;
+
+    uint64_t block[ZP7_COMPACT_BLOCK];
+    for (size_t b = 0; b < n; b += ZP7_COMPACT_BLOCK) {
+        size_t len = n - b < ZP7_COMPACT_BLOCK ? n - b : ZP7_COMPACT_BLOCK;
+        zp7_pext_array_64(block, src + b, mask + b, len);
+        for (size_t i = 0; i < len; i++) {
+            uint64_t x = block[i];
+            uint64_t pop = popcnt(mask[b + i]);
+            acc |= x << acc_bits;
+            if (acc_bits + pop >= 64) {
+                if (shared) {
+                    edge->index[0] = w;
+                    edge->value[0] = acc;
+                    shared = 0;
+                } else
+                    dst[w] = acc;
+                w++;
+                // The bits of x that didn't fit. If acc was empty, all of x
+                // fit, and a shift by 64 would be undefined
+                acc = acc_bits ? x >> (64 - acc_bits) : 0;
+                acc_bits = acc_bits + pop - 64;
+            } else
+                acc_bits += pop;
+        }
+    }
+
+    if (shared ? acc_bits > offset % 64 : acc_bits != 0) {
+        edge->index[shared ? 0 : 1] = w;
+        edge->value[shared ? 0 : 1] = acc;
+    }
+    return w * 64 + acc_bits - offset;
+}
+
+// Compact N words of SRC with MASK into DST. Returns the number of output
+// bits.
+size_t zp7_compact_64(uint64_t *dst, const uint64_t *src, const uint64_t *mask,
+        size_t n) {
+    zp7_compact_edge_t edge;
+    size_t bits = zp7_compact_range_64(dst, 0, src, mask, n, &edge);
+    // Starting at offset 0, only the end word can be partial
+    if (edge.index[1] != ZP7_COMPACT_NO_EDGE)
+        dst[edge.index[1]] = edge.value[1];
+    return bits;
+}
+
+// Bitmap flattening
+//
+// This turns a bitmap into the list of its set bit positions. The usual
+// loop, storing the trailing zero count and clearing the lowest set bit
+// until the word is zero, takes a branch per set bit, and mispredicts
+// constantly when the density of the bitmap varies. Here, the positions are
+// computed eight at a time without any branches, with PEXT. The bit
+// positions in a word are the numbers 0..63, and bit J of those numbers forms
+// a constant 64-bit plane, e.g. 0xAAAA... for bit 0. Extracting each of the
+// six planes with the bitmap word as the mask gives bit J of the position of
+// each set bit, in order. All six extractions share one PPP, and then each
+// group of eight positions is an 8x8 bit matrix transpose away from being
+// eight position bytes, which are widened and stored all at once.
+//
+// This needs AVX2 to pay off: the six extractions are done together in two
+// vectors, and all eight groups are transposed at once, first with an 8x8
+// byte transpose, so each 64-bit lane holds byte G of every plane, then with
+// a bit transpose of each lane (a single GF2P8AFFINEQB with GFNI, which
+// multiplies each byte by the lane's 8x8 bit matrix).
+//
+// Each word needs a branch per group of eight set bits, and the first group
+// is always stored, even if the word is empty. So DST needs room for eight
+// entries past the last set bit.
+
+static const uint64_t flatten_planes[6] = {
+    0xAAAAAAAAAAAAAAAAULL, 0xCCCCCCCCCCCCCCCCULL, 0xF0F0F0F0F0F0F0F0ULL,
+    0xFF00FF00FF00FF00ULL, 0xFFFF0000FFFF0000ULL, 0xFFFFFFFF00000000ULL,
+};
+
+// Store the eight position bytes in POS, plus BASE, to DST
+static inline void flatten_store(uint32_t *dst, uint64_t pos, uint32_t base) {
+#ifdef HAS_AVX2
+    __m256i p = _mm256_cvtepu8_epi32(xmm_from_64(pos));
+    p = _mm256_add_epi32(p, _mm256_set1_epi32(base));
+    _mm256_storeu_si256((__m256i *)dst, p);
+#else
+    for (int k = 0; k < 8; k++)
+        dst[k] = base + (uint32_t)((pos >> (8 * k)) & 0xFF);
+#endif
+}
+
+#if defined(HAS_AVX2) && !defined(ZP7_32BIT)
+
+// Transpose the 8x8 bit matrix in each 64-bit lane, with row R in byte R
+static inline __m256i flatten_transpose_bits(__m256i x) {
+#ifdef HAS_GFNI
+    // Byte K of the result gets bit K of each byte of the matrix. The affine
+    // transform takes bit I of its result from byte 7-I of the matrix, so the
+    // rows have to be in reverse order, which flatten_word() takes care of.
+    __m256i unit = _mm256_set1_epi64x(0x8040201008040201LL);
+    return _mm256_gf2p8affine_epi64_epi8(unit, x, 0);
+#else
+    __m256i t;
+    t = _mm256_and_si256(_mm256_xor_si256(x, _mm256_srli_epi64(x, 7)),
+            _mm256_set1_epi64x(0x00AA00AA00AA00AALL));
+    x = _mm256_xor_si256(x, _mm256_xor_si256(t, _mm256_slli_epi64(t, 7)));
+    t = _mm256_and_si256(_mm256_xor_si256(x, _mm256_srli_epi64(x, 14)),
+            _mm256_set1_epi64x(0x0000CCCC0000CCCCLL));
+    x = _mm256_xor_si256(x, _mm256_xor_si256(t, _mm256_slli_epi64(t, 14)));
+    t = _mm256_and_si256(_mm256_xor_si256(x, _mm256_srli_epi64(x, 28)),
+            _mm256_set1_epi64x(0x00000000F0F0F0F0LL));
+    x = _mm256_xor_si256(x, _mm256_xor_si256(t, _mm256_slli_epi64(t, 28)));
+    return x;
+#endif
+}
+
+static inline void flatten_word(uint32_t *dst, uint64_t m, uint32_t base) {
+    zp7_masks_64_t masks = zp7_ppp_64(m);
+
+    // Rows 0-3 of the 8x8 matrices in A, and rows 4-7 in B. Row R is plane
+    // R, or 7-R for GFNI, with zeroes for the missing planes 6 and 7.
+#ifdef HAS_GFNI
+    __m256i a = _mm256_setr_epi64x(0, 0, flatten_planes[5], flatten_planes[4]);
+    __m256i b = _mm256_setr_epi64x(flatten_planes[3], flatten_planes[2],
+            flatten_planes[1], flatten_planes[0]);
+#else
+    __m256i a = _mm256_setr_epi64x(flatten_planes[0], flatten_planes[1],
+            flatten_planes[2], flatten_planes[3]);
+    __m256i b = _mm256_setr_epi64x(flatten_planes[4], flatten_planes[5], 0, 0);
+#endif
+
+    // PEXT of all the planes, same as zp7_pext_pre_64()
+    __m256i mask = _mm256_set1_epi64x(m);
+    a = _mm256_and_si256(a, mask);
+    b = _mm256_and_si256(b, mask);
+    for (int i = 0; i < N_BITS; i++) {
+        __m128i shift = _mm_cvtsi32_si128(1 << i);
+        __m256i bit = _mm256_set1_epi64x(masks.ppp_bit[i]);
+        a = _mm256_or_si256(_mm256_andnot_si256(bit, a),
+                _mm256_srl_epi64(_mm256_and_si256(a, bit), shift));
+        b = _mm256_or_si256(_mm256_andnot_si256(bit, b),
+                _mm256_srl_epi64(_mm256_and_si256(b, bit), shift));
+    }
+
+    // Transpose bytes: interleave rows 0/1, 2/3, etc. within each 128-bit
+    // lane, giving 16-bit pairs of rows for each G, then interleave those
+    // pairs, and finally put rows 0-3 and 4-7 of each G next to each other
+    __m256i pairs = _mm256_setr_epi8(0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13,
+            6, 14, 7, 15, 0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15);
+    a = _mm256_shuffle_epi8(a, pairs);
+    b = _mm256_shuffle_epi8(b, pairs);
+    __m256i r01_45 = _mm256_permute2x128_si256(a, b, 0x20);
+    __m256i r23_67 = _mm256_permute2x128_si256(a, b, 0x31);
+    __m256i quads = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i lo = _mm256_permutevar8x32_epi32(
+            _mm256_unpacklo_epi16(r01_45, r23_67), quads);
+    __m256i hi = _mm256_permutevar8x32_epi32(
+            _mm256_unpackhi_epi16(r01_45, r23_67), quads);
+
+    uint64_t pos[8];
+    _mm256_storeu_si256((__m256i *)&pos[0], flatten_transpose_bits(lo));
+    _mm256_storeu_si256((__m256i *)&pos[4], flatten_transpose_bits(hi));
+
+    uint64_t pop = popcnt(m);
+    uint32_t g = 0;
+    do {
+        flatten_store(dst + 8 * g, pos[g], base);
+        g++;
+    } while (8 * g < pop);
+}
+
+#else
+
+// Without vectors, the six extractions and the transposes cost more than
+// they save, so just find eight set bits at a time with trailing zero counts.
+// This is still free of branches within each group. Setting the top bit
+// keeps the count defined once M runs out of bits, and doesn't change it
+// before then.
+static inline void flatten_word(uint32_t *dst, uint64_t m, uint32_t base) {
+    uint64_t pop = popcnt(m);
+    uint32_t g = 0;
+    do {
+        for (int k = 0; k < 8; k++) {
+            dst[8 * g + k] = base + __builtin_ctzll(m | 1ULL << 63);
+            m &= m - 1;
+        }
+        g++;
+    } while (8 * g < pop);
+}
+
+#endif
+
+// Write the positions of the set bits of the N words of BITMAP to DST, in
+// increasing order, with bit B of word I at position I*64+B. Returns the
+// number of set bits. Positions are 32 bits, so the bitmap can be up to 2^32
+// bits long.
+size_t zp7_flatten_64(uint32_t *dst, const uint64_t *bitmap, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        flatten_word(dst + count, bitmap[i], (uint32_t)(i * 64));
+        count += popcnt(bitmap[i]);
+    }
+    return count;
+}
+
+#endif
@@ -0,0 +1,222 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef ZP7_BITIO_C
+#define ZP7_BITIO_C
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "zp7.c"
+
+// Bit streams
+//
+// A writer and reader for streams of bit fields of any width, like the
+// output of entropy coders. The main operations combine the field packing
+// with PEXT/PDEP: zp7_bit_append_pext() extracts the bits of a word selected
+// by a mask and appends them to the stream, and zp7_bit_read_pdep() takes
+// the next bits of the stream and deposits them in the positions of a mask.
+// The field widths are the popcounts of the masks, so variable-width records
+// are described by nothing but their masks.
+//
+// The stream is an array of 64-bit words, filled from the lowest bit up, so
+// the first field is in the low bits of the first word. Both sides keep up to
+// 63 bits in a 64-bit buffer, and the writer stores (or the reader loads) a
+// whole word only when the buffer fills up (or runs out), which is at most
+// once per field. A field that straddles two words is split with a single
+// pair of shifts.
+//
+// The bulk versions do the PEXT/PDEP for a block of words at once with
+// zp7_pext_pre_array_64()/zp7_pdep_pre_array_64(), which can use the faster
+// array kernels, and then pack or unpack the fixed-width fields.
+
+// Words per block for the bulk functions
+#define ZP7_BITIO_BLOCK         (256)
+
+// Error codes. Functions that can fail return 0 on success, or one of these
+#define ZP7_BITIO_ERR_FULL      (-1)
+
+typedef struct {
+    uint64_t *buf;
+    size_t capacity;
+    // Whole words written to BUF
+    size_t n_words;
+    // Pending bits, and how many of them there are (0 to 63)
+    uint64_t acc;
+    int n_bits;
+} zp7_bit_writer_t;
+
+typedef struct {
+    const uint64_t *buf;
+    size_t n_words;
+    // Next word to load from BUF
+    size_t pos;
+    // Bits loaded but not read yet, and how many there are (0 to 63)
+    uint64_t acc;
+    int n_bits;
+} zp7_bit_reader_t;
+
+// Writer
+
+// Start writing to BUF, which has room for CAPACITY words
+void zp7_bit_writer_init(zp7_bit_writer_t *w, uint64_t *buf,
+        size_t capacity) {
+    memset(w, 0, sizeof(*w));
+    w->buf = buf;
+    w->capacity = capacity;
+}
+
+// Append the low N bits of X (N from 0 to 64), which must be the only bits
+// set. Returns ZP7_BITIO_ERR_FULL, without writing anything, if this fills a
+// word and the buffer doesn't have room for it.
+static inline int zp7_bit_write_field(zp7_bit_writer_t *w, uint64_t x,
+        int n) {
+    int total = w->n_bits + n;
+    if (total < 64) {
+        w->acc |= x << w->n_bits;
+        w->n_bits = total;
+        return 0;
+    }
+    if (w->n_words == w->capacity)
+        return ZP7_BITIO_ERR_FULL;
+    // Store the full word, and keep the bits of X that didn't fit. With an
+    // empty buffer, that's none of them, and the double shift avoids an
+    // undefined shift by 64.
+    w->buf[w->n_words++] = w->acc | x << w->n_bits;
+    w->acc = x >> (63 - w->n_bits) >> 1;
+    w->n_bits = total - 64;
+    return 0;
+}
+
+// Append the low N bits of X (N from 0 to 64)
+int zp7_bit_write(zp7_bit_writer_t *w, uint64_t x, int n) {
+    if (n < 64)
+        x &= (1ULL << n) - 1;
+    return zp7_bit_write_field(w, x, n);
+}
+
+// Append the bits of X selected by the mask, as one field of
+// popcount(mask) bits
+int zp7_bit_append_pext(zp7_bit_writer_t *w, uint64_t x,
+        const zp7_masks_64_t *masks) {
+    return zp7_bit_write_field(w, zp7_pext_pre_64(x, masks),
+            (int)popcnt(masks->mask));
+}
+
+// Append the bits of each of the N words of SRC selected by the mask. If
+// the buffer fills up, the fields that fit are still appended.
+int zp7_bit_append_pext_array(zp7_bit_writer_t *w, const uint64_t *src,
+        size_t n, const zp7_masks_64_t *masks) {
+    int width = (int)popcnt(masks->mask);
+    uint64_t block[ZP7_BITIO_BLOCK];
+    for (size_t i = 0; i < n; i += ZP7_BITIO_BLOCK) {
+        size_t len = n - i < ZP7_BITIO_BLOCK ? n - i : ZP7_BITIO_BLOCK;
+        zp7_pext_pre_array_64(block, src + i, len, masks);
+        for (size_t k = 0; k < len; k++) {
+            if (zp7_bit_write_field(w, block[k], width))
+                return ZP7_BITIO_ERR_FULL;
+        }
+    }
+    return 0;
+}
+
+// Number of bits written so far
+uint64_t zp7_bit_writer_bits(const zp7_bit_writer_t *w) {
+    return (uint64_t)w->n_words * 64 + w->n_bits;
+}
+
+// Store any pending bits, padded with zeros to a whole word. Writing can't
+// continue afterwards (except by starting a new stream). Returns
+// ZP7_BITIO_ERR_FULL if there's no room for the last word.
+int zp7_bit_writer_finish(zp7_bit_writer_t *w) {
+    if (w->n_bits == 0)
+        return 0;
+    if (w->n_words == w->capacity)
+        return ZP7_BITIO_ERR_FULL;
+    w->buf[w->n_words++] = w->acc;
+    w->acc = 0;
+    w->n_bits = 0;
+    return 0;
+}
+
+// Reader
+
+// Start reading from the N_WORDS words in BUF
+void zp7_bit_reader_init(zp7_bit_reader_t *r, const uint64_t *buf,
+        size_t n_words) {
+    memset(r, 0, sizeof(*r));
+    r->buf = buf;
+    r->n_words = n_words;
+}
+
+// Read the next N bits (N from 0 to 64). Only the low N bits of the result
+// are valid; the bits above can be garbage, for callers that mask them
+// anyway. Past the end of the stream, the bits read are zero.
+static inline uint64_t zp7_bit_read_field(zp7_bit_reader_t *r, int n) {
+    if (n <= r->n_bits) {
+        uint64_t x = r->acc;
+        r->acc >>= n;
+        r->n_bits -= n;
+        return x;
+    }
+    // Refill: the buffered bits are the low part of the field, and the rest
+    // comes from the next word, whose leftover bits are buffered
+    uint64_t next = r->pos < r->n_words ? r->buf[r->pos++] : 0;
+    uint64_t x = r->acc | next << r->n_bits;
+    int used = n - r->n_bits;
+    r->acc = next >> (used - 1) >> 1;
+    r->n_bits = 64 - used;
+    return x;
+}
+
+// Read the next N bits (N from 0 to 64)
+uint64_t zp7_bit_read(zp7_bit_reader_t *r, int n) {
+    uint64_t x = zp7_bit_read_field(r, n);
+    return n < 64 ? x & ((1ULL << n) - 1) : x;
+}
+
+// Read the next popcount(mask) bits, and deposit them in the positions of
+// the mask
+uint64_t zp7_bit_read_pdep(zp7_bit_reader_t *r, const zp7_masks_64_t *masks) {
+    // PDEP ignores the input bits above the popcount, so the field doesn't
+    // need masking
+    return zp7_pdep_pre_64(zp7_bit_read_field(r, (int)popcnt(masks->mask)),
+            masks);
+}
+
+// Read N fields of popcount(mask) bits, depositing each in the positions of
+// the mask, into DST
+void zp7_bit_read_pdep_array(zp7_bit_reader_t *r, uint64_t *dst, size_t n,
+        const zp7_masks_64_t *masks) {
+    int width = (int)popcnt(masks->mask);
+    for (size_t i = 0; i < n; i++)
+        dst[i] = zp7_bit_read_field(r, width);
+    zp7_pdep_pre_array_64(dst, dst, n, masks);
+}
+
+// Number of bits read so far
+uint64_t zp7_bit_reader_bits(const zp7_bit_reader_t *r) {
+    return (uint64_t)r->pos * 64 - r->n_bits;
+}
+
+#endif
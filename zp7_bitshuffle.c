@@ -0,0 +1,524 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef ZP7_BITSHUFFLE_C
+#define ZP7_BITSHUFFLE_C
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAS_SSE2) || defined(HAS_AVX2)
+#   include <immintrin.h>
+#endif
+
+#include "zp7.c"
+
+// Bitshuffle
+//
+// Bitshuffle rearranges an array of N elements of S bytes so that the bits
+// that are in the same place in each element end up next to each other,
+// which makes numeric data with slowly changing values much more
+// compressible: the output is S*8 rows of N bits each, with row B*8+J
+// holding bit J of byte B of every element. The layout matches the
+// bitshuffle library: N is processed in groups of eight elements, and any
+// leftover elements (less than eight) are copied unchanged at the end.
+//
+// This is done in two transposes. First, the bytes: the input is an N x S
+// byte matrix, and transposing it gives S rows of N bytes. For elements of
+// 2, 4 or 8 bytes, it's a few rounds of splitting even and odd bytes with
+// SSE2 packs (or a strided copy without SSE2). For the other sizes, each
+// group of eight elements is S words, and byte B of each element is
+// scattered through those words in a fixed pattern, so it's gathered with a
+// PEXT of each word (and scattered back with PDEP when unshuffling), with
+// the S*S masks precomputed once per call.
+//
+// Then the bits: each group of eight bytes in a row is an 8x8 bit matrix,
+// and transposing it gives one byte of each of the eight output rows. With
+// SSE2 or AVX2, PMOVMSKB does this for 16 or 32 bytes at once, taking the
+// top bit of every byte, and shifting left moves the next bit up. The
+// reverse needs the eight rows interleaved back into groups first, which is
+// a network of unpacks, and then the 8x8 transposes are done with shifts in
+// each 64-bit lane.
+
+// Default block size for the streaming API, as in the bitshuffle library
+#define ZP7_BITSHUFFLE_BLOCK_BYTES  (8192)
+
+// Error codes. Functions that can fail return 0 on success, or one of these
+#define ZP7_BITSHUFFLE_ERR_SIZE     (-1)
+#define ZP7_BITSHUFFLE_ERR_MEMORY   (-2)
+
+// Little-endian loads and stores, which compile to plain moves on
+// little-endian hosts
+static inline uint64_t bitshuffle_load(const uint8_t *p) {
+    uint64_t x = 0;
+    for (int k = 0; k < 8; k++)
+        x |= (uint64_t)p[k] << (8 * k);
+    return x;
+}
+
+static inline void bitshuffle_store(uint8_t *p, uint64_t x) {
+    for (int k = 0; k < 8; k++)
+        p[k] = (uint8_t)(x >> (8 * k));
+}
+
+// Transpose an 8x8 bit matrix, with row R in byte R
+static inline uint64_t bitshuffle_transpose_8x8(uint64_t x) {
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x ^= t ^ (t << 28);
+    return x;
+}
+
+// Byte transposes
+
+// For sizes other than 1, 2, 4 and 8: MASKS[B][W] selects the bytes of word
+// W of a group that are byte B of an element
+static void bitshuffle_byte_masks(zp7_masks_64_t masks[8][8], size_t s) {
+    for (size_t b = 0; b < s; b++) {
+        for (size_t w = 0; w < s; w++) {
+            uint64_t m = 0;
+            for (size_t i = 0; i < 8; i++) {
+                if ((8 * w + i) % s == b)
+                    m |= 0xFFULL << (8 * i);
+            }
+            masks[b][w] = zp7_ppp_64(m);
+        }
+    }
+}
+
+#if defined(HAS_SSE2) || defined(HAS_AVX2)
+
+// Transpose 16 elements of S bytes (2, 4 or 8) in V into S vectors of 16
+// bytes. Each pass splits the even and odd bytes of pairs of vectors, and
+// after log2(S) passes, byte B of each element is in V[B].
+static inline void bitshuffle_split_bytes(__m128i *v, size_t s) {
+    __m128i lo = _mm_set1_epi16(0xFF), t[8];
+    for (size_t pass = 1; pass < s; pass *= 2) {
+        for (size_t k = 0; k < s / 2; k++) {
+            __m128i a = v[2 * k], b = v[2 * k + 1];
+            t[k] = _mm_packus_epi16(_mm_and_si128(a, lo), _mm_and_si128(b, lo));
+            t[k + s / 2] = _mm_packus_epi16(_mm_srli_epi16(a, 8),
+                    _mm_srli_epi16(b, 8));
+        }
+        memcpy(v, t, s * sizeof(__m128i));
+    }
+}
+
+// The reverse of bitshuffle_split_bytes()
+static inline void bitshuffle_merge_bytes(__m128i *v, size_t s) {
+    __m128i t[8];
+    for (size_t pass = 1; pass < s; pass *= 2) {
+        for (size_t k = 0; k < s / 2; k++) {
+            t[2 * k] = _mm_unpacklo_epi8(v[k], v[k + s / 2]);
+            t[2 * k + 1] = _mm_unpackhi_epi8(v[k], v[k + s / 2]);
+        }
+        memcpy(v, t, s * sizeof(__m128i));
+    }
+}
+
+#endif
+
+// Groups of eight elements gathered at once with odd sizes, so that the
+// PEXTs/PDEPs for each mask are done as arrays
+#define BITSHUFFLE_CHUNK    (256)
+
+// Byte transposes for 2, 4 and 8 bytes. These are inlined with a constant
+// S, so the vectors can stay in registers.
+static inline void bitshuffle_to_rows_pow2(uint8_t *dst, const uint8_t *src,
+        size_t n, size_t s) {
+    size_t i = 0;
+#if defined(HAS_SSE2) || defined(HAS_AVX2)
+    for (; i + 16 <= n; i += 16) {
+        __m128i v[8];
+        for (size_t k = 0; k < s; k++)
+            v[k] = _mm_loadu_si128((const __m128i *)(src + i * s) + k);
+        bitshuffle_split_bytes(v, s);
+        for (size_t b = 0; b < s; b++)
+            _mm_storeu_si128((__m128i *)(dst + b * n + i), v[b]);
+    }
+#endif
+    for (; i < n; i++) {
+        for (size_t b = 0; b < s; b++)
+            dst[b * n + i] = src[i * s + b];
+    }
+}
+
+static inline void bitshuffle_from_rows_pow2(uint8_t *dst, const uint8_t *src,
+        size_t n, size_t s) {
+    size_t i = 0;
+#if defined(HAS_SSE2) || defined(HAS_AVX2)
+    for (; i + 16 <= n; i += 16) {
+        __m128i v[8];
+        for (size_t b = 0; b < s; b++)
+            v[b] = _mm_loadu_si128((const __m128i *)(src + b * n + i));
+        bitshuffle_merge_bytes(v, s);
+        for (size_t k = 0; k < s; k++)
+            _mm_storeu_si128((__m128i *)(dst + i * s) + k, v[k]);
+    }
+#endif
+    for (; i < n; i++) {
+        for (size_t b = 0; b < s; b++)
+            dst[i * s + b] = src[b * n + i];
+    }
+}
+
+// DST[B*N + I] = SRC[I*S + B], for N a multiple of 8
+static void bitshuffle_to_rows(uint8_t *dst, const uint8_t *src, size_t n,
+        size_t s) {
+    switch (s) {
+        case 2: bitshuffle_to_rows_pow2(dst, src, n, 2); return;
+        case 4: bitshuffle_to_rows_pow2(dst, src, n, 4); return;
+        case 8: bitshuffle_to_rows_pow2(dst, src, n, 8); return;
+    }
+    // Each group of eight elements is S words, which are split into one
+    // array per word position. Then the bytes of the output rows are
+    // extracted from each array, and concatenated.
+    zp7_masks_64_t masks[8][8];
+    bitshuffle_byte_masks(masks, s);
+    uint64_t words[8][BITSHUFFLE_CHUNK], row[BITSHUFFLE_CHUNK],
+            part[BITSHUFFLE_CHUNK];
+    for (size_t g = 0; g < n / 8; g += BITSHUFFLE_CHUNK) {
+        size_t len = n / 8 - g < BITSHUFFLE_CHUNK ? n / 8 - g :
+            BITSHUFFLE_CHUNK;
+        for (size_t k = 0; k < len; k++) {
+            for (size_t w = 0; w < s; w++)
+                words[w][k] = bitshuffle_load(src + 8 * ((g + k) * s + w));
+        }
+        for (size_t b = 0; b < s; b++) {
+            // Every word has at least one byte of each, so the shifts stay
+            // below 64
+            zp7_pext_pre_array_64(row, words[0], len, &masks[b][0]);
+            int shift = (int)popcnt(masks[b][0].mask);
+            for (size_t w = 1; w < s; w++) {
+                zp7_pext_pre_array_64(part, words[w], len, &masks[b][w]);
+                for (size_t k = 0; k < len; k++)
+                    row[k] |= part[k] << shift;
+                shift += (int)popcnt(masks[b][w].mask);
+            }
+            for (size_t k = 0; k < len; k++)
+                bitshuffle_store(dst + b * n + 8 * (g + k), row[k]);
+        }
+    }
+}
+
+// The reverse of bitshuffle_to_rows()
+static void bitshuffle_from_rows(uint8_t *dst, const uint8_t *src, size_t n,
+        size_t s) {
+    switch (s) {
+        case 2: bitshuffle_from_rows_pow2(dst, src, n, 2); return;
+        case 4: bitshuffle_from_rows_pow2(dst, src, n, 4); return;
+        case 8: bitshuffle_from_rows_pow2(dst, src, n, 8); return;
+    }
+    zp7_masks_64_t masks[8][8];
+    bitshuffle_byte_masks(masks, s);
+    uint64_t words[8][BITSHUFFLE_CHUNK], row[BITSHUFFLE_CHUNK],
+            part[BITSHUFFLE_CHUNK];
+    for (size_t g = 0; g < n / 8; g += BITSHUFFLE_CHUNK) {
+        size_t len = n / 8 - g < BITSHUFFLE_CHUNK ? n / 8 - g :
+            BITSHUFFLE_CHUNK;
+        memset(words, 0, sizeof(words));
+        for (size_t b = 0; b < s; b++) {
+            for (size_t k = 0; k < len; k++)
+                row[k] = bitshuffle_load(src + b * n + 8 * (g + k));
+            for (size_t w = 0; w < s; w++) {
+                zp7_pdep_pre_array_64(part, row, len, &masks[b][w]);
+                int shift = (int)popcnt(masks[b][w].mask);
+                for (size_t k = 0; k < len; k++) {
+                    words[w][k] |= part[k];
+                    row[k] >>= shift;
+                }
+            }
+        }
+        for (size_t k = 0; k < len; k++) {
+            for (size_t w = 0; w < s; w++)
+                bitshuffle_store(dst + 8 * ((g + k) * s + w), words[w][k]);
+        }
+    }
+}
+
+// Bit transposes
+
+// Transpose each of the ROWS rows of N bytes in SRC into eight rows of N/8
+// bytes in DST
+static void bitshuffle_bits(uint8_t *dst, const uint8_t *src, size_t n,
+        size_t rows) {
+    size_t row_bytes = n / 8;
+    for (size_t b = 0; b < rows; b++) {
+        const uint8_t *in = src + b * n;
+        uint8_t *out = dst + b * 8 * row_bytes;
+        size_t g = 0;
+#if defined(HAS_AVX2)
+        for (; g + 4 <= row_bytes; g += 4) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(in + 8 * g));
+            for (int j = 7; j >= 0; j--) {
+                uint32_t m = (uint32_t)_mm256_movemask_epi8(v);
+                memcpy(out + j * row_bytes + g, &m, sizeof(m));
+                v = _mm256_slli_epi16(v, 1);
+            }
+        }
+#elif defined(HAS_SSE2)
+        for (; g + 2 <= row_bytes; g += 2) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(in + 8 * g));
+            for (int j = 7; j >= 0; j--) {
+                uint16_t m = (uint16_t)_mm_movemask_epi8(v);
+                memcpy(out + j * row_bytes + g, &m, sizeof(m));
+                v = _mm_slli_epi16(v, 1);
+            }
+        }
+#endif
+        for (; g < row_bytes; g++) {
+            uint64_t x = bitshuffle_transpose_8x8(bitshuffle_load(in + 8 * g));
+            for (int j = 0; j < 8; j++)
+                out[j * row_bytes + g] = (uint8_t)(x >> (8 * j));
+        }
+    }
+}
+
+#if defined(HAS_SSE2) || defined(HAS_AVX2)
+
+// Interleave the eight rows R into 64-bit lanes with byte J from row J, and
+// transpose each lane. For 128-bit vectors, this gives groups 2K and 2K+1 in
+// OUT[K]; for 256-bit ones, each 128-bit lane is done separately.
+#define BITSHUFFLE_UNBITS(v, r, out, unpacklo_8, unpackhi_8, unpacklo_16,     \
+        unpackhi_16, unpacklo_32, unpackhi_32, and_, xor_, srli, slli, set1)  \
+    do {                                                                    \
+        v p[8], q[8];                                                       \
+        for (int k = 0; k < 4; k++) {                                       \
+            p[2 * k] = unpacklo_8(r[2 * k], r[2 * k + 1]);                  \
+            p[2 * k + 1] = unpackhi_8(r[2 * k], r[2 * k + 1]);              \
+        }                                                                   \
+        for (int k = 0; k < 2; k++) {                                       \
+            q[4 * k] = unpacklo_16(p[4 * k], p[4 * k + 2]);                 \
+            q[4 * k + 1] = unpackhi_16(p[4 * k], p[4 * k + 2]);             \
+            q[4 * k + 2] = unpacklo_16(p[4 * k + 1], p[4 * k + 3]);         \
+            q[4 * k + 3] = unpackhi_16(p[4 * k + 1], p[4 * k + 3]);         \
+        }                                                                   \
+        for (int k = 0; k < 4; k++) {                                       \
+            out[2 * k] = unpacklo_32(q[k], q[k + 4]);                       \
+            out[2 * k + 1] = unpackhi_32(q[k], q[k + 4]);                   \
+        }                                                                   \
+        for (int k = 0; k < 8; k++) {                                       \
+            v x = out[k], t;                                                \
+            t = and_(xor_(x, srli(x, 7)), set1(0x00AA00AA00AA00AALL));        \
+            x = xor_(x, xor_(t, slli(t, 7)));                                 \
+            t = and_(xor_(x, srli(x, 14)), set1(0x0000CCCC0000CCCCLL));       \
+            x = xor_(x, xor_(t, slli(t, 14)));                                \
+            t = and_(xor_(x, srli(x, 28)), set1(0x00000000F0F0F0F0LL));       \
+            out[k] = xor_(x, xor_(t, slli(t, 28)));                           \
+        }                                                                   \
+    } while (0)
+
+#endif
+
+// The reverse of bitshuffle_bits()
+static void bitshuffle_unbits(uint8_t *dst, const uint8_t *src, size_t n,
+        size_t rows) {
+    size_t row_bytes = n / 8;
+    for (size_t b = 0; b < rows; b++) {
+        const uint8_t *in = src + b * 8 * row_bytes;
+        uint8_t *out = dst + b * n;
+        size_t g = 0;
+#if defined(HAS_AVX2)
+        for (; g + 32 <= row_bytes; g += 32) {
+            __m256i r[8], w[8];
+            for (int j = 0; j < 8; j++)
+                r[j] = _mm256_loadu_si256((const __m256i *)
+                        (in + j * row_bytes + g));
+            BITSHUFFLE_UNBITS(__m256i, r, w, _mm256_unpacklo_epi8,
+                    _mm256_unpackhi_epi8, _mm256_unpacklo_epi16,
+                    _mm256_unpackhi_epi16, _mm256_unpacklo_epi32,
+                    _mm256_unpackhi_epi32, _mm256_and_si256,
+                    _mm256_xor_si256, _mm256_srli_epi64, _mm256_slli_epi64,
+                    _mm256_set1_epi64x);
+            // The low lanes have groups 0-15, and the high lanes 16-31
+            for (int k = 0; k < 8; k += 2) {
+                _mm256_storeu_si256((__m256i *)(out + 8 * g + 16 * k),
+                        _mm256_permute2x128_si256(w[k], w[k + 1], 0x20));
+                _mm256_storeu_si256((__m256i *)(out + 8 * g + 128 + 16 * k),
+                        _mm256_permute2x128_si256(w[k], w[k + 1], 0x31));
+            }
+        }
+#endif
+#if defined(HAS_SSE2) || defined(HAS_AVX2)
+        for (; g + 16 <= row_bytes; g += 16) {
+            __m128i r[8], w[8];
+            for (int j = 0; j < 8; j++)
+                r[j] = _mm_loadu_si128((const __m128i *)
+                        (in + j * row_bytes + g));
+            BITSHUFFLE_UNBITS(__m128i, r, w, _mm_unpacklo_epi8,
+                    _mm_unpackhi_epi8, _mm_unpacklo_epi16, _mm_unpackhi_epi16,
+                    _mm_unpacklo_epi32, _mm_unpackhi_epi32, _mm_and_si128,
+                    _mm_xor_si128, _mm_srli_epi64, _mm_slli_epi64,
+                    _mm_set1_epi64x);
+            for (int k = 0; k < 8; k++)
+                _mm_storeu_si128((__m128i *)(out + 8 * g + 16 * k), w[k]);
+        }
+#endif
+        for (; g < row_bytes; g++) {
+            uint64_t x = 0;
+            for (int j = 0; j < 8; j++)
+                x |= (uint64_t)in[j * row_bytes + g] << (8 * j);
+            bitshuffle_store(out + 8 * g, bitshuffle_transpose_8x8(x));
+        }
+    }
+}
+
+// Bitshuffle N elements of ELEM_SIZE bytes (1 to 8) from SRC to DST. TMP
+// needs room for N*ELEM_SIZE bytes.
+int zp7_bitshuffle(uint8_t *dst, const uint8_t *src, size_t n,
+        size_t elem_size, uint8_t *tmp) {
+    if (elem_size < 1 || elem_size > 8)
+        return ZP7_BITSHUFFLE_ERR_SIZE;
+    size_t n_8 = n & ~(size_t)7;
+    if (elem_size == 1)
+        bitshuffle_bits(dst, src, n_8, 1);
+    else {
+        bitshuffle_to_rows(tmp, src, n_8, elem_size);
+        bitshuffle_bits(dst, tmp, n_8, elem_size);
+    }
+    memcpy(dst + n_8 * elem_size, src + n_8 * elem_size,
+            (n - n_8) * elem_size);
+    return 0;
+}
+
+// Undo zp7_bitshuffle()
+int zp7_bitunshuffle(uint8_t *dst, const uint8_t *src, size_t n,
+        size_t elem_size, uint8_t *tmp) {
+    if (elem_size < 1 || elem_size > 8)
+        return ZP7_BITSHUFFLE_ERR_SIZE;
+    size_t n_8 = n & ~(size_t)7;
+    if (elem_size == 1)
+        bitshuffle_unbits(dst, src, n_8, 1);
+    else {
+        bitshuffle_unbits(tmp, src, n_8, elem_size);
+        bitshuffle_from_rows(dst, tmp, n_8, elem_size);
+    }
+    memcpy(dst + n_8 * elem_size, src + n_8 * elem_size,
+            (n - n_8) * elem_size);
+    return 0;
+}
+
+// Streaming
+//
+// Compressors work on fixed-size blocks, each shuffled on its own. The
+// stream takes input in pieces of any size, and outputs each block as soon
+// as it's complete. The last block can be partial, and is shuffled the same
+// way when unshuffling, so the same block size has to be used for both.
+
+typedef struct {
+    size_t elem_size;
+    // Block size in bytes, a multiple of 8 elements
+    size_t block_size;
+    int unshuffle;
+    // The block being filled, and scratch space
+    uint8_t *buf;
+    size_t fill;
+    uint8_t *tmp;
+} zp7_bitshuffle_stream_t;
+
+// Start a stream that shuffles (or unshuffles, if UNSHUFFLE is set) blocks
+// of BLOCK_ELEMS elements (a multiple of 8), or about
+// ZP7_BITSHUFFLE_BLOCK_BYTES bytes if BLOCK_ELEMS is 0
+int zp7_bitshuffle_stream_init(zp7_bitshuffle_stream_t *s, size_t elem_size,
+        size_t block_elems, int unshuffle) {
+    memset(s, 0, sizeof(*s));
+    if (elem_size < 1 || elem_size > 8 || block_elems % 8)
+        return ZP7_BITSHUFFLE_ERR_SIZE;
+    if (block_elems == 0)
+        block_elems = ZP7_BITSHUFFLE_BLOCK_BYTES / elem_size & ~(size_t)7;
+    s->elem_size = elem_size;
+    s->block_size = block_elems * elem_size;
+    s->unshuffle = unshuffle;
+    s->buf = (uint8_t *)malloc(s->block_size);
+    s->tmp = (uint8_t *)malloc(s->block_size);
+    if (!s->buf || !s->tmp) {
+        free(s->buf);
+        free(s->tmp);
+        return ZP7_BITSHUFFLE_ERR_MEMORY;
+    }
+    return 0;
+}
+
+void zp7_bitshuffle_stream_free(zp7_bitshuffle_stream_t *s) {
+    free(s->buf);
+    free(s->tmp);
+    memset(s, 0, sizeof(*s));
+}
+
+static void bitshuffle_stream_block(zp7_bitshuffle_stream_t *s, uint8_t *dst,
+        const uint8_t *src, size_t size) {
+    size_t n = size / s->elem_size;
+    if (s->unshuffle)
+        zp7_bitunshuffle(dst, src, n, s->elem_size, s->tmp);
+    else
+        zp7_bitshuffle(dst, src, n, s->elem_size, s->tmp);
+}
+
+// Feed SIZE bytes from SRC to the stream, and write any completed blocks to
+// DST. Returns the number of bytes written, which is at most SIZE plus one
+// block.
+size_t zp7_bitshuffle_stream_write(zp7_bitshuffle_stream_t *s, uint8_t *dst,
+        const uint8_t *src, size_t size) {
+    size_t written = 0;
+    // Finish a partially filled block first
+    if (s->fill > 0) {
+        size_t len = s->block_size - s->fill;
+        if (len > size)
+            len = size;
+        memcpy(s->buf + s->fill, src, len);
+        s->fill += len;
+        src += len;
+        size -= len;
+        if (s->fill < s->block_size)
+            return 0;
+        bitshuffle_stream_block(s, dst, s->buf, s->block_size);
+        written = s->block_size;
+        s->fill = 0;
+    }
+    // Then whole blocks straight from the input
+    for (; size >= s->block_size; size -= s->block_size) {
+        bitshuffle_stream_block(s, dst + written, src, s->block_size);
+        src += s->block_size;
+        written += s->block_size;
+    }
+    memcpy(s->buf, src, size);
+    s->fill = size;
+    return written;
+}
+
+// Write out the last, partial block, and return its size. The input must be
+// a whole number of elements.
+size_t zp7_bitshuffle_stream_finish(zp7_bitshuffle_stream_t *s,
+        uint8_t *dst) {
+    size_t size = s->fill;
+    bitshuffle_stream_block(s, dst, s->buf, size);
+    s->fill = 0;
+    return size;
+}
+
+#endif
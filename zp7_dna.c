@@ -0,0 +1,346 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef ZP7_DNA_C
+#define ZP7_DNA_C
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef HAS_AVX2
+#   include <immintrin.h>
+#endif
+
+// Nucleotide packing
+//
+// The ASCII codes for A, C, G and T (in either case) differ in bits 1 and
+// 2, which give A=0, C=1, G=3 and T=2, so packing a sequence into 2-bit
+// codes is a PEXT of those bits from each byte, and unpacking is a PDEP
+// followed by some arithmetic to turn the two bits back into letters. The
+// complement of a base is its code XOR 2, so reverse complements of packed
+// sequences just reverse the order of the 2-bit fields and flip one bit of
+// each.
+//
+// N also needs bit 3, which is only set for N among these letters, so the
+// 4-bit codes are bits 1-3 of the character: the same as the 2-bit codes,
+// plus 4 for N (so N is 7). Its complement is itself.
+//
+// Sequences are packed from the low bits up, 32 bases to a word with 2-bit
+// codes, and 16 with 4-bit codes. The unused codes at the end of the last
+// word are zero. Characters other than ACGTN are packed as whatever their
+// bits happen to be, and unpacking always gives upper case.
+//
+// The masks are fixed, so like zp7_pixel.c, the PEXT/PDEP code for them is
+// generated by zp7-gen: the ZP7 stages with the PPP masks as constants,
+// trimmed to the bits in use. The 4-bit codes are shifted down first, so
+// they're the low three bits of each nibble after packing the low nibble of
+// every byte. The packing and reverse complement loops are straight-line
+// code on whole words, which compilers vectorize. Unpacking spreads groups
+// of codes across lanes, which they don't, so it has an explicit AVX2 path
+// (with HAS_AVX2) running the same stages on four words at once.
+
+// Little-endian loads and stores, which compile to plain moves on
+// little-endian hosts
+static inline uint64_t dna_load(const char *p) {
+    uint64_t x = 0;
+    for (int k = 0; k < 8; k++)
+        x |= (uint64_t)(uint8_t)p[k] << (8 * k);
+    return x;
+}
+
+static inline void dna_store(char *p, uint64_t x) {
+    for (int k = 0; k < 8; k++)
+        p[k] = (char)(x >> (8 * k));
+}
+
+// Load the last N (less than 8) characters of a sequence, padded with zeros
+static inline uint64_t dna_load_partial(const char *p, size_t n) {
+    uint64_t x = 0;
+    for (size_t k = 0; k < n; k++)
+        x |= (uint64_t)(uint8_t)p[k] << (8 * k);
+    return x;
+}
+
+// Generated code
+//
+// Output of zp7-gen -p dna for these masks:
+//
+//     code2   0x0606060606060606
+//     nibbles 0x0F0F0F0F0F0F0F0F
+
+// PEXT with 0x0606060606060606: stages, 22 ops
+static inline uint64_t dna_pext_code2(uint64_t a) {
+    a = (a & 0x0606060606060606ULL) >> 1;
+    a = (a & 0x0003000300030003ULL) | ((a & 0x0300030003000300ULL) >> 2);
+    a = (a & 0x00c0000300c00003ULL) | ((a & 0x000300c0000300c0ULL) >> 4);
+    a = (a & 0x0000300000c0000fULL) | ((a & 0x00c0000f00003000ULL) >> 8);
+    a = (a & 0x0000f0000000003fULL) | ((a & 0x000000000fc00000ULL) >> 16);
+    a = (a & 0x0000000000000fffULL) | ((a & 0x0000f00000000000ULL) >> 32);
+    return a;
+}
+
+#define DNA_PEXT_CODE2_STAGES(STAGE) \
+    STAGE(0x0000000000000000ULL, 0x0606060606060606ULL, 1) \
+    STAGE(0x0003000300030003ULL, 0x0300030003000300ULL, 2) \
+    STAGE(0x00c0000300c00003ULL, 0x000300c0000300c0ULL, 4) \
+    STAGE(0x0000300000c0000fULL, 0x00c0000f00003000ULL, 8) \
+    STAGE(0x0000f0000000003fULL, 0x000000000fc00000ULL, 16) \
+    STAGE(0x0000000000000fffULL, 0x0000f00000000000ULL, 32)
+
+// PDEP with 0x0606060606060606: stages, 22 ops
+static inline uint64_t dna_pdep_code2(uint64_t a) {
+    a = (a & 0x0000000000000fffULL) + ((a & 0x000000000000f000ULL) << 32);
+    a = (a & 0x0000f0000000003fULL) + ((a & 0x0000000000000fc0ULL) << 16);
+    a = (a & 0x0000300000c0000fULL) + ((a & 0x0000c0000f000030ULL) << 8);
+    a = (a & 0x00c0000300c00003ULL) + ((a & 0x0000300c0000300cULL) << 4);
+    a = (a & 0x0003000300030003ULL) + ((a & 0x00c000c000c000c0ULL) << 2);
+    a = (a & 0x0303030303030303ULL) << 1;
+    return a;
+}
+
+#define DNA_PDEP_CODE2_STAGES(STAGE) \
+    STAGE(0x0000000000000fffULL, 0x000000000000f000ULL, 32) \
+    STAGE(0x0000f0000000003fULL, 0x0000000000000fc0ULL, 16) \
+    STAGE(0x0000300000c0000fULL, 0x0000c0000f000030ULL, 8) \
+    STAGE(0x00c0000300c00003ULL, 0x0000300c0000300cULL, 4) \
+    STAGE(0x0003000300030003ULL, 0x00c000c000c000c0ULL, 2) \
+    STAGE(0x0000000000000000ULL, 0x0303030303030303ULL, 1)
+
+// PEXT with 0x0f0f0f0f0f0f0f0f: stages, 12 ops
+static inline uint64_t dna_pext_nibbles(uint64_t a) {
+    a = (a & 0x000f000f000f000fULL) | ((a & 0x0f000f000f000f00ULL) >> 4);
+    a = (a & 0x000000ff000000ffULL) | ((a & 0x00ff000000ff0000ULL) >> 8);
+    a = (a & 0x000000000000ffffULL) | ((a & 0x0000ffff00000000ULL) >> 16);
+    return a;
+}
+
+#define DNA_PEXT_NIBBLES_STAGES(STAGE) \
+    STAGE(0x000f000f000f000fULL, 0x0f000f000f000f00ULL, 4) \
+    STAGE(0x000000ff000000ffULL, 0x00ff000000ff0000ULL, 8) \
+    STAGE(0x000000000000ffffULL, 0x0000ffff00000000ULL, 16)
+
+// PDEP with 0x0f0f0f0f0f0f0f0f: stages, 12 ops
+static inline uint64_t dna_pdep_nibbles(uint64_t a) {
+    a = (a & 0x000000000000ffffULL) + ((a & 0x00000000ffff0000ULL) << 16);
+    a = (a & 0x000000ff000000ffULL) + ((a & 0x0000ff000000ff00ULL) << 8);
+    a = (a & 0x000f000f000f000fULL) + ((a & 0x00f000f000f000f0ULL) << 4);
+    return a;
+}
+
+#define DNA_PDEP_NIBBLES_STAGES(STAGE) \
+    STAGE(0x000000000000ffffULL, 0x00000000ffff0000ULL, 16) \
+    STAGE(0x000000ff000000ffULL, 0x0000ff000000ff00ULL, 8) \
+    STAGE(0x000f000f000f000fULL, 0x00f000f000f000f0ULL, 4)
+
+// Letters
+
+// Turn each byte of X, holding a 4-bit code in bits 1-3, into its letter:
+// 0x41 ('A') plus the code bits gives A, C and G, T needs another 0x0F,
+// and N (which would be 'O') one less.
+static inline uint64_t dna_letters(uint64_t x) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t t = x >> 2 & ~(x >> 1) & ~(x >> 3) & ones;
+    uint64_t n = x >> 3 & ones;
+    return (x | 0x41 * ones) + t * 0x0F - n;
+}
+
+#ifdef HAS_AVX2
+
+// The same PDEPs and letters on each 64-bit lane, for unpacking 32 bases at
+// a time. The stages come from the lists zp7-gen makes with the functions
+// above, so the constants only exist once. A stage without any bits to keep
+// is just the shift.
+
+#define DNA_PDEP_STAGE(keep, move, shift)                                   \
+    a = (keep) ? _mm256_add_epi64(                                          \
+            _mm256_and_si256(a, _mm256_set1_epi64x(keep)),                  \
+            _mm256_slli_epi64(_mm256_and_si256(a,                           \
+                    _mm256_set1_epi64x(move)), shift)) :                    \
+        _mm256_slli_epi64(_mm256_and_si256(a, _mm256_set1_epi64x(move)),    \
+                shift);
+
+static inline __m256i dna_pdep_code2_avx2(__m256i a) {
+    DNA_PDEP_CODE2_STAGES(DNA_PDEP_STAGE)
+    return a;
+}
+
+static inline __m256i dna_pdep_nibbles_avx2(__m256i a) {
+    DNA_PDEP_NIBBLES_STAGES(DNA_PDEP_STAGE)
+    return a;
+}
+
+static inline __m256i dna_letters_avx2(__m256i x) {
+    __m256i ones = _mm256_set1_epi8(1);
+    __m256i t = _mm256_andnot_si256(
+            _mm256_or_si256(_mm256_srli_epi64(x, 1), _mm256_srli_epi64(x, 3)),
+            _mm256_and_si256(_mm256_srli_epi64(x, 2), ones));
+    __m256i n = _mm256_and_si256(_mm256_srli_epi64(x, 3), ones);
+    __m256i y = _mm256_or_si256(x, _mm256_set1_epi8(0x41));
+    // Add 15 for T and take 1 for N, which don't borrow from other bytes
+    y = _mm256_add_epi64(y, _mm256_sub_epi64(_mm256_slli_epi64(t, 4), t));
+    return _mm256_sub_epi64(y, n);
+}
+
+#endif
+
+// Packing
+
+// Pack N bases of SRC into 2-bit codes in DST, which needs (N + 31) / 32
+// words
+void zp7_dna_pack2(uint64_t *dst, const char *src, size_t n) {
+    size_t n_words = n / 32;
+    for (size_t i = 0; i < n_words; i++) {
+        const char *p = src + 32 * i;
+        dst[i] = dna_pext_code2(dna_load(p)) |
+            dna_pext_code2(dna_load(p + 8)) << 16 |
+            dna_pext_code2(dna_load(p + 16)) << 32 |
+            dna_pext_code2(dna_load(p + 24)) << 48;
+    }
+    if (n % 32) {
+        uint64_t x = 0;
+        for (size_t k = 32 * n_words; k < n; k += 8) {
+            size_t len = n - k < 8 ? n - k : 8;
+            x |= dna_pext_code2(dna_load_partial(src + k, len)) <<
+                (2 * (k % 32));
+        }
+        dst[n_words] = x;
+    }
+}
+
+// Unpack N bases from 2-bit codes in SRC to letters in DST
+void zp7_dna_unpack2(char *dst, const uint64_t *src, size_t n) {
+    size_t i = 0;
+#ifdef HAS_AVX2
+    for (; i + 32 <= n; i += 32) {
+        // Spread the word's 16-bit groups of codes across the lanes
+        __m128i w = _mm_loadl_epi64((const __m128i *)(src + i / 32));
+        __m256i x = dna_pdep_code2_avx2(_mm256_cvtepu16_epi64(w));
+        _mm256_storeu_si256((__m256i *)(dst + i), dna_letters_avx2(x));
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x = dna_pdep_code2(src[i / 32] >> (2 * (i % 32)));
+        dna_store(dst + i, dna_letters(x));
+    }
+    if (i < n) {
+        uint64_t x = dna_letters(dna_pdep_code2(src[i / 32] >> (2 * (i % 32))));
+        for (size_t k = 0; i + k < n; k++)
+            dst[i + k] = (char)(x >> (8 * k));
+    }
+}
+
+// The 4-bit codes of 8 characters, as 32 bits
+static inline uint64_t dna_pack4_word(uint64_t x) {
+    return dna_pext_nibbles(x >> 1 & 0x0707070707070707ULL);
+}
+
+// Pack N bases of SRC into 4-bit codes in DST, which needs (N + 15) / 16
+// words
+void zp7_dna_pack4(uint64_t *dst, const char *src, size_t n) {
+    size_t n_words = n / 16;
+    for (size_t i = 0; i < n_words; i++) {
+        const char *p = src + 16 * i;
+        dst[i] = dna_pack4_word(dna_load(p)) |
+            dna_pack4_word(dna_load(p + 8)) << 32;
+    }
+    if (n % 16) {
+        uint64_t x = 0;
+        for (size_t k = 16 * n_words; k < n; k += 8) {
+            size_t len = n - k < 8 ? n - k : 8;
+            x |= dna_pack4_word(dna_load_partial(src + k, len)) <<
+                (4 * (k % 16));
+        }
+        dst[n_words] = x;
+    }
+}
+
+// Unpack N bases from 4-bit codes in SRC to letters in DST
+void zp7_dna_unpack4(char *dst, const uint64_t *src, size_t n) {
+    size_t i = 0;
+#ifdef HAS_AVX2
+    for (; i + 32 <= n; i += 32) {
+        __m128i w = _mm_loadu_si128((const __m128i *)(src + i / 16));
+        __m256i x = dna_pdep_nibbles_avx2(_mm256_cvtepu32_epi64(w));
+        x = _mm256_slli_epi64(x, 1);
+        _mm256_storeu_si256((__m256i *)(dst + i), dna_letters_avx2(x));
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x = dna_pdep_nibbles(src[i / 16] >> (4 * (i % 16))) << 1;
+        dna_store(dst + i, dna_letters(x));
+    }
+    if (i < n) {
+        uint64_t x = dna_pdep_nibbles(src[i / 16] >> (4 * (i % 16))) << 1;
+        x = dna_letters(x);
+        for (size_t k = 0; i + k < n; k++)
+            dst[i + k] = (char)(x >> (8 * k));
+    }
+}
+
+// Reverse complements
+//
+// Each word is reversed and complemented, and the words are taken in
+// reverse order. Unless the sequence fills the last word, that leaves the
+// padding at the bottom of the first word, so everything is shifted down
+// across words by the size of the padding.
+
+static inline uint64_t dna_revcomp2_word(uint64_t x) {
+    x = (x >> 2 & 0x3333333333333333ULL) | (x & 0x3333333333333333ULL) << 2;
+    x = (x >> 4 & 0x0F0F0F0F0F0F0F0FULL) | (x & 0x0F0F0F0F0F0F0F0FULL) << 4;
+    return __builtin_bswap64(x) ^ 0xAAAAAAAAAAAAAAAAULL;
+}
+
+// Flip the 2 bit of each code, unless the 4 bit is set (for N)
+static inline uint64_t dna_revcomp4_word(uint64_t x) {
+    x = (x >> 4 & 0x0F0F0F0F0F0F0F0FULL) | (x & 0x0F0F0F0F0F0F0F0FULL) << 4;
+    x = __builtin_bswap64(x);
+    return x ^ (~x >> 1 & 0x2222222222222222ULL);
+}
+
+// Reverse complement N packed bases from SRC into DST. DST and SRC can't
+// overlap.
+#define DNA_REVCOMP(dst, src, n, per_word, bits, revcomp_word)              \
+    do {                                                                    \
+        size_t n_words = ((n) + (per_word) - 1) / (per_word);               \
+        int pad = (int)((n_words * (per_word) - (n)) * (bits));             \
+        if (pad == 0) {                                                     \
+            for (size_t i = 0; i < n_words; i++)                            \
+                dst[i] = revcomp_word(src[n_words - 1 - i]);                \
+            break;                                                          \
+        }                                                                   \
+        for (size_t i = 0; i < n_words; i++) {                              \
+            uint64_t lo = revcomp_word(src[n_words - 1 - i]) >> pad;        \
+            uint64_t hi = i + 1 < n_words ?                                 \
+                revcomp_word(src[n_words - 2 - i]) << (64 - pad) : 0;       \
+            dst[i] = lo | hi;                                               \
+        }                                                                   \
+    } while (0)
+
+void zp7_dna_revcomp2(uint64_t *dst, const uint64_t *src, size_t n) {
+    DNA_REVCOMP(dst, src, n, 32, 2, dna_revcomp2_word);
+}
+
+void zp7_dna_revcomp4(uint64_t *dst, const uint64_t *src, size_t n) {
+    DNA_REVCOMP(dst, src, n, 16, 4, dna_revcomp4_word);
+}
+
+#endif
@@ -0,0 +1,440 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// zp7-extract: apply PEXT or PDEP to every 8-byte word of a file
+//
+//     zp7-extract [-d] [-t THREADS] [-o OUTPUT] [-q] -m MASK[,MASK...] [INPUT]
+//
+// Each native-endian 64-bit word of INPUT (or stdin, if INPUT is missing or
+// "-") is replaced by its PEXT (or PDEP, with -d) with MASK, and written to
+// OUTPUT (or stdout). With several comma-separated masks, they're used in a
+// repeating pattern: word I uses mask I mod the number of masks, which is
+// handy for pulling fields out of arrays of multi-word records. A partial
+// word at the end of the input is padded with zero bytes. The throughput is
+// reported on stderr, unless -q is given.
+//
+// This tries to avoid copying the data more than necessary. A regular input
+// file is mapped with mmap rather than read, and an OUTPUT file is sized up
+// front and mapped too, so the kernels read and write the page cache
+// directly. When stdout is a pipe, the output is handed to the pipe with
+// vmsplice, which gifts freshly mapped pages to it instead of copying them.
+// Anything else (like input from a pipe, or stdout redirected to a file)
+// falls back to read/write in blocks.
+//
+// Build with the same flags as the code that uses ZP7, plus -pthread, e.g.:
+//
+//     cc -O3 -march=native -DHAS_CLMUL -DHAS_BZHI -DHAS_POPCNT -pthread
+//         zp7_extract.c -o zp7-extract
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "zp7.c"
+#include "zp7_parallel.c"
+
+#define MAX_MASKS       (64)
+
+// Words per block when streaming
+#define BLOCK_WORDS     (1 << 17)
+
+// Words per block of expanded masks, for mask patterns
+#define MASK_WORDS      (1024)
+
+typedef struct {
+    int pdep;
+    uint64_t mask[MAX_MASKS];
+    int n_masks;
+    zp7_masks_64_t masks;
+
+    // The current piece of the data, and the index of its first word in the
+    // whole stream, for lining up the mask pattern
+    uint64_t *dst;
+    const uint64_t *src;
+    size_t base;
+} extract_t;
+
+// Process words [BEGIN, END) of the current piece. This is run on the thread
+// pool, so it only touches its own range.
+static void extract_range(void *p, size_t begin, size_t end) {
+    extract_t *ex = (extract_t *)p;
+    uint64_t *dst = ex->dst + begin;
+    const uint64_t *src = ex->src + begin;
+    size_t n = end - begin;
+
+    if (ex->n_masks == 1) {
+        if (ex->pdep)
+            zp7_pdep_pre_array_64(dst, src, n, &ex->masks);
+        else
+            zp7_pext_pre_array_64(dst, src, n, &ex->masks);
+        return;
+    }
+
+    // Expand the pattern into a block of masks, one per word
+    uint64_t mask[MASK_WORDS];
+    for (size_t b = 0; b < n; b += MASK_WORDS) {
+        size_t len = n - b < MASK_WORDS ? n - b : MASK_WORDS;
+        size_t m = (ex->base + begin + b) % ex->n_masks;
+        for (size_t i = 0; i < len; i++) {
+            mask[i] = ex->mask[m];
+            if (++m == (size_t)ex->n_masks)
+                m = 0;
+        }
+        if (ex->pdep)
+            zp7_pdep_array_64(dst + b, src + b, mask, len);
+        else
+            zp7_pext_array_64(dst + b, src + b, mask, len);
+    }
+}
+
+static void extract(zp7_pool_t *pool, extract_t *ex, uint64_t *dst,
+        const uint64_t *src, size_t n, size_t base) {
+    ex->dst = dst;
+    ex->src = src;
+    ex->base = base;
+    zp7_pool_run(pool, n, ZP7_POOL_CHUNK, extract_range, ex);
+}
+
+// Output
+//
+// Output blocks are either written from one reused buffer, or, when the
+// output is a pipe, handed to the pipe with vmsplice. vmsplice only puts
+// references to the pages into the pipe, and the reader can keep them for
+// as long as it likes (tee or splice can pass them on without copying), so
+// there's no way to tell when a buffer could safely be rewritten. Instead,
+// each spliced block gets freshly mapped pages, which are gifted to the
+// pipe and unmapped right away: the pipe's references keep them alive, and
+// nothing ever writes to them again.
+
+typedef struct {
+    int fd;
+    // Whether to try vmsplice. This is cleared if it fails, e.g. because the
+    // output isn't a pipe after all.
+    int splice;
+    // Words per block, and the buffer for blocks that are written
+    size_t words;
+    uint64_t *buf;
+} output_t;
+
+static int output_init(output_t *out) {
+    out->words = BLOCK_WORDS;
+#ifdef __linux__
+    if (out->splice) {
+        // Try to get a bigger pipe, then match the blocks to its size, so
+        // each block is one vmsplice
+        fcntl(out->fd, F_SETPIPE_SZ, BLOCK_WORDS * sizeof(uint64_t));
+        int size = fcntl(out->fd, F_GETPIPE_SZ);
+        if (size > 0)
+            out->words = size / sizeof(uint64_t);
+    }
+#endif
+    out->buf = aligned_alloc(4096, out->words * sizeof(uint64_t));
+    return out->buf ? 0 : -1;
+}
+
+static void output_free(output_t *out) {
+    free(out->buf);
+}
+
+// A buffer for the next block of up to OUT->words words
+static uint64_t *output_buffer(output_t *out) {
+#ifdef __linux__
+    if (out->splice) {
+        void *buf = mmap(NULL, out->words * sizeof(uint64_t),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return buf != MAP_FAILED ? (uint64_t *)buf : NULL;
+    }
+#endif
+    return out->buf;
+}
+
+static int write_all(int fd, const char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t r = write(fd, buf, size);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += r;
+        size -= r;
+    }
+    return 0;
+}
+
+// Output SIZE bytes of BUF, which came from output_buffer(). A spliced
+// buffer is unmapped here, so it can't be used afterwards.
+static int output(output_t *out, uint64_t *buf, size_t size) {
+    const char *p = (const char *)buf;
+    int r = 0;
+#ifdef __linux__
+    if (buf != out->buf) {
+        struct iovec iov = { buf, size };
+        while (iov.iov_len > 0 && out->splice) {
+            ssize_t n = vmsplice(out->fd, &iov, 1, SPLICE_F_GIFT);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EINVAL || errno == EBADF) {
+                    out->splice = 0;
+                    break;
+                }
+                r = -1;
+                break;
+            }
+            iov.iov_base = (char *)iov.iov_base + n;
+            iov.iov_len -= n;
+        }
+        p = (const char *)iov.iov_base;
+        size = iov.iov_len;
+        // Whatever vmsplice didn't take (if it turned out not to work) is
+        // written normally
+        if (r == 0 && size > 0)
+            r = write_all(out->fd, p, size);
+        munmap(buf, out->words * sizeof(uint64_t));
+        return r;
+    }
+#endif
+    return write_all(out->fd, p, size);
+}
+
+// Read up to SIZE bytes, stopping early only at the end of the input
+static ssize_t read_all(int fd, char *buf, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t r = read(fd, buf + total, size - total);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (r == 0)
+            break;
+        total += r;
+    }
+    return total;
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-d] [-t THREADS] [-o OUTPUT] [-q] "
+            "-m MASK[,MASK...] [INPUT]\n", name);
+    exit(2);
+}
+
+static void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    extract_t ex;
+    memset(&ex, 0, sizeof(ex));
+    const char *out_path = NULL;
+    int n_threads = 1;
+    int quiet = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "dm:o:t:q")) != -1) {
+        switch (opt) {
+            case 'd':
+                ex.pdep = 1;
+                break;
+            case 'm': {
+                char *s = optarg;
+                for (;;) {
+                    char *end;
+                    errno = 0;
+                    uint64_t m = strtoull(s, &end, 0);
+                    if (end == s || errno || ex.n_masks == MAX_MASKS ||
+                            (*end != ',' && *end != '\0')) {
+                        fprintf(stderr, "bad mask list: %s\n", optarg);
+                        exit(2);
+                    }
+                    ex.mask[ex.n_masks++] = m;
+                    if (*end == '\0')
+                        break;
+                    s = end + 1;
+                }
+                break;
+            }
+            case 'o':
+                out_path = optarg;
+                break;
+            case 't': {
+                // 0 means one thread per CPU
+                char *end;
+                errno = 0;
+                long t = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || errno || t < 0 ||
+                        t > ZP7_POOL_MAX_THREADS) {
+                    fprintf(stderr, "bad thread count: %s (0 to %d)\n",
+                            optarg, ZP7_POOL_MAX_THREADS);
+                    exit(2);
+                }
+                n_threads = (int)t;
+                break;
+            }
+            case 'q':
+                quiet = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (ex.n_masks == 0 || optind < argc - 1)
+        usage(argv[0]);
+    ex.masks = zp7_ppp_64(ex.mask[0]);
+
+    int in_fd = 0;
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+        in_fd = open(argv[optind], O_RDONLY);
+        if (in_fd < 0)
+            die(argv[optind]);
+    }
+    output_t out = { 1, 0, 0, NULL };
+    if (out_path) {
+        out.fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (out.fd < 0)
+            die(out_path);
+    }
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) != 0 || fstat(out.fd, &out_st) != 0)
+        die("fstat");
+#ifdef __linux__
+    out.splice = S_ISFIFO(out_st.st_mode);
+#endif
+
+    zp7_pool_t *pool = NULL;
+    if (n_threads != 1 && !(pool = zp7_pool_create(n_threads, 0)))
+        die("zp7_pool_create");
+    double start = now_sec();
+    uint64_t bytes = 0;
+
+    if (S_ISREG(in_st.st_mode) && in_st.st_size > 0) {
+        // Mapped input. Any partial word at the end is handled separately,
+        // so the kernels can read the mapping directly.
+        size_t size = in_st.st_size;
+        size_t n = size / sizeof(uint64_t);
+        size_t n_out = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        const uint64_t *src = mmap(NULL, size, PROT_READ, MAP_SHARED, in_fd,
+                0);
+        if (src == MAP_FAILED)
+            die("mmap input");
+        madvise((void *)src, size, MADV_SEQUENTIAL);
+        uint64_t last = 0;
+        memcpy(&last, src + n, size - n * sizeof(uint64_t));
+        bytes = size;
+
+        if (out_path && S_ISREG(out_st.st_mode)) {
+            // Mapped output. This is only done for a file opened here: stdout
+            // redirected to a file is usually write-only, or appending, and
+            // truncating it could lose what's already there.
+            size_t out_size = n_out * sizeof(uint64_t);
+            if (ftruncate(out.fd, out_size) != 0)
+                die("ftruncate");
+            uint64_t *dst = mmap(NULL, out_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, out.fd, 0);
+            if (dst == MAP_FAILED)
+                die("mmap output");
+            extract(pool, &ex, dst, src, n, 0);
+            if (n_out > n)
+                extract(pool, &ex, dst + n, &last, 1, n);
+            munmap(dst, out_size);
+        } else {
+            if (output_init(&out) != 0)
+                die("malloc");
+            for (size_t i = 0; i < n_out; i += out.words) {
+                size_t len = n_out - i < out.words ? n_out - i : out.words;
+                uint64_t *buf = output_buffer(&out);
+                if (!buf)
+                    die("mmap");
+                size_t full = i + len <= n ? len : n - i;
+                extract(pool, &ex, buf, src + i, full, i);
+                if (full < len)
+                    extract(pool, &ex, buf + full, &last, 1, n);
+                if (output(&out, buf, len * sizeof(uint64_t)) != 0)
+                    die("write");
+            }
+            output_free(&out);
+        }
+        munmap((void *)src, size);
+    } else {
+        // Streaming input
+        if (output_init(&out) != 0)
+            die("malloc");
+        uint64_t *in = malloc(out.words * sizeof(uint64_t));
+        if (!in)
+            die("malloc");
+        for (size_t base = 0; ; ) {
+            ssize_t size = read_all(in_fd, (char *)in,
+                    out.words * sizeof(uint64_t));
+            if (size < 0)
+                die("read");
+            if (size == 0)
+                break;
+            // Zero-pad a partial word
+            size_t len = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+            memset((char *)in + size, 0, len * sizeof(uint64_t) - size);
+
+            uint64_t *buf = output_buffer(&out);
+            if (!buf)
+                die("mmap");
+            extract(pool, &ex, buf, in, len, base);
+            if (output(&out, buf, len * sizeof(uint64_t)) != 0)
+                die("write");
+            base += len;
+            bytes += size;
+            if ((size_t)size < out.words * sizeof(uint64_t))
+                break;
+        }
+        free(in);
+        output_free(&out);
+    }
+
+    double elapsed = now_sec() - start;
+    if (!quiet)
+        fprintf(stderr, "%llu bytes in %.3f s, %.2f GB/s\n",
+                (unsigned long long)bytes, elapsed,
+                elapsed > 0 ? bytes / elapsed * 1e-9 : 0.0);
+
+    zp7_pool_destroy(pool);
+    if (out_path && close(out.fd) != 0)
+        die(out_path);
+    return 0;
+}
@@ -0,0 +1,482 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// zp7-gen: generate C code for PEXT/PDEP with fixed masks
+//
+//     zp7-gen [-p PREFIX] [-o OUTPUT] [INPUT]
+//
+// INPUT (or stdin) lists masks that are known at build time, one per line as
+// "NAME MASK", where MASK is in any base strtoull() accepts. Blank lines and
+// anything after a '#' are ignored. The output (to OUTPUT, or stdout) is a
+// header with two static inline functions for each mask:
+//
+//     static inline uint64_t PREFIX_pext_NAME(uint64_t a);
+//     static inline uint64_t PREFIX_pdep_NAME(uint64_t a);
+//
+// PREFIX defaults to "zp7". The header is self-contained (it only needs
+// <stdint.h>), so it can be used from C code that doesn't include zp7.c.
+// OUTPUT is only replaced once the whole header has been written, so a bad
+// input line leaves it as it was.
+//
+// With a constant mask, the compiler could fold zp7_ppp_64() and the stage
+// loops into constants if everything got inlined, but in practice it mostly
+// doesn't, and it never knows which stages are no-ops. The generator does
+// this ahead of time, and picks the cheapest of three forms for each mask
+// and direction:
+//
+// * Stages: the same shift stages as zp7_pext_pre_64()/zp7_pdep_pre_64(),
+//   with the PPP masks as constants. Only the bits that can actually be set
+//   at each stage are kept in its constants, so stages that don't move any
+//   bits are dropped entirely, and so is the initial masking of the input.
+// * Runs: each run of contiguous mask bits is moved as a unit, with one
+//   shift and one AND, and the runs are ORed together. This wins for masks
+//   with few runs, like bit fields.
+// * Multiply: if a multiplication by a magic constant moves every mask bit
+//   into place without any of the partial products colliding (and so
+//   carrying into the result), the whole thing is an AND, a multiply, and a
+//   shift or another AND.
+//
+// The cost of each form is estimated by counting operations, with a
+// multiply counted as three. The choice is recorded in a comment above
+// each function.
+//
+// Functions that use the stages are followed by a macro that lists them, so
+// SIMD code can run the same stages with the same constants:
+//
+//     #define PREFIX_PDEP_NAME_STAGES(STAGE) STAGE(KEEP, MOVE, SHIFT) ...
+//
+// where each stage is A = (A & KEEP) | ((A & MOVE) >> SHIFT) for PEXT, and
+// (A & KEEP) + ((A & MOVE) << SHIFT) for PDEP. KEEP can be zero.
+//
+// This is meant to be run from the build, e.g. with a Makefile rule:
+//
+//     masks.h: masks.txt zp7-gen
+//             ./zp7-gen -o $@ masks.txt
+//
+// Build it with any C compiler; it doesn't need any HAS_* defines:
+//
+//     cc -O2 zp7_gen.c -o zp7-gen
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NAME        (128)
+
+// Cost of a multiply, relative to the simple ALU operations
+#define MUL_COST        (3)
+
+typedef enum { FORM_STAGES, FORM_RUNS, FORM_MULTIPLY } form_t;
+
+static const char *form_names[] = { "stages", "runs", "multiply" };
+
+// The layout of a mask: the position of each set bit, in increasing order,
+// so bit I of a PEXT result comes from bit POS[I] of the input, and the runs
+// of contiguous set bits
+typedef struct {
+    uint64_t mask;
+    int n;
+    int pos[64];
+    int n_runs;
+    int run_start[64];
+    int run_len[64];
+} layout_t;
+
+// One stage: A = (A & KEEP) | ((A & MOVE) >> SHIFT), or << for PDEP
+typedef struct {
+    int shift;
+    uint64_t keep;
+    uint64_t move;
+} stage_t;
+
+typedef struct {
+    form_t form;
+    int cost;
+    // Stages
+    int n_stages;
+    stage_t stages[6];
+    // Multiply: PEXT is ((A & MASK) * MUL) >> SHIFT & LOW, PDEP is
+    // ((A & LOW) * MUL) & MASK
+    uint64_t mul;
+    int shift;
+} plan_t;
+
+static uint64_t low_bits(int n) {
+    return n >= 64 ? ~0ULL : (1ULL << n) - 1;
+}
+
+static void get_layout(layout_t *l, uint64_t mask) {
+    memset(l, 0, sizeof(*l));
+    l->mask = mask;
+    for (int p = 0; p < 64; p++) {
+        if (!(mask >> p & 1))
+            continue;
+        if (p == 0 || !(mask >> (p - 1) & 1)) {
+            l->run_start[l->n_runs] = p;
+            l->run_len[l->n_runs++] = 0;
+        }
+        l->run_len[l->n_runs - 1]++;
+        l->pos[l->n++] = p;
+    }
+}
+
+// Stages
+
+// Bit I of the result moves POS[I] - I places. In PEXT order, stage S moves
+// the bits whose distance has bit S set, by 1 << S, so before it each bit
+// has moved by the lower bits of its distance. PDEP is the same in reverse.
+// The stages are the same as in zp7.c, but with each constant limited to the
+// bits that are actually in use at that point.
+static void plan_stages(plan_t *plan, const layout_t *l, int pdep) {
+    memset(plan, 0, sizeof(*plan));
+    plan->form = FORM_STAGES;
+    for (int k = 0; k < 6; k++) {
+        int s = pdep ? 5 - k : k;
+        uint64_t move = 0, keep = 0;
+        for (int i = 0; i < l->n; i++) {
+            int dist = l->pos[i] - i;
+            // Distance already moved by the earlier stages
+            int done = pdep ? dist & ~((2 << s) - 1) : dist & ((1 << s) - 1);
+            int at = pdep ? i + done : l->pos[i] - done;
+            if (dist >> s & 1)
+                move |= 1ULL << at;
+            else
+                keep |= 1ULL << at;
+        }
+        if (move == 0)
+            continue;
+        stage_t *st = &plan->stages[plan->n_stages++];
+        st->shift = 1 << s;
+        st->move = move;
+        st->keep = keep;
+        plan->cost += keep ? 4 : 2;
+    }
+    // Without any stages, it's just the initial AND
+    if (plan->n_stages == 0)
+        plan->cost = 1;
+}
+
+// Runs: a shift (unless the run doesn't move) and an AND for each run, and
+// ORs to combine them
+static void plan_runs(plan_t *plan, const layout_t *l) {
+    memset(plan, 0, sizeof(*plan));
+    plan->form = FORM_RUNS;
+    for (int r = 0, i = 0; r < l->n_runs; i += l->run_len[r++])
+        plan->cost += 1 + (l->run_start[r] != i) + (r > 0);
+}
+
+// Multiply: look for a multiplier with one bit for each distinct distance,
+// such that the partial products never overlap below the top of the result.
+// Then there are no carries, and every bit ends up in place. Returns 0 if
+// there's no such multiplier.
+static int plan_multiply(plan_t *plan, const layout_t *l, int pdep) {
+    memset(plan, 0, sizeof(*plan));
+    plan->form = FORM_MULTIPLY;
+    if (l->n == 0)
+        return 0;
+    // PEXT puts the result at bits SHIFT and up, and shifts it down at the
+    // end. SHIFT has to be large enough that every distance is non-negative.
+    // The largest SHIFT is tried first, since with the result at the top,
+    // the final AND isn't needed.
+    int min_shift = 0;
+    for (int i = 0; i < l->n; i++) {
+        if (l->pos[i] - i > min_shift)
+            min_shift = l->pos[i] - i;
+    }
+    int max_shift = pdep ? 0 : 64 - l->n;
+    for (int shift = max_shift; shift >= (pdep ? 0 : min_shift); shift--) {
+        uint64_t mul = 0;
+        for (int i = 0; i < l->n; i++) {
+            int d = pdep ? l->pos[i] - i : shift + i - l->pos[i];
+            mul |= 1ULL << d;
+        }
+        // Everything below TOP needs to be free of collisions
+        int top = pdep ? l->pos[l->n - 1] + 1 : shift + l->n;
+        uint64_t seen = 0;
+        int ok = 1;
+        for (int i = 0; i < l->n && ok; i++) {
+            int p = pdep ? i : l->pos[i];
+            for (int d = 0; d < 64 && ok; d++) {
+                if (!(mul >> d & 1) || p + d >= top)
+                    continue;
+                ok = !(seen >> (p + d) & 1);
+                seen |= 1ULL << (p + d);
+            }
+        }
+        if (!ok)
+            continue;
+        plan->mul = mul;
+        plan->shift = shift;
+        if (pdep)
+            plan->cost = (l->n < 64) + MUL_COST + 1;
+        else
+            plan->cost = 1 + MUL_COST + (shift > 0) + (shift + l->n < 64);
+        return 1;
+    }
+    return 0;
+}
+
+static void plan_best(plan_t *best, const layout_t *l, int pdep) {
+    plan_t plan;
+    plan_runs(best, l);
+    plan_stages(&plan, l, pdep);
+    if (plan.cost < best->cost)
+        *best = plan;
+    if (plan_multiply(&plan, l, pdep) && plan.cost < best->cost)
+        *best = plan;
+}
+
+// Code output
+
+// Print NAME in upper case
+static void emit_upper(FILE *f, const char *name) {
+    for (; *name; name++)
+        fputc(toupper((unsigned char)*name), f);
+}
+
+static void emit_stages_macro(FILE *f, const char *prefix, const char *name,
+        const plan_t *plan, int pdep) {
+    fprintf(f, "#define ");
+    emit_upper(f, prefix);
+    fprintf(f, "_%s_", pdep ? "PDEP" : "PEXT");
+    emit_upper(f, name);
+    fprintf(f, "_STAGES(STAGE) \\\n");
+    for (int k = 0; k < plan->n_stages; k++) {
+        const stage_t *st = &plan->stages[k];
+        fprintf(f, "    STAGE(0x%016llxULL, 0x%016llxULL, %d)%s\n",
+                (unsigned long long)st->keep, (unsigned long long)st->move,
+                st->shift, k < plan->n_stages - 1 ? " \\" : "");
+    }
+    fprintf(f, "\n");
+}
+
+static void emit_function(FILE *f, const char *prefix, const char *name,
+        const layout_t *l, int pdep) {
+    plan_t plan;
+    plan_best(&plan, l, pdep);
+    const char *op = pdep ? "<<" : ">>";
+    fprintf(f, "// %s with 0x%016llx: %s, %d ops\n", pdep ? "PDEP" : "PEXT",
+            (unsigned long long)l->mask, form_names[plan.form], plan.cost);
+    fprintf(f, "static inline uint64_t %s_%s_%s(uint64_t a) {\n", prefix,
+            pdep ? "pdep" : "pext", name);
+
+    if (l->n == 0) {
+        fprintf(f, "    (void)a;\n    return 0;\n}\n\n");
+        return;
+    }
+    switch (plan.form) {
+        case FORM_STAGES:
+            if (plan.n_stages == 0) {
+                fprintf(f, "    return a & 0x%016llxULL;\n}\n\n",
+                        (unsigned long long)(pdep ? low_bits(l->n) : l->mask));
+                return;
+            }
+            for (int k = 0; k < plan.n_stages; k++) {
+                const stage_t *st = &plan.stages[k];
+                // The moved and kept bits are disjoint, so PDEP adds them
+                // like zp7_pdep_pre_64() does, which can become an LEA
+                if (st->keep) {
+                    fprintf(f, "    a = (a & 0x%016llxULL) %s "
+                            "((a & 0x%016llxULL) %s %d);\n",
+                            (unsigned long long)st->keep, pdep ? "+" : "|",
+                            (unsigned long long)st->move, op, st->shift);
+                } else {
+                    fprintf(f, "    a = (a & 0x%016llxULL) %s %d;\n",
+                            (unsigned long long)st->move, op, st->shift);
+                }
+            }
+            fprintf(f, "    return a;\n}\n\n");
+            emit_stages_macro(f, prefix, name, &plan, pdep);
+            return;
+        case FORM_RUNS:
+            fprintf(f, "    return");
+            for (int r = 0, i = 0; r < l->n_runs; i += l->run_len[r++]) {
+                int from = pdep ? i : l->run_start[r];
+                int to = pdep ? l->run_start[r] : i;
+                uint64_t bits = low_bits(l->run_len[r]) << to;
+                if (l->n_runs > 1)
+                    fprintf(f, "%s\n        ", r > 0 ? " |" : "");
+                else
+                    fprintf(f, " ");
+                if (from == to)
+                    fprintf(f, "(a & 0x%016llxULL)", (unsigned long long)bits);
+                else {
+                    fprintf(f, "((a %s %d) & 0x%016llxULL)", op,
+                            pdep ? to - from : from - to,
+                            (unsigned long long)bits);
+                }
+            }
+            fprintf(f, ";\n");
+            break;
+        case FORM_MULTIPLY:
+            if (pdep) {
+                fprintf(f, "    return ((a & 0x%016llxULL) * "
+                        "0x%016llxULL) & 0x%016llxULL;\n",
+                        (unsigned long long)low_bits(l->n),
+                        (unsigned long long)plan.mul,
+                        (unsigned long long)l->mask);
+            } else {
+                fprintf(f, "    return ((a & 0x%016llxULL) * "
+                        "0x%016llxULL) >> %d", (unsigned long long)l->mask,
+                        (unsigned long long)plan.mul, plan.shift);
+                if (plan.shift + l->n < 64) {
+                    fprintf(f, " & 0x%016llxULL",
+                            (unsigned long long)low_bits(l->n));
+                }
+                fprintf(f, ";\n");
+            }
+            break;
+    }
+    fprintf(f, "}\n\n");
+}
+
+// Input parsing
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-p PREFIX] [-o OUTPUT] [INPUT]\n", name);
+    exit(2);
+}
+
+static int is_identifier(const char *s) {
+    if (!isalpha((unsigned char)*s) && *s != '_')
+        return 0;
+    for (; *s; s++) {
+        if (!isalnum((unsigned char)*s) && *s != '_')
+            return 0;
+    }
+    return 1;
+}
+
+// Generate the header for the masks in IN, returning 0 on success
+static int generate(FILE *out, FILE *in, const char *in_path,
+        const char *prefix) {
+    // The include guard comes from the prefix, like ZP7_MASKS_H
+    char guard[MAX_NAME + 16];
+    snprintf(guard, sizeof(guard), "%s_MASKS_H", prefix);
+    for (char *c = guard; *c; c++)
+        *c = (char)toupper((unsigned char)*c);
+    fprintf(out, "// Generated by zp7-gen from %s. Do not edit.\n\n",
+            in_path);
+    fprintf(out, "#ifndef %s\n#define %s\n\n#include <stdint.h>\n\n", guard,
+            guard);
+
+    char line[1024];
+    for (int line_no = 1; fgets(line, sizeof(line), in); line_no++) {
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        char name[MAX_NAME + 1], value[MAX_NAME + 1], extra;
+        int fields = sscanf(line, "%128s %128s %c", name, value, &extra);
+        if (fields <= 0)
+            continue;
+        char *end;
+        errno = 0;
+        uint64_t mask = strtoull(value, &end, 0);
+        if (fields != 2 || !is_identifier(name) || *end != '\0' || errno ||
+                value[0] == '-') {
+            fprintf(stderr, "%s:%d: expected NAME MASK\n", in_path, line_no);
+            return 1;
+        }
+        layout_t l;
+        get_layout(&l, mask);
+        emit_function(out, prefix, name, &l, 0);
+        emit_function(out, prefix, name, &l, 1);
+    }
+    if (ferror(in)) {
+        perror(in_path);
+        return 1;
+    }
+    fprintf(out, "#endif\n");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *prefix = "zp7";
+    const char *out_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:o:")) != -1) {
+        switch (opt) {
+            case 'p':
+                prefix = optarg;
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind < argc - 1 || !is_identifier(prefix))
+        usage(argv[0]);
+
+    const char *in_path = "-";
+    FILE *in = stdin;
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+        in_path = argv[optind];
+        in = fopen(in_path, "r");
+        if (!in) {
+            perror(in_path);
+            return 1;
+        }
+    }
+
+    // OUTPUT is written under a temporary name and renamed when it's
+    // complete, so an error never leaves a truncated header behind for the
+    // build to pick up
+    FILE *out = stdout;
+    char *tmp_path = NULL;
+    if (out_path) {
+        size_t size = strlen(out_path) + sizeof(".tmp");
+        tmp_path = malloc(size);
+        if (!tmp_path) {
+            perror("malloc");
+            return 1;
+        }
+        snprintf(tmp_path, size, "%s.tmp", out_path);
+        out = fopen(tmp_path, "w");
+        if (!out) {
+            perror(tmp_path);
+            return 1;
+        }
+    }
+
+    int r = generate(out, in, in_path, prefix);
+    if (fclose(out) != 0 && r == 0) {
+        perror(out_path ? tmp_path : "stdout");
+        r = 1;
+    }
+    if (out_path) {
+        if (r == 0 && rename(tmp_path, out_path) != 0) {
+            perror(out_path);
+            r = 1;
+        }
+        if (r != 0)
+            remove(tmp_path);
+        free(tmp_path);
+    }
+    return r;
+}
@@ -0,0 +1,459 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef ZP7_PARALLEL_C
+#define ZP7_PARALLEL_C
+
+// Pinning threads needs pthread_setaffinity_np(), which glibc only declares
+// with _GNU_SOURCE. That has to be defined before any system header is
+// included, so if this file isn't the first include, define it on the
+// command line (or at the top of the including file).
+#ifdef __linux__
+#   ifndef _GNU_SOURCE
+#       define _GNU_SOURCE
+#   endif
+#endif
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "zp7.c"
+
+// Multithreaded bulk PEXT/PDEP
+//
+// The bulk functions in zp7.c have no dependencies between words, so huge
+// arrays can simply be split between threads. This file has a small thread
+// pool for that, and parallel versions of the bulk functions on top of it.
+// Each thread calls the regular bulk functions on its pieces of the array, so
+// it uses whichever kernel those pick (SVE2, GFNI, etc.).
+//
+// The array is split into chunks, and each thread gets a contiguous "home"
+// range of chunks, which it works through from the front. Once a thread runs
+// out of its own chunks, it steals chunks from the other threads' ranges,
+// starting with its neighbors. Both the owner and the thieves take chunks
+// with an atomic increment of the same counter, so there's no locking, and
+// the chunks are big enough that the increments are rare.
+//
+// The home ranges matter on NUMA systems. Pages are placed on the node of
+// the thread that first touches them, so if an array is initialized with the
+// same static split (thread I of N writing the Ith contiguous part), each
+// thread's home range is in its local memory, and only stolen chunks cross
+// nodes. zp7_pool_run() can be used to do that initialization with the same
+// split. Chunks are a multiple of the page size, so with a page-aligned array,
+// no page is shared between threads. With ZP7_POOL_PIN, the threads are also
+// pinned to one CPU each (on Linux), so they stay on the same node as their
+// memory.
+//
+// The calling thread does its share of the work as thread 0, so a pool of N
+// threads only starts N-1 of its own.
+
+// Flags for zp7_pool_create()
+#define ZP7_POOL_PIN            (1 << 0)
+
+// Words per chunk. This is a multiple of the page size, and big enough that
+// per-chunk overhead (like the GFNI mask precomputation) doesn't matter.
+#ifndef ZP7_POOL_CHUNK
+#   define ZP7_POOL_CHUNK       (1 << 16)
+#endif
+
+// Arrays shorter than this aren't worth waking up the threads for
+#ifndef ZP7_POOL_MIN_ARRAY
+#   define ZP7_POOL_MIN_ARRAY   (1 << 18)
+#endif
+
+#define ZP7_POOL_MAX_THREADS    (1024)
+
+// A thread's home range of chunks, padded to a cache line so the counters
+// of different threads don't share one
+typedef struct {
+    atomic_size_t next;
+    size_t end;
+    char pad[64 - sizeof(atomic_size_t) - sizeof(size_t)];
+} zp7_pool_range_t;
+
+// The work for one call: FN(ARG, BEGIN, END) for each chunk of N items
+typedef void (*zp7_pool_fn_t)(void *arg, size_t begin, size_t end);
+
+typedef struct zp7_pool zp7_pool_t;
+
+typedef struct {
+    zp7_pool_t *pool;
+    int index;
+} zp7_pool_worker_t;
+
+struct zp7_pool {
+    int n_threads;
+    int flags;
+    pthread_t *threads;
+    zp7_pool_worker_t *workers;
+    zp7_pool_range_t *ranges;
+
+    // The current job, protected by lock
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;
+    int n_running;
+    int shutdown;
+    zp7_pool_fn_t fn;
+    void *arg;
+    size_t n;
+    size_t chunk;
+};
+
+static void zp7_pool_pin(int index) {
+#if defined(__linux__) && defined(CPU_SETSIZE)
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % CPU_SETSIZE, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+    (void)index;
+#endif
+}
+
+// Take chunks from RANGE until there are none left
+static void zp7_pool_drain(zp7_pool_t *pool, zp7_pool_range_t *range) {
+    for (;;) {
+        size_t c = atomic_fetch_add_explicit(&range->next, 1,
+                memory_order_relaxed);
+        if (c >= range->end)
+            break;
+        size_t begin = c * pool->chunk;
+        size_t end = begin + pool->chunk;
+        if (end > pool->n)
+            end = pool->n;
+        pool->fn(pool->arg, begin, end);
+    }
+}
+
+// Do thread INDEX's share of the current job: its own range first, then
+// steal from the others, nearest first
+static void zp7_pool_work(zp7_pool_t *pool, int index) {
+    zp7_pool_drain(pool, &pool->ranges[index]);
+    for (int d = 1; d < pool->n_threads; d++) {
+        int v = (d & 1) ? index + (d + 1) / 2 : index - d / 2;
+        v = (v + pool->n_threads) % pool->n_threads;
+        zp7_pool_drain(pool, &pool->ranges[v]);
+    }
+}
+
+static void *zp7_pool_thread(void *p) {
+    zp7_pool_worker_t *worker = (zp7_pool_worker_t *)p;
+    zp7_pool_t *pool = worker->pool;
+    if (pool->flags & ZP7_POOL_PIN)
+        zp7_pool_pin(worker->index);
+
+    uint64_t generation = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == generation && !pool->shutdown)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->shutdown)
+            break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        zp7_pool_work(pool, worker->index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->n_running == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void zp7_pool_destroy(zp7_pool_t *pool);
+
+// Create a pool of N_THREADS threads (including the caller), or one per
+// online CPU if N_THREADS is 0. FLAGS is a combination of ZP7_POOL_*.
+// Returns NULL on failure.
+zp7_pool_t *zp7_pool_create(int n_threads, int flags) {
+    if (n_threads <= 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_cpus > 0 ? (int)n_cpus : 1;
+    }
+    if (n_threads > ZP7_POOL_MAX_THREADS)
+        n_threads = ZP7_POOL_MAX_THREADS;
+
+    zp7_pool_t *pool = (zp7_pool_t *)calloc(1, sizeof(zp7_pool_t));
+    if (!pool)
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    // n_threads counts the threads that have started, so a partially
+    // created pool can be destroyed
+    pool->n_threads = 1;
+    pool->flags = flags;
+    pool->threads = (pthread_t *)calloc(n_threads, sizeof(pthread_t));
+    pool->workers = (zp7_pool_worker_t *)calloc(n_threads,
+            sizeof(zp7_pool_worker_t));
+    pool->ranges = (zp7_pool_range_t *)aligned_alloc(64,
+            n_threads * sizeof(zp7_pool_range_t));
+    if (!pool->threads || !pool->workers || !pool->ranges) {
+        zp7_pool_destroy(pool);
+        return NULL;
+    }
+    for (int i = 0; i < n_threads; i++) {
+        atomic_init(&pool->ranges[i].next, 0);
+        pool->ranges[i].end = 0;
+    }
+
+    if (flags & ZP7_POOL_PIN)
+        zp7_pool_pin(0);
+    for (int i = 1; i < n_threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->threads[i], NULL, zp7_pool_thread,
+                    &pool->workers[i]) != 0) {
+            zp7_pool_destroy(pool);
+            return NULL;
+        }
+        pool->n_threads++;
+    }
+    return pool;
+}
+
+void zp7_pool_destroy(zp7_pool_t *pool) {
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->n_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->ranges);
+    free(pool);
+}
+
+int zp7_pool_n_threads(const zp7_pool_t *pool) {
+    return pool ? pool->n_threads : 1;
+}
+
+// Call FN(ARG, BEGIN, END) on chunks of CHUNK items covering [0, N), spread
+// across the pool, and wait for all of them to finish. Each thread's home
+// range is the same static split described above. Only one job can run on
+// a pool at a time.
+void zp7_pool_run(zp7_pool_t *pool, size_t n, size_t chunk, zp7_pool_fn_t fn,
+        void *arg) {
+    if (n == 0)
+        return;
+    if (!pool || pool->n_threads == 1 || n <= chunk) {
+        for (size_t begin = 0; begin < n; begin += chunk)
+            fn(arg, begin, n - begin < chunk ? n : begin + chunk);
+        return;
+    }
+
+    size_t n_chunks = (n + chunk - 1) / chunk;
+    int n_threads = pool->n_threads;
+    for (int i = 0; i < n_threads; i++) {
+        atomic_store_explicit(&pool->ranges[i].next,
+                n_chunks * i / n_threads, memory_order_relaxed);
+        pool->ranges[i].end = n_chunks * (i + 1) / n_threads;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->n = n;
+    pool->chunk = chunk;
+    pool->n_running = n_threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    zp7_pool_work(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->n_running > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Parallel bulk PEXT/PDEP. These are the same as the bulk functions in
+// zp7.c, with a pool as the first argument. A NULL pool runs on the calling
+// thread only.
+
+typedef struct {
+    uint64_t *dst;
+    const uint64_t *src;
+    const uint64_t *mask;
+    const zp7_masks_64_t *masks;
+} zp7_parallel_args_t;
+
+static void zp7_parallel_pext_pre(void *p, size_t begin, size_t end) {
+    zp7_parallel_args_t *args = (zp7_parallel_args_t *)p;
+    zp7_pext_pre_array_64(args->dst + begin, args->src + begin, end - begin,
+            args->masks);
+}
+
+static void zp7_parallel_pdep_pre(void *p, size_t begin, size_t end) {
+    zp7_parallel_args_t *args = (zp7_parallel_args_t *)p;
+    zp7_pdep_pre_array_64(args->dst + begin, args->src + begin, end - begin,
+            args->masks);
+}
+
+static void zp7_parallel_pext(void *p, size_t begin, size_t end) {
+    zp7_parallel_args_t *args = (zp7_parallel_args_t *)p;
+    zp7_pext_array_64(args->dst + begin, args->src + begin,
+            args->mask + begin, end - begin);
+}
+
+static void zp7_parallel_pdep(void *p, size_t begin, size_t end) {
+    zp7_parallel_args_t *args = (zp7_parallel_args_t *)p;
+    zp7_pdep_array_64(args->dst + begin, args->src + begin,
+            args->mask + begin, end - begin);
+}
+
+static void zp7_parallel_run(zp7_pool_t *pool, size_t n, zp7_pool_fn_t fn,
+        zp7_parallel_args_t *args) {
+    if (n < ZP7_POOL_MIN_ARRAY)
+        fn(args, 0, n);
+    else
+        zp7_pool_run(pool, n, ZP7_POOL_CHUNK, fn, args);
+}
+
+void zp7_pext_pre_array_parallel_64(zp7_pool_t *pool, uint64_t *dst,
+        const uint64_t *src, size_t n, const zp7_masks_64_t *masks) {
+    zp7_parallel_args_t args = { dst, src, NULL, masks };
+    zp7_parallel_run(pool, n, zp7_parallel_pext_pre, &args);
+}
+
+void zp7_pdep_pre_array_parallel_64(zp7_pool_t *pool, uint64_t *dst,
+        const uint64_t *src, size_t n, const zp7_masks_64_t *masks) {
+    zp7_parallel_args_t args = { dst, src, NULL, masks };
+    zp7_parallel_run(pool, n, zp7_parallel_pdep_pre, &args);
+}
+
+void zp7_pext_array_parallel_64(zp7_pool_t *pool, uint64_t *dst,
+        const uint64_t *src, const uint64_t *mask, size_t n) {
+    zp7_parallel_args_t args = { dst, src, mask, NULL };
+    zp7_parallel_run(pool, n, zp7_parallel_pext, &args);
+}
+
+void zp7_pdep_array_parallel_64(zp7_pool_t *pool, uint64_t *dst,
+        const uint64_t *src, const uint64_t *mask, size_t n) {
+    zp7_parallel_args_t args = { dst, src, mask, NULL };
+    zp7_parallel_run(pool, n, zp7_parallel_pdep, &args);
+}
+
+// Parallel bitstream compaction
+//
+// Unlike the bulk functions, zp7_compact_64() can't just be split up, since
+// where each part of the output goes depends on the popcount of all the
+// masks before it. So this takes two passes over the chunks: first the
+// threads count the set mask bits in each chunk, then a (serial, since
+// there are few chunks) prefix sum of those counts gives the output bit
+// offset of each chunk, and then the threads compact the chunks in parallel.
+//
+// The output of neighboring chunks can share a word, so each chunk only
+// writes the words it fills completely, and returns the partial words at
+// either end. Those are merged serially at the end, ORing together all the
+// pieces of each shared word. Chunks with few set mask bits can put several
+// pieces in the same word, so the shared words are cleared first.
+
+typedef struct {
+    uint64_t *dst;
+    const uint64_t *src;
+    const uint64_t *mask;
+    size_t chunk;
+    size_t *offset;
+    zp7_compact_edge_t *edge;
+} zp7_compact_args_t;
+
+static void zp7_compact_count(void *p, size_t begin, size_t end) {
+    zp7_compact_args_t *args = (zp7_compact_args_t *)p;
+    size_t count = 0;
+    for (size_t i = begin; i < end; i++)
+        count += popcnt(args->mask[i]);
+    args->offset[begin / args->chunk] = count;
+}
+
+static void zp7_compact_chunk(void *p, size_t begin, size_t end) {
+    zp7_compact_args_t *args = (zp7_compact_args_t *)p;
+    size_t c = begin / args->chunk;
+    zp7_compact_range_64(args->dst, args->offset[c], args->src + begin,
+            args->mask + begin, end - begin, &args->edge[c]);
+}
+
+static size_t zp7_compact_parallel(zp7_pool_t *pool, uint64_t *dst,
+        const uint64_t *src, const uint64_t *mask, size_t n, size_t chunk) {
+    size_t n_chunks = (n + chunk - 1) / chunk;
+    size_t *offset = (size_t *)malloc(n_chunks * sizeof(size_t));
+    zp7_compact_edge_t *edge = (zp7_compact_edge_t *)malloc(n_chunks *
+            sizeof(zp7_compact_edge_t));
+    if (!offset || !edge) {
+        free(offset);
+        free(edge);
+        return zp7_compact_64(dst, src, mask, n);
+    }
+
+    zp7_compact_args_t args = { dst, src, mask, chunk, offset, edge };
+    zp7_pool_run(pool, n, chunk, zp7_compact_count, &args);
+
+    // Exclusive prefix sum of the counts
+    size_t total = 0;
+    for (size_t c = 0; c < n_chunks; c++) {
+        size_t count = offset[c];
+        offset[c] = total;
+        total += count;
+    }
+
+    zp7_pool_run(pool, n, chunk, zp7_compact_chunk, &args);
+
+    for (size_t c = 0; c < n_chunks; c++)
+        for (int e = 0; e < 2; e++)
+            if (edge[c].index[e] != ZP7_COMPACT_NO_EDGE)
+                dst[edge[c].index[e]] = 0;
+    for (size_t c = 0; c < n_chunks; c++)
+        for (int e = 0; e < 2; e++)
+            if (edge[c].index[e] != ZP7_COMPACT_NO_EDGE)
+                dst[edge[c].index[e]] |= edge[c].value[e];
+
+    free(offset);
+    free(edge);
+    return total;
+}
+
+// Same as zp7_compact_64(), with the work spread across POOL
+size_t zp7_compact_parallel_64(zp7_pool_t *pool, uint64_t *dst,
+        const uint64_t *src, const uint64_t *mask, size_t n) {
+    if (!pool || pool->n_threads == 1 || n < ZP7_POOL_MIN_ARRAY)
+        return zp7_compact_64(dst, src, mask, n);
+    return zp7_compact_parallel(pool, dst, src, mask, n, ZP7_POOL_CHUNK);
+}
+
+#endif
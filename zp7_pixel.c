@@ -0,0 +1,217 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef ZP7_PIXEL_C
+#define ZP7_PIXEL_C
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Pixel format conversion
+//
+// Packed pixel formats are PDEP/PEXT problems: unpacking RGB565 to 8 bits
+// per channel deposits the 5/6/5 channel bits into the top of three bytes,
+// and packing takes the top bits of each byte back out. Every pixel uses the
+// same mask, and the masks are known ahead of time, so the PDEP/PEXT code
+// for each one is generated by zp7-gen (see zp7_gen.c), from the list in
+// the comment below. For all of these masks, it picks moving each channel
+// as a run over the shift stages, since there are only a few channels:
+// that's 8-11 operations per pixel, against 16-20 for the trimmed stages.
+// Going through the bulk array functions with runtime masks instead was
+// several times slower, even with the GFNI kernels. The conversion loops
+// are simple enough for compilers to vectorize.
+//
+// The formats, as native-endian integers:
+//
+//     RGB565      uint16_t, R in bits 11-15, G in 5-10, B in 0-4
+//     RGB555      uint16_t, R in bits 10-14, G in 5-9, B in 0-4, and bit 15
+//                 ignored (written as zero)
+//     ARGB8888    uint32_t, 0xAARRGGBB
+//     RGB10A2     uint32_t, R in bits 0-9, G in 10-19, B in 20-29, A in
+//                 30-31 (like DXGI_FORMAT_R10G10B10A2_UNORM)
+//     RGBA16      uint64_t, R in bits 0-15, G in 16-31, B in 32-47, A in
+//                 48-63
+//     v210        uint32_t, three 10-bit components in bits 0-9, 10-19 and
+//                 20-29 of each word, six pixels of 4:2:2 (in the order
+//                 Cb Y Cr Y Cb Y Cr Y Cb Y Cr Y) in every four words
+//     UYVY16      uint16_t, the same components in the same order, one per
+//                 element
+//
+// The v210 functions work on N words (so 3*N components), and don't care
+// where the lines start and end; v210 lines are padded to a multiple of 128
+// bytes, and that padding is converted like everything else.
+//
+// Widening conversions scale each channel to the full range by repeating
+// its top bits below it (so 5-bit 31 becomes 8-bit 255), and set the alpha
+// to the maximum for formats without one. Narrowing conversions truncate.
+
+// Generated code
+//
+// Output of zp7-gen -p pixel for these masks, each for one pixel in the
+// wide format:
+//
+//     rgb565  0x00F8FCF8
+//     rgb555  0x00F8F8F8
+//     rgb10a2 0xC000FFC0FFC0FFC0
+//     v210    0x0000FFC0FFC0FFC0
+
+// PEXT with 0x0000000000f8fcf8: runs, 8 ops
+static inline uint64_t pixel_pext_rgb565(uint64_t a) {
+    return
+        ((a >> 3) & 0x000000000000001fULL) |
+        ((a >> 5) & 0x00000000000007e0ULL) |
+        ((a >> 8) & 0x000000000000f800ULL);
+}
+
+// PDEP with 0x0000000000f8fcf8: runs, 8 ops
+static inline uint64_t pixel_pdep_rgb565(uint64_t a) {
+    return
+        ((a << 3) & 0x00000000000000f8ULL) |
+        ((a << 5) & 0x000000000000fc00ULL) |
+        ((a << 8) & 0x0000000000f80000ULL);
+}
+
+// PEXT with 0x0000000000f8f8f8: runs, 8 ops
+static inline uint64_t pixel_pext_rgb555(uint64_t a) {
+    return
+        ((a >> 3) & 0x000000000000001fULL) |
+        ((a >> 6) & 0x00000000000003e0ULL) |
+        ((a >> 9) & 0x0000000000007c00ULL);
+}
+
+// PDEP with 0x0000000000f8f8f8: runs, 8 ops
+static inline uint64_t pixel_pdep_rgb555(uint64_t a) {
+    return
+        ((a << 3) & 0x00000000000000f8ULL) |
+        ((a << 6) & 0x000000000000f800ULL) |
+        ((a << 9) & 0x0000000000f80000ULL);
+}
+
+// PEXT with 0xc000ffc0ffc0ffc0: runs, 11 ops
+static inline uint64_t pixel_pext_rgb10a2(uint64_t a) {
+    return
+        ((a >> 6) & 0x00000000000003ffULL) |
+        ((a >> 12) & 0x00000000000ffc00ULL) |
+        ((a >> 18) & 0x000000003ff00000ULL) |
+        ((a >> 32) & 0x00000000c0000000ULL);
+}
+
+// PDEP with 0xc000ffc0ffc0ffc0: runs, 11 ops
+static inline uint64_t pixel_pdep_rgb10a2(uint64_t a) {
+    return
+        ((a << 6) & 0x000000000000ffc0ULL) |
+        ((a << 12) & 0x00000000ffc00000ULL) |
+        ((a << 18) & 0x0000ffc000000000ULL) |
+        ((a << 32) & 0xc000000000000000ULL);
+}
+
+// PEXT with 0x0000ffc0ffc0ffc0: runs, 8 ops
+static inline uint64_t pixel_pext_v210(uint64_t a) {
+    return
+        ((a >> 6) & 0x00000000000003ffULL) |
+        ((a >> 12) & 0x00000000000ffc00ULL) |
+        ((a >> 18) & 0x000000003ff00000ULL);
+}
+
+// PDEP with 0x0000ffc0ffc0ffc0: runs, 8 ops
+static inline uint64_t pixel_pdep_v210(uint64_t a) {
+    return
+        ((a << 6) & 0x000000000000ffc0ULL) |
+        ((a << 12) & 0x00000000ffc00000ULL) |
+        ((a << 18) & 0x0000ffc000000000ULL);
+}
+
+// Fill the bits below each widened channel with copies of its top bits. The
+// channels are deposited at the top of their fields, so shifting down by the
+// channel width gives the next bits, and the masks keep them inside the
+// field. Five-bit channels in a byte need one copy and a partial one, six
+// bits need one partial copy, and ten bits in 16 need one partial copy.
+static inline uint32_t pixel_widen_565(uint32_t x) {
+    return x | (x >> 5 & 0x070007) | (x >> 6 & 0x000300) | 0xFF000000U;
+}
+
+static inline uint32_t pixel_widen_555(uint32_t x) {
+    return x | (x >> 5 & 0x070707) | 0xFF000000U;
+}
+
+static inline uint64_t pixel_widen_10(uint64_t x) {
+    return x | (x >> 10 & 0x0000003F003F003FULL);
+}
+
+// The two alpha bits are repeated eight times
+static inline uint64_t pixel_widen_10a2(uint64_t x) {
+    uint64_t a = x & 0xC000000000000000ULL;
+    a |= a >> 2;
+    a |= a >> 4;
+    a |= a >> 8;
+    return pixel_widen_10(x) | a;
+}
+
+void zp7_rgb565_to_argb8888(uint32_t *dst, const uint16_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = pixel_widen_565((uint32_t)pixel_pdep_rgb565(src[i]));
+}
+
+void zp7_argb8888_to_rgb565(uint16_t *dst, const uint32_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = (uint16_t)pixel_pext_rgb565(src[i]);
+}
+
+void zp7_rgb555_to_argb8888(uint32_t *dst, const uint16_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = pixel_widen_555((uint32_t)pixel_pdep_rgb555(src[i]));
+}
+
+void zp7_argb8888_to_rgb555(uint16_t *dst, const uint32_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = (uint16_t)pixel_pext_rgb555(src[i]);
+}
+
+void zp7_rgb10a2_to_rgba16(uint64_t *dst, const uint32_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = pixel_widen_10a2(pixel_pdep_rgb10a2(src[i]));
+}
+
+void zp7_rgba16_to_rgb10a2(uint32_t *dst, const uint64_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = (uint32_t)pixel_pext_rgb10a2(src[i]);
+}
+
+// v210 and UYVY16 have three components per word
+void zp7_v210_to_uyvy16(uint16_t *dst, const uint32_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint64_t x = pixel_widen_10(pixel_pdep_v210(src[i]));
+        dst[3 * i] = (uint16_t)x;
+        dst[3 * i + 1] = (uint16_t)(x >> 16);
+        dst[3 * i + 2] = (uint16_t)(x >> 32);
+    }
+}
+
+void zp7_uyvy16_to_v210(uint32_t *dst, const uint16_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        const uint16_t *in = src + 3 * i;
+        uint64_t x = in[0] | (uint64_t)in[1] << 16 | (uint64_t)in[2] << 32;
+        dst[i] = (uint32_t)pixel_pext_v210(x);
+    }
+}
+
+#endif
@@ -0,0 +1,583 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef ZP7_ROARING_C
+#define ZP7_ROARING_C
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zp7.c"
+
+// Compressed bitmaps
+//
+// This is a set of 32-bit integers in the style of Roaring bitmaps: the
+// values are split by their high 16 bits into containers, each holding the
+// low 16 bits of its values in whichever of three forms is smallest:
+//
+//   * array: a sorted array of up to ZP7_ROARING_ARRAY_MAX values
+//   * bitmap: ZP7_ROARING_WORDS 64-bit words, one bit per value
+//   * run: sorted (start, length - 1) pairs, for long stretches of values
+//
+// New containers start out as arrays, and become bitmaps once they fill up.
+// zp7_roaring_optimize() picks the smallest form for every container, and is
+// the only thing that creates run containers; adding to a run container
+// turns it back into a bitmap.
+//
+// ZP7 comes in for the bitmap containers: select finds the word holding the
+// K-th value, and then the position of the K'th set bit in that word is the
+// trailing zero count of PDEP(1 << K, word). Intersections of bitmaps go
+// through zp7_flatten_64(), which turns the ANDed words into values without
+// a branch per value. Run containers are intersected with each other
+// directly, and expanded to bitmaps to intersect with bitmaps.
+
+#define ZP7_ROARING_ARRAY           (1)
+#define ZP7_ROARING_BITMAP          (2)
+#define ZP7_ROARING_RUN             (3)
+
+// Words in a bitmap, one bit for each of the 2^16 low halves. An array of
+// 4096 16-bit values is the same size.
+#define ZP7_ROARING_WORDS           (1024)
+#define ZP7_ROARING_ARRAY_MAX       (4096)
+
+// Error codes. Functions that can fail return 0 on success, or one of these
+#define ZP7_ROARING_ERR_MEMORY      (-1)
+#define ZP7_ROARING_ERR_RANGE       (-2)
+
+typedef struct {
+    uint16_t key;
+    uint16_t type;
+    // Number of values, 1 to 65536
+    uint32_t card;
+    // For arrays, the values, and for runs, pairs of (start, length - 1),
+    // both with SIZE entries and room for CAPACITY. For bitmaps, the words.
+    void *data;
+    uint32_t size;
+    uint32_t capacity;
+} zp7_container_t;
+
+typedef struct {
+    // Containers, sorted by key
+    zp7_container_t *containers;
+    size_t n;
+    size_t capacity;
+} zp7_roaring_t;
+
+void zp7_roaring_init(zp7_roaring_t *r) {
+    memset(r, 0, sizeof(*r));
+}
+
+void zp7_roaring_free(zp7_roaring_t *r) {
+    for (size_t i = 0; i < r->n; i++)
+        free(r->containers[i].data);
+    free(r->containers);
+    zp7_roaring_init(r);
+}
+
+// Container helpers
+
+// Find the container with KEY. Returns whether it exists, and sets INDEX to
+// where it is or would be inserted.
+static int roaring_find(const zp7_roaring_t *r, uint16_t key, size_t *index) {
+    size_t lo = 0, hi = r->n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (r->containers[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *index = lo;
+    return lo < r->n && r->containers[lo].key == key;
+}
+
+// Number of values in the sorted array V of N values that are below X
+static uint32_t array_lower_bound(const uint16_t *v, uint32_t n, uint32_t x) {
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (v[mid] < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Set bits LO through HI (inclusive) of WORDS
+static void words_set_range(uint64_t *words, uint32_t lo, uint32_t hi) {
+    uint32_t first = lo >> 6, last = hi >> 6;
+    uint64_t lo_mask = -1ULL << (lo & 63);
+    uint64_t hi_mask = -1ULL >> (63 - (hi & 63));
+    if (first == last) {
+        words[first] |= lo_mask & hi_mask;
+        return;
+    }
+    words[first] |= lo_mask;
+    for (uint32_t i = first + 1; i < last; i++)
+        words[i] = -1ULL;
+    words[last] |= hi_mask;
+}
+
+// Get the values of any container as a bitmap, either pointing right at a
+// bitmap container's words or filling in TMP
+static const uint64_t *container_words(const zp7_container_t *c,
+        uint64_t *tmp) {
+    if (c->type == ZP7_ROARING_BITMAP)
+        return (const uint64_t *)c->data;
+    memset(tmp, 0, ZP7_ROARING_WORDS * sizeof(uint64_t));
+    const uint16_t *v = (const uint16_t *)c->data;
+    if (c->type == ZP7_ROARING_ARRAY) {
+        for (uint32_t i = 0; i < c->size; i++)
+            tmp[v[i] >> 6] |= 1ULL << (v[i] & 63);
+    } else {
+        for (uint32_t i = 0; i < c->size; i++)
+            words_set_range(tmp, v[2 * i], v[2 * i] + v[2 * i + 1]);
+    }
+    return tmp;
+}
+
+// Number of runs of set bits in WORDS: the bits that are set, but where the
+// bit below is clear
+static uint32_t words_count_runs(const uint64_t *words) {
+    uint32_t runs = 0;
+    uint64_t carry = 0;
+    for (int i = 0; i < ZP7_ROARING_WORDS; i++) {
+        uint64_t w = words[i];
+        runs += popcnt(w & ~(w << 1 | carry));
+        carry = w >> 63;
+    }
+    return runs;
+}
+
+// Replace the data of C with the values in WORDS, in form TYPE. WORDS can't
+// point to C's own data. On failure, C is unchanged.
+static int container_set_words(zp7_container_t *c, const uint64_t *words,
+        int type, uint32_t card) {
+    void *data;
+    uint32_t size = 0;
+    if (type == ZP7_ROARING_BITMAP) {
+        data = malloc(ZP7_ROARING_WORDS * sizeof(uint64_t));
+        if (!data)
+            return ZP7_ROARING_ERR_MEMORY;
+        memcpy(data, words, ZP7_ROARING_WORDS * sizeof(uint64_t));
+    } else if (type == ZP7_ROARING_ARRAY) {
+        // Flatten to 32-bit values, with room for zp7_flatten_64() to
+        // overshoot, then narrow them
+        uint32_t values[ZP7_ROARING_ARRAY_MAX + 8];
+        size = (uint32_t)zp7_flatten_64(values, words, ZP7_ROARING_WORDS);
+        data = malloc(size * sizeof(uint16_t));
+        if (!data)
+            return ZP7_ROARING_ERR_MEMORY;
+        for (uint32_t i = 0; i < size; i++)
+            ((uint16_t *)data)[i] = (uint16_t)values[i];
+    } else {
+        size = words_count_runs(words);
+        uint16_t *runs = (uint16_t *)malloc(size * 2 * sizeof(uint16_t));
+        if (!runs)
+            return ZP7_ROARING_ERR_MEMORY;
+        // Walk the runs by alternately finding the next set and clear bits
+        uint32_t n = 0, pos = 0;
+        while (n < size) {
+            uint64_t w = words[pos >> 6] & (-1ULL << (pos & 63));
+            while (!w)
+                w = words[(pos = (pos | 63) + 1) >> 6];
+            uint32_t start = (pos & ~63) + __builtin_ctzll(w);
+            pos = start;
+            w = ~words[pos >> 6] & (-1ULL << (pos & 63));
+            while (!w && (pos | 63) + 1 < 1 << 16)
+                w = ~words[(pos = (pos | 63) + 1) >> 6];
+            uint32_t end = w ? (pos & ~63) + __builtin_ctzll(w) : 1 << 16;
+            runs[2 * n] = (uint16_t)start;
+            runs[2 * n + 1] = (uint16_t)(end - start - 1);
+            n++;
+            pos = end;
+        }
+        data = runs;
+    }
+    free(c->data);
+    c->data = data;
+    c->type = type;
+    c->card = card;
+    c->size = c->capacity = size;
+    return 0;
+}
+
+static int container_to_bitmap(zp7_container_t *c) {
+    uint64_t tmp[ZP7_ROARING_WORDS];
+    return container_set_words(c, container_words(c, tmp),
+            ZP7_ROARING_BITMAP, c->card);
+}
+
+// Building
+
+int zp7_roaring_add(zp7_roaring_t *r, uint32_t x) {
+    uint16_t key = x >> 16;
+    uint16_t low = x & 0xFFFF;
+    size_t i;
+    if (!roaring_find(r, key, &i)) {
+        if (r->n == r->capacity) {
+            size_t capacity = r->capacity ? 2 * r->capacity : 4;
+            zp7_container_t *containers = (zp7_container_t *)realloc(
+                    r->containers, capacity * sizeof(zp7_container_t));
+            if (!containers)
+                return ZP7_ROARING_ERR_MEMORY;
+            r->containers = containers;
+            r->capacity = capacity;
+        }
+        uint16_t *v = (uint16_t *)malloc(sizeof(uint16_t));
+        if (!v)
+            return ZP7_ROARING_ERR_MEMORY;
+        memmove(&r->containers[i + 1], &r->containers[i],
+                (r->n - i) * sizeof(zp7_container_t));
+        r->n++;
+        zp7_container_t *c = &r->containers[i];
+        v[0] = low;
+        c->key = key;
+        c->type = ZP7_ROARING_ARRAY;
+        c->card = c->size = c->capacity = 1;
+        c->data = v;
+        return 0;
+    }
+
+    zp7_container_t *c = &r->containers[i];
+    if (c->type == ZP7_ROARING_ARRAY) {
+        uint16_t *v = (uint16_t *)c->data;
+        uint32_t pos = array_lower_bound(v, c->size, low);
+        if (pos < c->size && v[pos] == low)
+            return 0;
+        if (c->size < ZP7_ROARING_ARRAY_MAX) {
+            if (c->size == c->capacity) {
+                uint32_t capacity = 2 * c->capacity;
+                if (capacity > ZP7_ROARING_ARRAY_MAX)
+                    capacity = ZP7_ROARING_ARRAY_MAX;
+                v = (uint16_t *)realloc(v, capacity * sizeof(uint16_t));
+                if (!v)
+                    return ZP7_ROARING_ERR_MEMORY;
+                c->data = v;
+                c->capacity = capacity;
+            }
+            memmove(&v[pos + 1], &v[pos], (c->size - pos) * sizeof(uint16_t));
+            v[pos] = low;
+            c->size++;
+            c->card++;
+            return 0;
+        }
+    }
+
+    // Full arrays and runs become bitmaps
+    if (c->type != ZP7_ROARING_BITMAP) {
+        int err = container_to_bitmap(c);
+        if (err)
+            return err;
+    }
+    uint64_t *words = (uint64_t *)c->data;
+    uint64_t bit = 1ULL << (low & 63);
+    c->card += !(words[low >> 6] & bit);
+    words[low >> 6] |= bit;
+    return 0;
+}
+
+// Convert each container to whichever form takes the least memory
+int zp7_roaring_optimize(zp7_roaring_t *r) {
+    for (size_t i = 0; i < r->n; i++) {
+        zp7_container_t *c = &r->containers[i];
+        uint64_t tmp[ZP7_ROARING_WORDS];
+        const uint64_t *words = container_words(c, tmp);
+
+        // Sizes in bytes of each form
+        uint32_t array = c->card <= ZP7_ROARING_ARRAY_MAX ?
+            c->card * 2 : UINT32_MAX;
+        uint32_t bitmap = ZP7_ROARING_WORDS * 8;
+        uint32_t run = words_count_runs(words) * 4;
+        int type = ZP7_ROARING_BITMAP;
+        if (run < array && run < bitmap)
+            type = ZP7_ROARING_RUN;
+        else if (array <= bitmap)
+            type = ZP7_ROARING_ARRAY;
+        if (type == c->type)
+            continue;
+
+        // The new data can't be built from the old data in place
+        if (words == c->data) {
+            memcpy(tmp, words, sizeof(tmp));
+            words = tmp;
+        }
+        int err = container_set_words(c, words, type, c->card);
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+// Queries
+
+int zp7_roaring_contains(const zp7_roaring_t *r, uint32_t x) {
+    size_t i;
+    if (!roaring_find(r, x >> 16, &i))
+        return 0;
+    const zp7_container_t *c = &r->containers[i];
+    uint16_t low = x & 0xFFFF;
+    const uint16_t *v = (const uint16_t *)c->data;
+    if (c->type == ZP7_ROARING_ARRAY) {
+        uint32_t pos = array_lower_bound(v, c->size, low);
+        return pos < c->size && v[pos] == low;
+    } else if (c->type == ZP7_ROARING_BITMAP)
+        return ((const uint64_t *)c->data)[low >> 6] >> (low & 63) & 1;
+    for (uint32_t j = 0; j < c->size && v[2 * j] <= low; j++) {
+        if (low <= v[2 * j] + v[2 * j + 1])
+            return 1;
+    }
+    return 0;
+}
+
+uint64_t zp7_roaring_cardinality(const zp7_roaring_t *r) {
+    uint64_t card = 0;
+    for (size_t i = 0; i < r->n; i++)
+        card += r->containers[i].card;
+    return card;
+}
+
+// Number of values less than or equal to X
+uint64_t zp7_roaring_rank(const zp7_roaring_t *r, uint32_t x) {
+    uint64_t rank = 0;
+    size_t i;
+    int found = roaring_find(r, x >> 16, &i);
+    for (size_t j = 0; j < i; j++)
+        rank += r->containers[j].card;
+    if (!found)
+        return rank;
+
+    const zp7_container_t *c = &r->containers[i];
+    uint32_t low = x & 0xFFFF;
+    const uint16_t *v = (const uint16_t *)c->data;
+    if (c->type == ZP7_ROARING_ARRAY)
+        rank += array_lower_bound(v, c->size, low + 1);
+    else if (c->type == ZP7_ROARING_BITMAP) {
+        const uint64_t *words = (const uint64_t *)c->data;
+        for (uint32_t j = 0; j < low >> 6; j++)
+            rank += popcnt(words[j]);
+        rank += popcnt(words[low >> 6] & (-1ULL >> (63 - (low & 63))));
+    } else {
+        for (uint32_t j = 0; j < c->size && v[2 * j] <= low; j++) {
+            uint32_t end = v[2 * j] + v[2 * j + 1];
+            rank += (low < end ? low : end) - v[2 * j] + 1;
+        }
+    }
+    return rank;
+}
+
+// Find the K'th smallest value (counting from 0), and store it in X
+int zp7_roaring_select(const zp7_roaring_t *r, uint64_t k, uint32_t *x) {
+    size_t i = 0;
+    while (i < r->n && k >= r->containers[i].card)
+        k -= r->containers[i++].card;
+    if (i == r->n)
+        return ZP7_ROARING_ERR_RANGE;
+
+    const zp7_container_t *c = &r->containers[i];
+    const uint16_t *v = (const uint16_t *)c->data;
+    uint32_t low;
+    if (c->type == ZP7_ROARING_ARRAY)
+        low = v[k];
+    else if (c->type == ZP7_ROARING_BITMAP) {
+        const uint64_t *words = (const uint64_t *)c->data;
+        uint32_t j = 0;
+        for (uint64_t pop; k >= (pop = popcnt(words[j])); j++)
+            k -= pop;
+        low = j * 64 + __builtin_ctzll(zp7_pdep_64(1ULL << k, words[j]));
+    } else {
+        uint32_t j = 0;
+        while (k > v[2 * j + 1])
+            k -= v[2 * j + 1] + 1, j++;
+        low = v[2 * j] + (uint32_t)k;
+    }
+    *x = (uint32_t)c->key << 16 | low;
+    return 0;
+}
+
+// Intersections
+
+// Write the values in both A and B to DST, plus BASE, and return how many
+// there are. The writes can overshoot by eight values.
+static size_t container_and_to_list(uint32_t *dst, const zp7_container_t *a,
+        const zp7_container_t *b, uint32_t base) {
+    if (a->type != ZP7_ROARING_ARRAY && b->type == ZP7_ROARING_ARRAY) {
+        const zp7_container_t *t = a;
+        a = b;
+        b = t;
+    }
+    uint64_t tmp_a[ZP7_ROARING_WORDS], tmp_b[ZP7_ROARING_WORDS];
+    size_t n = 0;
+    if (a->type == ZP7_ROARING_ARRAY) {
+        const uint16_t *va = (const uint16_t *)a->data;
+        if (b->type == ZP7_ROARING_ARRAY) {
+            const uint16_t *vb = (const uint16_t *)b->data;
+            uint32_t i = 0, j = 0;
+            while (i < a->size && j < b->size) {
+                if (va[i] < vb[j])
+                    i++;
+                else if (va[i] > vb[j])
+                    j++;
+                else {
+                    dst[n++] = base | va[i];
+                    i++, j++;
+                }
+            }
+            return n;
+        }
+        // Probe the other container's bits, always writing the value but
+        // only keeping it if it's there
+        const uint64_t *words = container_words(b, tmp_b);
+        for (uint32_t i = 0; i < a->size; i++) {
+            dst[n] = base | va[i];
+            n += words[va[i] >> 6] >> (va[i] & 63) & 1;
+        }
+        return n;
+    }
+
+    // Two sets of runs intersect in runs, which can be written out directly
+    // rather than going through bitmaps
+    if (a->type == ZP7_ROARING_RUN && b->type == ZP7_ROARING_RUN) {
+        const uint16_t *ra = (const uint16_t *)a->data;
+        const uint16_t *rb = (const uint16_t *)b->data;
+        uint32_t i = 0, j = 0;
+        while (i < a->size && j < b->size) {
+            uint32_t end_a = ra[2 * i] + ra[2 * i + 1];
+            uint32_t end_b = rb[2 * j] + rb[2 * j + 1];
+            uint32_t lo = ra[2 * i] > rb[2 * j] ? ra[2 * i] : rb[2 * j];
+            uint32_t hi = end_a < end_b ? end_a : end_b;
+            for (uint32_t x = lo; x <= hi; x++)
+                dst[n++] = base | x;
+            i += end_a <= end_b;
+            j += end_b <= end_a;
+        }
+        return n;
+    }
+
+    const uint64_t *wa = container_words(a, tmp_a);
+    const uint64_t *wb = container_words(b, tmp_b);
+    for (int i = 0; i < ZP7_ROARING_WORDS; i++)
+        tmp_a[i] = wa[i] & wb[i];
+    n = zp7_flatten_64(dst, tmp_a, ZP7_ROARING_WORDS);
+    for (size_t i = 0; i < n; i++)
+        dst[i] |= base;
+    return n;
+}
+
+static uint32_t container_and_cardinality(const zp7_container_t *a,
+        const zp7_container_t *b) {
+    if (a->type != ZP7_ROARING_ARRAY && b->type == ZP7_ROARING_ARRAY) {
+        const zp7_container_t *t = a;
+        a = b;
+        b = t;
+    }
+    uint64_t tmp_a[ZP7_ROARING_WORDS], tmp_b[ZP7_ROARING_WORDS];
+    uint32_t card = 0;
+    if (a->type == ZP7_ROARING_ARRAY) {
+        const uint16_t *va = (const uint16_t *)a->data;
+        if (b->type == ZP7_ROARING_ARRAY) {
+            const uint16_t *vb = (const uint16_t *)b->data;
+            uint32_t i = 0, j = 0;
+            while (i < a->size && j < b->size) {
+                card += va[i] == vb[j];
+                uint16_t x = va[i], y = vb[j];
+                i += x <= y;
+                j += y <= x;
+            }
+            return card;
+        }
+        const uint64_t *words = container_words(b, tmp_b);
+        for (uint32_t i = 0; i < a->size; i++)
+            card += words[va[i] >> 6] >> (va[i] & 63) & 1;
+        return card;
+    }
+
+    if (a->type == ZP7_ROARING_RUN && b->type == ZP7_ROARING_RUN) {
+        const uint16_t *ra = (const uint16_t *)a->data;
+        const uint16_t *rb = (const uint16_t *)b->data;
+        uint32_t i = 0, j = 0;
+        while (i < a->size && j < b->size) {
+            uint32_t end_a = ra[2 * i] + ra[2 * i + 1];
+            uint32_t end_b = rb[2 * j] + rb[2 * j + 1];
+            uint32_t lo = ra[2 * i] > rb[2 * j] ? ra[2 * i] : rb[2 * j];
+            uint32_t hi = end_a < end_b ? end_a : end_b;
+            if (lo <= hi)
+                card += hi - lo + 1;
+            i += end_a <= end_b;
+            j += end_b <= end_a;
+        }
+        return card;
+    }
+
+    const uint64_t *wa = container_words(a, tmp_a);
+    const uint64_t *wb = container_words(b, tmp_b);
+    for (int i = 0; i < ZP7_ROARING_WORDS; i++)
+        card += popcnt(wa[i] & wb[i]);
+    return card;
+}
+
+// Write the values in both A and B to DST, in increasing order, and return
+// how many there are. DST needs room for eight values past the end of the
+// intersection; the smaller cardinality of A and B, plus eight, is enough.
+size_t zp7_roaring_and_to_list(uint32_t *dst, const zp7_roaring_t *a,
+        const zp7_roaring_t *b) {
+    size_t n = 0;
+    size_t i = 0, j = 0;
+    while (i < a->n && j < b->n) {
+        const zp7_container_t *ca = &a->containers[i];
+        const zp7_container_t *cb = &b->containers[j];
+        if (ca->key < cb->key)
+            i++;
+        else if (ca->key > cb->key)
+            j++;
+        else {
+            n += container_and_to_list(dst + n, ca, cb,
+                    (uint32_t)ca->key << 16);
+            i++, j++;
+        }
+    }
+    return n;
+}
+
+uint64_t zp7_roaring_and_cardinality(const zp7_roaring_t *a,
+        const zp7_roaring_t *b) {
+    uint64_t card = 0;
+    size_t i = 0, j = 0;
+    while (i < a->n && j < b->n) {
+        const zp7_container_t *ca = &a->containers[i];
+        const zp7_container_t *cb = &b->containers[j];
+        if (ca->key < cb->key)
+            i++;
+        else if (ca->key > cb->key)
+            j++;
+        else {
+            card += container_and_cardinality(ca, cb);
+            i++, j++;
+        }
+    }
+    return card;
+}
+
+#endif
@@ -0,0 +1,171 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef ZP7_SCAN_C
+#define ZP7_SCAN_C
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zp7.c"
+
+// Scans of bit-packed columns
+//
+// This evaluates predicates on a column of K-bit codes without unpacking
+// them, in the style of BitWeaving/H. The codes are packed into 64-bit words
+// in fields of K+1 bits, as many as fit, with the top bit of each field (the
+// delimiter) left clear. Adding two words of fields then can't carry from
+// one field into the next: the carry out of each K-bit code lands in its
+// delimiter bit instead. So with C replicated into every field, and ONES
+// being K one bits in every field:
+//
+//   * X > C:  (X + (C ^ ONES)) sets the delimiter, since X + 2^K-1 - C
+//             carries out of K bits exactly when X > C
+//   * X < C:  (C + (X ^ ONES)) sets the delimiter, by symmetry
+//   * X == C: ((X ^ C) + ONES) sets the delimiter when X != C
+//
+// and BETWEEN is the AND of two of these. That gives one result bit per code,
+// in the delimiter positions, for the cost of a few instructions per word. A
+// PEXT with the delimiter bits as the mask then packs them into one bit per
+// code. The mask is the same for every word, so its PPP is computed once, and
+// the extraction is done in blocks with the bulk kernels.
+
+// Predicates, comparing each code X to LO (and HI)
+#define ZP7_SCAN_EQ                 (0)
+#define ZP7_SCAN_LT                 (1)
+#define ZP7_SCAN_GT                 (2)
+// LO <= X <= HI
+#define ZP7_SCAN_BETWEEN            (3)
+
+// Error codes. zp7_scan_64() returns 0 on success, or one of these
+#define ZP7_SCAN_ERR_BITS           (-1)
+#define ZP7_SCAN_ERR_OP             (-2)
+
+// Words scanned at a time
+#define ZP7_SCAN_BLOCK              (256)
+
+// Number of CODE_BITS-bit codes in each word, for CODE_BITS from 1 to 32
+static inline int zp7_scan_per_word(int code_bits) {
+    return 64 / (code_bits + 1);
+}
+
+// Number of words needed for N codes
+size_t zp7_scan_words(size_t n, int code_bits) {
+    size_t per_word = zp7_scan_per_word(code_bits);
+    return (n + per_word - 1) / per_word;
+}
+
+// Replicate X into every field of a word
+static inline uint64_t scan_replicate(uint64_t x, int code_bits) {
+    uint64_t r = 0;
+    for (int f = 0; f < zp7_scan_per_word(code_bits); f++)
+        r |= x << (f * (code_bits + 1));
+    return r;
+}
+
+// Pack N codes of CODE_BITS bits into DST, which needs zp7_scan_words()
+// words. Unused fields in the last word are zero.
+void zp7_scan_pack(uint64_t *dst, const uint32_t *codes, size_t n,
+        int code_bits) {
+    int per_word = zp7_scan_per_word(code_bits);
+    uint64_t code_mask = (1ULL << code_bits) - 1;
+    for (size_t w = 0, i = 0; i < n; w++) {
+        uint64_t x = 0;
+        for (int f = 0; f < per_word && i < n; f++, i++)
+            x |= (codes[i] & code_mask) << (f * (code_bits + 1));
+        dst[w] = x;
+    }
+}
+
+// Evaluate predicate OP on each of the N codes in PACKED, and write the
+// results to RESULT, one bit per code. Bits past the last code in the last
+// word are cleared. CODE_BITS must be from 1 to 32.
+int zp7_scan_64(uint64_t *result, const uint64_t *packed, size_t n,
+        int code_bits, int op, uint32_t lo, uint32_t hi) {
+    if (code_bits < 1 || code_bits > 32)
+        return ZP7_SCAN_ERR_BITS;
+    if (op < ZP7_SCAN_EQ || op > ZP7_SCAN_BETWEEN)
+        return ZP7_SCAN_ERR_OP;
+
+    int per_word = zp7_scan_per_word(code_bits);
+    uint64_t code_mask = (1ULL << code_bits) - 1;
+    uint64_t ones = scan_replicate(code_mask, code_bits);
+    uint64_t delim = scan_replicate(1ULL << code_bits, code_bits);
+    uint64_t lo_rep = scan_replicate(lo & code_mask, code_bits);
+    uint64_t hi_rep = scan_replicate(hi & code_mask, code_bits);
+    zp7_masks_64_t masks = zp7_ppp_64(delim);
+
+    size_t n_words = zp7_scan_words(n, code_bits);
+    uint64_t block[ZP7_SCAN_BLOCK];
+    uint64_t acc = 0;
+    int acc_bits = 0;
+    for (size_t b = 0; b < n_words; b += ZP7_SCAN_BLOCK) {
+        size_t len = n_words - b < ZP7_SCAN_BLOCK ? n_words - b :
+            ZP7_SCAN_BLOCK;
+        const uint64_t *x = packed + b;
+        switch (op) {
+            case ZP7_SCAN_EQ:
+                for (size_t i = 0; i < len; i++)
+                    block[i] = ~((x[i] ^ lo_rep) + ones) & delim;
+                break;
+            case ZP7_SCAN_LT:
+                for (size_t i = 0; i < len; i++)
+                    block[i] = (lo_rep + (x[i] ^ ones)) & delim;
+                break;
+            case ZP7_SCAN_GT:
+                for (size_t i = 0; i < len; i++)
+                    block[i] = (x[i] + (lo_rep ^ ones)) & delim;
+                break;
+            case ZP7_SCAN_BETWEEN:
+                // Neither X < LO nor X > HI
+                for (size_t i = 0; i < len; i++)
+                    block[i] = ~((lo_rep + (x[i] ^ ones)) |
+                            (x[i] + (hi_rep ^ ones))) & delim;
+                break;
+        }
+        zp7_pext_pre_array_64(block, block, len, &masks);
+
+        // Pack the PER_WORD result bits of each word together. The last
+        // word can have padding fields past the last code, which are left
+        // out.
+        for (size_t i = 0; i < len; i++) {
+            uint64_t r = block[i];
+            int bits = per_word;
+            if (b + i == n_words - 1) {
+                bits = (int)(n - (n_words - 1) * per_word);
+                r &= -1ULL >> (64 - bits);
+            }
+            acc |= r << acc_bits;
+            acc_bits += bits;
+            if (acc_bits >= 64) {
+                *result++ = acc;
+                acc_bits -= 64;
+                acc = acc_bits ? r >> (bits - acc_bits) : 0;
+            }
+        }
+    }
+    if (acc_bits > 0)
+        *result = acc;
+    return 0;
+}
+
+#endif
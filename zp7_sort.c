@@ -0,0 +1,126 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef ZP7_SORT_C
+#define ZP7_SORT_C
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zp7.c"
+
+// Radix sort by scattered key bits
+//
+// This sorts 64-bit values by the bits selected by a key mask, that is, by
+// PEXT(value, mask), with an LSD radix sort. The key is never stored: the
+// mask's PPP is computed once, and every pass extracts the keys again, a
+// block at a time into a small buffer with zp7_pext_pre_array_64(), so the
+// extraction uses the fastest bulk kernel available and stays in cache. The
+// first pass builds the histograms of every digit at once, right after
+// extracting each block, and then each digit takes one pass that extracts
+// the keys and scatters the values. Digits where all the values agree are
+// skipped.
+//
+// The digit size trades the number of passes against the histogram size:
+// 8-bit digits keep the histogram in L1, while 11-bit digits take
+// ceil(bits / 11) passes instead of ceil(bits / 8). That saves a pass for
+// keys of 9-11, 17-22 or 25-32 bits, and two passes for 33 bits, 41-44
+// bits, and so on.
+
+#define ZP7_SORT_MAX_DIGIT_BITS     (11)
+
+// Keys extracted at a time
+#define ZP7_SORT_BLOCK              (256)
+
+// Error codes. All functions return 0 on success, or one of these
+#define ZP7_SORT_ERR_DIGIT          (-1)
+#define ZP7_SORT_ERR_MEMORY         (-2)
+
+// Stably sort the N values in DATA by PEXT(value, MASK), using DIGIT_BITS
+// bits (1 to ZP7_SORT_MAX_DIGIT_BITS) per pass. TMP needs room for N values.
+int zp7_radix_sort_64(uint64_t *data, uint64_t *tmp, size_t n, uint64_t mask,
+        int digit_bits) {
+    if (digit_bits < 1 || digit_bits > ZP7_SORT_MAX_DIGIT_BITS)
+        return ZP7_SORT_ERR_DIGIT;
+    int key_bits = (int)popcnt(mask);
+    int n_digits = (key_bits + digit_bits - 1) / digit_bits;
+    size_t n_buckets = (size_t)1 << digit_bits;
+    uint64_t digit_mask = n_buckets - 1;
+    if (n_digits == 0 || n < 2)
+        return 0;
+    size_t *counts = (size_t *)calloc(n_digits * n_buckets, sizeof(size_t));
+    if (!counts)
+        return ZP7_SORT_ERR_MEMORY;
+
+    zp7_masks_64_t masks = zp7_ppp_64(mask);
+    uint64_t keys[ZP7_SORT_BLOCK];
+
+    // Histograms of every digit
+    for (size_t b = 0; b < n; b += ZP7_SORT_BLOCK) {
+        size_t len = n - b < ZP7_SORT_BLOCK ? n - b : ZP7_SORT_BLOCK;
+        zp7_pext_pre_array_64(keys, data + b, len, &masks);
+        for (int d = 0; d < n_digits; d++) {
+            size_t *count = counts + d * n_buckets;
+            int shift = d * digit_bits;
+            for (size_t i = 0; i < len; i++)
+                count[keys[i] >> shift & digit_mask]++;
+        }
+    }
+
+    uint64_t *src = data, *dst = tmp;
+    for (int d = 0; d < n_digits; d++) {
+        size_t *count = counts + d * n_buckets;
+        int shift = d * digit_bits;
+
+        // Turn the counts into starting offsets, skipping the digit if it's
+        // the same everywhere
+        size_t offset = 0;
+        int skip = 0;
+        for (size_t j = 0; j < n_buckets; j++) {
+            size_t c = count[j];
+            skip |= c == n;
+            count[j] = offset;
+            offset += c;
+        }
+        if (skip)
+            continue;
+
+        for (size_t b = 0; b < n; b += ZP7_SORT_BLOCK) {
+            size_t len = n - b < ZP7_SORT_BLOCK ? n - b : ZP7_SORT_BLOCK;
+            zp7_pext_pre_array_64(keys, src + b, len, &masks);
+            for (size_t i = 0; i < len; i++)
+                dst[count[keys[i] >> shift & digit_mask]++] = src[b + i];
+        }
+        uint64_t *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != data)
+        memcpy(data, src, n * sizeof(uint64_t));
+
+    free(counts);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,230 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef ZP7_TABLE_C
+#define ZP7_TABLE_C
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "zp7.c"
+
+// Precomputed mask tables on disk
+//
+// Computing zp7_masks_64_t for millions of masks at startup is wasted work
+// when the masks don't change between runs. This file defines a simple file
+// format for arrays of precomputed masks: a fixed 64-byte header followed
+// directly by the raw zp7_masks_64_t structs. The loader maps the file
+// read-only with mmap, so the masks are used in place (no copy, no PPP), and
+// every process mapping the same file shares the same physical pages through
+// the page cache.
+//
+// The header layout is, in native byte order:
+//
+//     offset  size  field
+//     0       8     magic, "ZP7MASKS"
+//     8       4     format version (ZP7_TABLE_VERSION)
+//     12      4     byte order mark, 0x01020304 as written by the host
+//     16      4     width in bits of each mask (64)
+//     20      4     layout of the entries (ZP7_TABLE_LAYOUT_*)
+//     24      4     size in bytes of one entry
+//     28      4     reserved, zero
+//     32      8     number of entries
+//     40      8     checksum of the entry data
+//     48      16    reserved, zero
+//
+// The entries start at offset 64, so they are cache-line aligned in the
+// mapping. The format is not meant to be portable across byte orders: a file
+// written on a big-endian host is rejected on a little-endian one (and vice
+// versa) rather than silently byte-swapped, since swapping would defeat the
+// zero-copy mapping.
+
+#define ZP7_TABLE_MAGIC             "ZP7MASKS"
+#define ZP7_TABLE_VERSION           (1)
+#define ZP7_TABLE_BOM               (0x01020304U)
+#define ZP7_TABLE_HEADER_SIZE       (64)
+
+// Entries are stored as an array of zp7_masks_64_t: the mask followed by its
+// N_BITS PPP values, or on 32-bit hosts, the PPP values and popcounts for each
+// half of the mask. The two have the same size, so the layout field is what
+// keeps a table from one being loaded on the other.
+#define ZP7_TABLE_LAYOUT_AOS        (1)
+#define ZP7_TABLE_LAYOUT_AOS_32     (2)
+
+#ifdef ZP7_32BIT
+#   define ZP7_TABLE_LAYOUT         ZP7_TABLE_LAYOUT_AOS_32
+#else
+#   define ZP7_TABLE_LAYOUT         ZP7_TABLE_LAYOUT_AOS
+#endif
+
+// Flags for zp7_table_open()
+#define ZP7_TABLE_NO_VERIFY         (1 << 0)
+
+// Error codes. All functions return 0 on success, or one of these
+#define ZP7_TABLE_ERR_IO            (-1)
+#define ZP7_TABLE_ERR_FORMAT        (-2)
+#define ZP7_TABLE_ERR_VERSION       (-3)
+#define ZP7_TABLE_ERR_LAYOUT        (-4)
+#define ZP7_TABLE_ERR_CHECKSUM      (-5)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t bom;
+    uint32_t width;
+    uint32_t layout;
+    uint32_t entry_size;
+    uint32_t reserved_0;
+    uint64_t count;
+    uint64_t checksum;
+    uint64_t reserved_1[2];
+} zp7_table_header_t;
+
+// Make sure the struct matches the on-disk layout
+typedef char zp7_table_header_size_check[
+    sizeof(zp7_table_header_t) == ZP7_TABLE_HEADER_SIZE ? 1 : -1];
+
+typedef struct {
+    // The entries, pointing into the read-only mapping
+    const zp7_masks_64_t *masks;
+    uint64_t count;
+
+    // The whole mapping, for zp7_table_close()
+    void *map;
+    size_t map_size;
+} zp7_table_t;
+
+// The checksum is 64-bit FNV-1a, but over 64-bit words instead of bytes. The
+// entry data is always a multiple of 8 bytes, and this is about 8x faster
+// than the bytewise version while still catching truncation and bit flips.
+static uint64_t zp7_table_checksum(const zp7_masks_64_t *masks,
+        uint64_t count) {
+    const uint64_t *words = (const uint64_t *)masks;
+    uint64_t n_words = count * (sizeof(zp7_masks_64_t) / sizeof(uint64_t));
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (uint64_t i = 0; i < n_words; i++) {
+        hash ^= words[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Write COUNT precomputed masks to a table file at PATH
+int zp7_table_write(const char *path, const zp7_masks_64_t *masks,
+        uint64_t count) {
+    zp7_table_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ZP7_TABLE_MAGIC, sizeof(header.magic));
+    header.version = ZP7_TABLE_VERSION;
+    header.bom = ZP7_TABLE_BOM;
+    header.width = 64;
+    header.layout = ZP7_TABLE_LAYOUT;
+    header.entry_size = sizeof(zp7_masks_64_t);
+    header.count = count;
+    header.checksum = zp7_table_checksum(masks, count);
+
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return ZP7_TABLE_ERR_IO;
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        (count == 0 ||
+         fwrite(masks, sizeof(zp7_masks_64_t), count, f) == count);
+    if (fclose(f) != 0 || !ok)
+        return ZP7_TABLE_ERR_IO;
+    return 0;
+}
+
+// Map a table file at PATH read-only. On success, TABLE->masks points to
+// TABLE->count precomputed masks that can be passed directly to
+// zp7_pext_pre_64()/zp7_pdep_pre_64(). The checksum is verified unless
+// ZP7_TABLE_NO_VERIFY is passed in FLAGS; skipping it avoids touching every
+// page at startup, for callers that trust the file.
+int zp7_table_open(const char *path, zp7_table_t *table, int flags) {
+    memset(table, 0, sizeof(*table));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return ZP7_TABLE_ERR_IO;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return ZP7_TABLE_ERR_IO;
+    }
+    if ((uint64_t)st.st_size < ZP7_TABLE_HEADER_SIZE) {
+        close(fd);
+        return ZP7_TABLE_ERR_FORMAT;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping holds its own reference to the file
+    close(fd);
+    if (map == MAP_FAILED)
+        return ZP7_TABLE_ERR_IO;
+
+    const zp7_table_header_t *header = (const zp7_table_header_t *)map;
+    const zp7_masks_64_t *masks = (const zp7_masks_64_t *)
+        ((const char *)map + ZP7_TABLE_HEADER_SIZE);
+    uint64_t max_count = (size - ZP7_TABLE_HEADER_SIZE) /
+        sizeof(zp7_masks_64_t);
+
+    int err = 0;
+    if (memcmp(header->magic, ZP7_TABLE_MAGIC, sizeof(header->magic)) ||
+            header->bom != ZP7_TABLE_BOM)
+        err = ZP7_TABLE_ERR_FORMAT;
+    else if (header->version != ZP7_TABLE_VERSION)
+        err = ZP7_TABLE_ERR_VERSION;
+    else if (header->width != 64 || header->layout != ZP7_TABLE_LAYOUT ||
+            header->entry_size != sizeof(zp7_masks_64_t))
+        err = ZP7_TABLE_ERR_LAYOUT;
+    else if (header->count > max_count)
+        err = ZP7_TABLE_ERR_FORMAT;
+    else if (!(flags & ZP7_TABLE_NO_VERIFY) &&
+            zp7_table_checksum(masks, header->count) != header->checksum)
+        err = ZP7_TABLE_ERR_CHECKSUM;
+
+    if (err) {
+        munmap(map, size);
+        return err;
+    }
+
+    table->masks = masks;
+    table->count = header->count;
+    table->map = map;
+    table->map_size = size;
+    return 0;
+}
+
+void zp7_table_close(zp7_table_t *table) {
+    if (table->map)
+        munmap(table->map, table->map_size);
+    memset(table, 0, sizeof(*table));
+}
+
+#endif
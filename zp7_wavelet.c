@@ -0,0 +1,296 @@
+// ZP7 (Zach's Peppy Parallel-Prefix-Popcountin' PEXT/PDEP Polyfill)
+//
+// Copyright (c) 2020 Zach Wegner
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef ZP7_WAVELET_C
+#define ZP7_WAVELET_C
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zp7.c"
+
+// Wavelet matrix
+//
+// A wavelet matrix stores a sequence of N symbols of N_BITS bits as N_BITS
+// bit vectors of length N, one per level, and answers access (the I'th
+// symbol), rank (occurrences of a symbol before position I) and select
+// (position of the K'th occurrence of a symbol) in N_BITS steps each. Level 0
+// holds the top bit of each symbol. Each level after that holds the next bit
+// down, with the symbols stably partitioned by the bit of the level above:
+// first those where it was clear, then those where it was set.
+//
+// Construction works on the symbols sliced into bit planes, one bit vector
+// for each bit of the symbols. Level L is just the current plane of its bit,
+// and partitioning by it is a sheep-and-goats operation on each of the lower
+// planes: for each word, PEXT with the inverse of the level's word gathers
+// the bits that go first, and PEXT with the word itself gathers the rest,
+// and these get appended to the two halves of the next plane. Every plane
+// uses the same two masks for a given word, so the PPP for each is only done
+// once per word and level.
+//
+// Rank within a level uses a popcount directory with an entry every
+// ZP7_WAVELET_BLOCK words. Select finds the right word with the directory,
+// and then the position of the K'th set bit in the word is the trailing zero
+// count of PDEP(1 << K, word).
+
+#define ZP7_WAVELET_BLOCK           (8)
+
+// Error codes. Functions that can fail return 0 on success, or one of these
+#define ZP7_WAVELET_ERR_MEMORY      (-1)
+#define ZP7_WAVELET_ERR_RANGE       (-2)
+
+typedef struct {
+    size_t n;
+    int n_bits;
+    // Words in each level, with a zero word at the end so rank can look one
+    // word past the last bit
+    size_t stride;
+    uint64_t *levels;
+    // Number of set bits in each level before every block of words
+    size_t rank_stride;
+    uint64_t *ranks;
+    // Number of clear bits in each level
+    size_t zeros[32];
+} zp7_wavelet_t;
+
+void zp7_wavelet_free(zp7_wavelet_t *wm) {
+    free(wm->levels);
+    free(wm->ranks);
+    memset(wm, 0, sizeof(*wm));
+}
+
+// Transpose an 8x8 bit matrix, with row R in byte R
+static inline uint64_t wavelet_transpose_8x8(uint64_t x) {
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x ^= t ^ (t << 28);
+    return x;
+}
+
+// Slice N_BITS-bit SYMBOLS into bit planes, each STRIDE words apart. Each
+// group of eight symbols is done a byte at a time with a transpose, which
+// gives the eight symbols' bits for eight planes at once.
+static void wavelet_slice(uint64_t *planes, size_t stride,
+        const uint32_t *symbols, size_t n, int n_bits) {
+    for (size_t i = 0; i < n; i += 8) {
+        uint32_t s[8] = { 0 };
+        memcpy(s, symbols + i, (n - i < 8 ? n - i : 8) * sizeof(uint32_t));
+        size_t w = i / 64;
+        int shift = i % 64;
+        for (int b = 0; b < n_bits; b += 8) {
+            uint64_t x = 0;
+            for (int k = 0; k < 8; k++)
+                x |= (uint64_t)(s[k] >> b & 0xFF) << (8 * k);
+            x = wavelet_transpose_8x8(x);
+            for (int j = 0; j < 8 && b + j < n_bits; j++)
+                planes[(b + j) * stride + w] |= (x >> (8 * j) & 0xFF) << shift;
+        }
+    }
+}
+
+// OR the bits of X into DST at bit POS. The word after the one at POS is
+// always written, so DST needs a spare word at the end.
+static inline void wavelet_append(uint64_t *dst, size_t pos, uint64_t x) {
+    dst[pos / 64] |= x << (pos % 64);
+    // Shifting by 64 would be undefined, so shift twice
+    dst[pos / 64 + 1] |= x >> (63 - pos % 64) >> 1;
+}
+
+// Build a wavelet matrix for the N symbols in SYMBOLS, each below 2^N_BITS.
+// N_BITS must be from 1 to 32.
+int zp7_wavelet_build(zp7_wavelet_t *wm, const uint32_t *symbols, size_t n,
+        int n_bits) {
+    memset(wm, 0, sizeof(*wm));
+    if (n_bits < 1 || n_bits > 32)
+        return ZP7_WAVELET_ERR_RANGE;
+    wm->n = n;
+    wm->n_bits = n_bits;
+    size_t n_words = (n + 63) / 64;
+    size_t stride = wm->stride = n_words + 1;
+    wm->rank_stride = (stride + ZP7_WAVELET_BLOCK - 1) / ZP7_WAVELET_BLOCK;
+    wm->levels = (uint64_t *)malloc(n_bits * stride * sizeof(uint64_t));
+    wm->ranks = (uint64_t *)malloc(n_bits * wm->rank_stride *
+            sizeof(uint64_t));
+    // The current and next sets of planes. Each level leaves one plane fewer
+    // to partition, but the two sets swap after every level, so both are
+    // allocated with room for all of them.
+    uint64_t *cur = (uint64_t *)calloc(n_bits * stride, sizeof(uint64_t));
+    uint64_t *next = (uint64_t *)malloc(n_bits * stride * sizeof(uint64_t));
+    if (!wm->levels || !wm->ranks || !cur || !next) {
+        free(cur);
+        free(next);
+        zp7_wavelet_free(wm);
+        return ZP7_WAVELET_ERR_MEMORY;
+    }
+    wavelet_slice(cur, stride, symbols, n, n_bits);
+
+    // Mask of the valid bits in the last word
+    uint64_t last = n % 64 ? (1ULL << (n % 64)) - 1 : -1ULL;
+
+    for (int l = 0; l < n_bits; l++) {
+        int bit = n_bits - 1 - l;
+        const uint64_t *b = cur + bit * stride;
+        uint64_t *level = wm->levels + l * stride;
+        uint64_t *ranks = wm->ranks + l * wm->rank_stride;
+        memcpy(level, b, stride * sizeof(uint64_t));
+        uint64_t ones = 0;
+        for (size_t w = 0; w < stride; w++) {
+            if (w % ZP7_WAVELET_BLOCK == 0)
+                ranks[w / ZP7_WAVELET_BLOCK] = ones;
+            ones += popcnt(level[w]);
+        }
+        wm->zeros[l] = n - ones;
+        if (bit == 0)
+            break;
+
+        // Partition the lower planes into NEXT, clear bits first
+        memset(next, 0, bit * stride * sizeof(uint64_t));
+        size_t pos_0 = 0, pos_1 = wm->zeros[l];
+        for (size_t w = 0; w < n_words; w++) {
+            uint64_t m_1 = b[w];
+            uint64_t m_0 = ~m_1 & (w == n_words - 1 ? last : -1ULL);
+            zp7_masks_64_t masks_0 = zp7_ppp_64(m_0);
+            zp7_masks_64_t masks_1 = zp7_ppp_64(m_1);
+            for (int j = 0; j < bit; j++) {
+                uint64_t x = cur[j * stride + w];
+                wavelet_append(next + j * stride, pos_0,
+                        zp7_pext_pre_64(x, &masks_0));
+                wavelet_append(next + j * stride, pos_1,
+                        zp7_pext_pre_64(x, &masks_1));
+            }
+            pos_0 += popcnt(m_0);
+            pos_1 += popcnt(m_1);
+        }
+        uint64_t *t = cur;
+        cur = next;
+        next = t;
+    }
+
+    free(cur);
+    free(next);
+    return 0;
+}
+
+// Number of set bits in level L before position I
+static inline size_t wavelet_rank_1(const zp7_wavelet_t *wm, int l,
+        size_t i) {
+    const uint64_t *level = wm->levels + l * wm->stride;
+    size_t w = i / 64;
+    size_t b = w / ZP7_WAVELET_BLOCK;
+    size_t rank = wm->ranks[l * wm->rank_stride + b];
+    for (size_t j = b * ZP7_WAVELET_BLOCK; j < w; j++)
+        rank += popcnt(level[j]);
+    return rank + popcnt(level[w] & ((1ULL << (i % 64)) - 1));
+}
+
+// Position of the K'th set bit in level L, or clear bit if ZERO is set.
+// There must be more than K of them.
+static size_t wavelet_select(const zp7_wavelet_t *wm, int l, size_t k,
+        int zero) {
+    const uint64_t *level = wm->levels + l * wm->stride;
+    const uint64_t *ranks = wm->ranks + l * wm->rank_stride;
+    uint64_t flip = -(uint64_t)zero;
+    size_t block_bits = 64 * ZP7_WAVELET_BLOCK;
+
+    // Find the last block that starts with at most K bits before it
+    size_t lo = 0, hi = wm->rank_stride;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        size_t before = zero ? mid * block_bits - ranks[mid] : ranks[mid];
+        if (before <= k)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    k -= zero ? lo * block_bits - ranks[lo] : ranks[lo];
+
+    size_t w = lo * ZP7_WAVELET_BLOCK;
+    uint64_t x;
+    for (uint64_t pop; k >= (pop = popcnt(x = level[w] ^ flip)); w++)
+        k -= pop;
+    return w * 64 + __builtin_ctzll(zp7_pdep_64(1ULL << k, x));
+}
+
+// The I'th symbol
+uint32_t zp7_wavelet_access(const zp7_wavelet_t *wm, size_t i) {
+    uint32_t c = 0;
+    for (int l = 0; l < wm->n_bits; l++) {
+        const uint64_t *level = wm->levels + l * wm->stride;
+        uint32_t b = level[i / 64] >> (i % 64) & 1;
+        size_t rank = wavelet_rank_1(wm, l, i);
+        i = b ? wm->zeros[l] + rank : i - rank;
+        c = c << 1 | b;
+    }
+    return c;
+}
+
+// Follow the range [START, END) down through the levels for symbol C
+static void wavelet_range(const zp7_wavelet_t *wm, uint32_t c, size_t *start,
+        size_t *end) {
+    for (int l = 0; l < wm->n_bits; l++) {
+        size_t rank_s = wavelet_rank_1(wm, l, *start);
+        size_t rank_e = wavelet_rank_1(wm, l, *end);
+        if (c >> (wm->n_bits - 1 - l) & 1) {
+            *start = wm->zeros[l] + rank_s;
+            *end = wm->zeros[l] + rank_e;
+        } else {
+            *start -= rank_s;
+            *end -= rank_e;
+        }
+    }
+}
+
+// Number of occurrences of C before position I
+size_t zp7_wavelet_rank(const zp7_wavelet_t *wm, uint32_t c, size_t i) {
+    size_t start = 0, end = i;
+    wavelet_range(wm, c, &start, &end);
+    return end - start;
+}
+
+// Find the position of the K'th occurrence of C (counting from 0), and
+// store it in I
+int zp7_wavelet_select(const zp7_wavelet_t *wm, uint32_t c, size_t k,
+        size_t *i) {
+    // Find where the occurrences of C end up on the last level, then
+    // follow the K'th back up
+    size_t start = 0, end = wm->n;
+    wavelet_range(wm, c, &start, &end);
+    if (k >= end - start)
+        return ZP7_WAVELET_ERR_RANGE;
+    size_t pos = start + k;
+    for (int l = wm->n_bits - 1; l >= 0; l--) {
+        if (c >> (wm->n_bits - 1 - l) & 1)
+            pos = wavelet_select(wm, l, pos - wm->zeros[l], 0);
+        else
+            pos = wavelet_select(wm, l, pos, 1);
+    }
+    *i = pos;
+    return 0;
+}
+
+#endif